@@ -0,0 +1,117 @@
+/*
+ * gllabel-bake: Prepares glyphs ahead of time and writes them to an atlas
+ * cache file, which can then be loaded at runtime with
+ * GLFontManager::LoadAtlasCache() to skip all glyph preparation at startup.
+ * Depends on GLEW, GLM, FreeType2, and C++11. Does not need a GL context.
+ *
+ * Usage: gllabel-bake [-r FIRST-LAST]... [-s PIXELS] OUTPUT FONT...
+ *
+ * Each -r adds an inclusive range of codepoints (decimal or 0x-prefixed hex)
+ * to bake for every font. If no ranges are given, printable ASCII is baked.
+ * -s sets the size, in pixels per em, that cubic curves are approximated for
+ * (see GLFontManager::SetCubicTargetSize).
+ */
+
+#include <gllabel.hpp>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <utility>
+
+static void usage()
+{
+	std::cerr << "Usage: gllabel-bake [-r FIRST-LAST]... [-s PIXELS] OUTPUT FONT...\n";
+}
+
+static bool parse_range(const char *arg, std::pair<uint32_t, uint32_t> *range)
+{
+	char *end;
+	range->first = strtoul(arg, &end, 0);
+	if (end == arg || *end != '-') {
+		return false;
+	}
+
+	const char *second = end + 1;
+	range->second = strtoul(second, &end, 0);
+	return end != second && *end == '\0' && range->first <= range->second;
+}
+
+static bool parse_size(const char *arg, float *size)
+{
+	char *end;
+	*size = strtof(arg, &end);
+	return end != arg && *end == '\0' && *size > 0;
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<std::pair<uint32_t, uint32_t>> ranges;
+	float cubicTargetSize = 0;
+
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; i++) {
+		if (i + 1 >= argc) {
+			usage();
+			return 1;
+		}
+
+		std::pair<uint32_t, uint32_t> range;
+		bool ok;
+		if (strcmp(argv[i], "-r") == 0) {
+			ok = parse_range(argv[i + 1], &range);
+			ranges.push_back(range);
+		} else {
+			ok = strcmp(argv[i], "-s") == 0 && parse_size(argv[i + 1], &cubicTargetSize);
+		}
+		if (!ok) {
+			usage();
+			return 1;
+		}
+		i++;
+	}
+
+	if (argc - i < 2) {
+		usage();
+		return 1;
+	}
+	if (ranges.empty()) {
+		ranges.push_back(std::make_pair(32, 127));
+	}
+
+	const char *outputPath = argv[i++];
+	auto manager = GLFontManager::GetFontManager();
+	manager->SetCubicTargetSize(cubicTargetSize);
+
+	for (; i < argc; i++) {
+		FT_Face face = manager->GetFontFromPath(argv[i]);
+		if (!face) {
+			std::cerr << "Failed to load font " << argv[i] << "\n";
+			return 1;
+		}
+
+		size_t count = 0;
+		manager->GetGlyphForIndex(face, 0);
+		for (auto &range : ranges) {
+			for (uint64_t point = range.first; point <= range.second; point++) {
+				// Codepoints the face doesn't have share the missing
+				// glyph, which is already loaded
+				if (FT_Get_Char_Index(face, point) == 0) {
+					continue;
+				}
+				if (manager->GetGlyphForCodepoint(face, point)) {
+					count++;
+				}
+			}
+		}
+
+		std::cout << argv[i] << ": " << count << " glyphs\n";
+	}
+
+	if (!manager->SaveAtlasCache(outputPath)) {
+		return 1;
+	}
+
+	std::cout << "Wrote " << manager->atlases.size() << " atlases to "
+		<< outputPath << "\n";
+	return 0;
+}
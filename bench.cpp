@@ -0,0 +1,609 @@
+/*
+ * gllabel-bench: Microbenchmarks for glyph preparation, text editing,
+ * uploads, and drawing. Depends on GLEW, GLM, FreeType2, C++14, and either
+ * GLFW3 (for a hidden window) or EGL (for a headless context, if built
+ * with BENCH_EGL). Drawing is done into an offscreen framebuffer and timed
+ * on the GPU with timer queries.
+ *
+ * Usage: bench [FILTER]
+ *
+ * Only benchmarks whose name contains FILTER are run. Each result is
+ * printed to stdout as one JSON object per line:
+ *
+ *   {"name": "vgrid_build", "iterations": 95000, "ns_per_op": 812.4}
+ *
+ * ns_per_op is the median over several batches. GPU benchmarks also
+ * report gpu_ns_per_op. Progress and errors go to stderr.
+ */
+
+#include <gllabel.hpp>
+#include "lib/glyph_prep.hpp"
+#include "lib/outline.hpp"
+#include "lib/vgrid.hpp"
+#include "lib/atlas.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <glm/gtc/matrix_transform.hpp>
+
+#ifdef BENCH_EGL
+#include <EGL/egl.h>
+#else
+#include <glfw3.h>
+#endif
+
+static const char *kFontPath = "fonts/LiberationSans-Regular.ttf";
+
+// Each benchmark runs in kBatches batches, each at least kMinBatchNs long
+static const int kBatches = 5;
+static const uint64_t kMinBatchNs = 20 * 1000 * 1000;
+
+static const char *filter = "";
+
+// Results that are only computed to be timed are added to this, so that
+// they aren't optimized away
+static volatile size_t sink;
+
+typedef std::chrono::steady_clock Clock;
+
+static uint64_t elapsed_ns(Clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+static bool selected(const std::string &name)
+{
+	return name.find(filter) != std::string::npos;
+}
+
+static void report(
+	const std::string &name,
+	uint64_t iterations,
+	double nsPerOp,
+	double gpuNsPerOp = -1,
+	const std::string &extra = "")
+{
+	std::cout << "{\"name\": \"" << name << "\""
+		<< ", \"iterations\": " << iterations
+		<< ", \"ns_per_op\": " << nsPerOp;
+	if (gpuNsPerOp >= 0) {
+		std::cout << ", \"gpu_ns_per_op\": " << gpuNsPerOp;
+	}
+	std::cout << extra << "}" << std::endl;
+}
+
+static double median(std::vector<double> values)
+{
+	std::sort(values.begin(), values.end());
+	return values[values.size() / 2];
+}
+
+// Times op(n), which must do n calls of opsPerCall operations each. n is
+// doubled until a batch takes at least kMinBatchNs, and then the median
+// time per operation over kBatches batches is reported.
+template<typename Op>
+static void run(const std::string &name, uint64_t opsPerCall, Op op)
+{
+	if (!selected(name)) {
+		return;
+	}
+	std::cerr << name << "\n";
+
+	uint64_t n = 1;
+	for (;;) {
+		Clock::time_point start = Clock::now();
+		op(n);
+		if (elapsed_ns(start) >= kMinBatchNs || n >= (1ull << 30)) {
+			break;
+		}
+		n *= 2;
+	}
+
+	std::vector<double> nsPerOp;
+	for (int b = 0; b < kBatches; b++) {
+		Clock::time_point start = Clock::now();
+		op(n);
+		nsPerOp.push_back((double)elapsed_ns(start) / (n * opsPerCall));
+	}
+	report(name, n * opsPerCall * kBatches, median(nsPerOp));
+}
+
+// Printable ASCII, which every benchmark uses as its set of glyphs
+static std::vector<uint32_t> ascii_points()
+{
+	std::vector<uint32_t> points;
+	for (uint32_t point = 32; point < 127; point++) {
+		points.push_back(point);
+	}
+	return points;
+}
+
+static void bench_outlines(FT_Library ft, FT_Face face)
+{
+	std::vector<FT_Outline> outlines;
+	for (uint32_t point : ascii_points()) {
+		if (FT_Load_Glyph(face, FT_Get_Char_Index(face, point), FT_LOAD_NO_SCALE)) {
+			continue;
+		}
+		FT_Outline *src = &face->glyph->outline;
+		FT_Outline copy;
+		FT_Outline_New(ft, src->n_points, src->n_contours, &copy);
+		FT_Outline_Copy(src, &copy);
+		outlines.push_back(copy);
+	}
+
+	run("outline_decompose", outlines.size(), [&](uint64_t n) {
+		for (uint64_t i = 0; i < n; i++) {
+			for (FT_Outline &outline : outlines) {
+				sink += GetBeziersForOutline(&outline).size();
+			}
+		}
+	});
+
+	// Cubics approximated for text drawn at 16 pixels per em, a quarter of
+	// a pixel at a time (see GLFontManager::SetCubicTargetSize). Only
+	// differs for fonts with cubics.
+	double tolerance = face->units_per_EM * 0.25 / 16;
+	run("outline_decompose_16ppem", outlines.size(), [&](uint64_t n) {
+		for (uint64_t i = 0; i < n; i++) {
+			for (FT_Outline &outline : outlines) {
+				sink += GetBeziersForOutline(&outline, tolerance).size();
+			}
+		}
+	});
+
+	for (FT_Outline &outline : outlines) {
+		FT_Outline_Done(ft, &outline);
+	}
+}
+
+static void bench_vgrids(FT_Face face)
+{
+	std::vector<PreparedGlyph> glyphs;
+	size_t overflowPixels = 0;
+	for (uint32_t point : ascii_points()) {
+		PreparedGlyph prepared;
+		if (prepare_glyph(face, FT_Get_Char_Index(face, point), 0, &prepared) && !prepared.curves.empty()) {
+			overflowPixels = std::max(overflowPixels,
+				prepared.grid.OverflowPixelCount(kAtlasChannels));
+			glyphs.push_back(std::move(prepared));
+		}
+	}
+
+	run("vgrid_build", glyphs.size(), [&](uint64_t n) {
+		VGrid grid;
+		for (uint64_t i = 0; i < n; i++) {
+			for (PreparedGlyph &glyph : glyphs) {
+				grid.Build(
+					glyph.curves,
+					Vec2(glyph.metrics.width, glyph.metrics.height),
+					glyph.grid.width,
+					glyph.grid.height);
+			}
+		}
+	});
+
+	std::vector<uint16_t> atlas(kGridAtlasSize * kGridAtlasSize * kAtlasChannels);
+	std::vector<uint16_t> overflow((overflowPixels + 1) * kOverflowIndicesPerPixel);
+	VGridAtlas gridAtlas{};
+	gridAtlas.data = atlas.data();
+	gridAtlas.width = kGridAtlasSize;
+	gridAtlas.height = kGridAtlasSize;
+	gridAtlas.depth = kAtlasChannels;
+	run("vgrid_write", glyphs.size(), [&](uint64_t n) {
+		for (uint64_t i = 0; i < n; i++) {
+			for (PreparedGlyph &glyph : glyphs) {
+				gridAtlas.WriteVGridAt(glyph.grid, 0, 0, overflow.data());
+			}
+		}
+	});
+}
+
+static void bench_glyph_loads()
+{
+	std::vector<uint32_t> points = ascii_points();
+
+	// A new manager for every call, so every glyph is prepared, including
+	// opening the font
+	run("glyph_load_cold", points.size(), [&](uint64_t n) {
+		for (uint64_t i = 0; i < n; i++) {
+			GLFontManager manager;
+			FT_Face face = manager.GetFontFromPath(kFontPath);
+			for (uint32_t point : points) {
+				manager.GetGlyphForCodepoint(face, point);
+			}
+		}
+	});
+
+	GLFontManager manager;
+	FT_Face face = manager.GetFontFromPath(kFontPath);
+	for (uint32_t point : points) {
+		manager.GetGlyphForCodepoint(face, point);
+	}
+	run("glyph_load_warm", points.size(), [&](uint64_t n) {
+		for (uint64_t i = 0; i < n; i++) {
+			for (uint32_t point : points) {
+				manager.GetGlyphForCodepoint(face, point);
+			}
+		}
+	});
+}
+
+// Text of `size` characters, in lines of 80
+static std::u32string make_text(size_t size)
+{
+	std::u32string text(size, U'x');
+	for (size_t i = 0; i < size; i++) {
+		text[i] = (i % 80 == 79) ? U'\n' : U'a' + i % 26;
+	}
+	return text;
+}
+
+// Inserts and removes one character at the front, middle, and end of labels
+// of various sizes. Inserts and removes are timed separately, but always
+// alternate, so the label keeps its size.
+static void bench_label_edits(FT_Face face)
+{
+	static const size_t kSizes[] = {10000, 100000, 1000000};
+	static const char *kSizeNames[] = {"10k", "100k", "1m"};
+	static const char *kWhere[] = {"front", "middle", "end"};
+	static const int kEditsPerBatch = 1000;
+
+	for (size_t s = 0; s < sizeof(kSizes)/sizeof(kSizes[0]); s++) {
+		for (int w = 0; w < 3; w++) {
+			std::string suffix = std::string(kWhere[w]) + "_" + kSizeNames[s];
+			std::string insertName = "label_insert_" + suffix;
+			std::string removeName = "label_remove_" + suffix;
+			if (!selected(insertName) && !selected(removeName)) {
+				continue;
+			}
+			std::cerr << insertName << ", " << removeName << "\n";
+
+			GLLabel label;
+			label.SetText(make_text(kSizes[s]), glm::vec4(0,0,0,1), face);
+			size_t index = w == 0 ? 0 : w == 1 ? kSizes[s] / 2 : kSizes[s];
+
+			std::vector<double> insertNs, removeNs;
+			for (int b = 0; b < kBatches + 1; b++) {
+				uint64_t insertTime = 0, removeTime = 0;
+				for (int i = 0; i < kEditsPerBatch; i++) {
+					Clock::time_point start = Clock::now();
+					label.InsertText(U"y", index, glm::vec4(0,0,0,1), face);
+					insertTime += elapsed_ns(start);
+
+					start = Clock::now();
+					label.RemoveText(index, 1);
+					removeTime += elapsed_ns(start);
+				}
+
+				// The first batch is a warm-up
+				if (b > 0) {
+					insertNs.push_back((double)insertTime / kEditsPerBatch);
+					removeNs.push_back((double)removeTime / kEditsPerBatch);
+				}
+			}
+
+			uint64_t iterations = kEditsPerBatch * kBatches;
+			if (selected(insertName)) {
+				report(insertName, iterations, median(insertNs));
+			}
+			if (selected(removeName)) {
+				report(removeName, iterations, median(removeNs));
+			}
+		}
+	}
+}
+
+// Times replacing the whole text of a label with 5 MB of UTF-8, as when
+// showing a log file, and with 80 characters, as with a counter.
+static void bench_label_set_text(FT_Face face)
+{
+	std::u32string log = make_text(5 * 1024 * 1024);
+	std::string logUtf8(log.begin(), log.end()); // All ASCII
+	GLLabel label;
+	run("label_set_text_utf8_5mb", 1, [&](uint64_t n) {
+		for (uint64_t i = 0; i < n; i++) {
+			label.SetText(logUtf8, glm::vec4(0,0,0,1), face);
+		}
+		sink += label.GetTextSize();
+	});
+
+	std::string counter = logUtf8.substr(0, 80);
+	run("label_set_text_utf8_80", 1, [&](uint64_t n) {
+		for (uint64_t i = 0; i < n; i++) {
+			label.SetText(counter, glm::vec4(0,0,0,1), face);
+		}
+		sink += label.GetTextSize();
+	});
+}
+
+// Times uploading the atlases of a fresh manager that has loaded printable
+// ASCII, and uploading when nothing changed.
+static void bench_uploads()
+{
+	std::vector<uint32_t> points = ascii_points();
+	std::string fullName = "upload_atlases_full";
+	if (selected(fullName)) {
+		std::cerr << fullName << "\n";
+		std::vector<double> ns;
+		for (int b = 0; b < kBatches; b++) {
+			GLFontManager manager;
+			FT_Face face = manager.GetFontFromPath(kFontPath);
+			for (uint32_t point : points) {
+				manager.GetGlyphForCodepoint(face, point);
+			}
+			glFinish();
+
+			Clock::time_point start = Clock::now();
+			manager.UploadAtlases();
+			glFinish();
+			ns.push_back(elapsed_ns(start));
+		}
+		report(fullName, kBatches, median(ns));
+	}
+
+	GLFontManager manager;
+	FT_Face face = manager.GetFontFromPath(kFontPath);
+	for (uint32_t point : points) {
+		manager.GetGlyphForCodepoint(face, point);
+	}
+	manager.UploadAtlases();
+	run("upload_atlases_idle", 1, [&](uint64_t n) {
+		for (uint64_t i = 0; i < n; i++) {
+			manager.UploadAtlases();
+		}
+	});
+}
+
+// Fills an offscreen framebuffer with text at various sizes, and times
+// drawing it with timer queries.
+static void bench_render(FT_Face face)
+{
+	static const int kTargetSize = 1024;
+	static const int kGlyphSizes[] = {4, 8, 16, 32, 64, 128};
+	static const int kFrames = 20;
+	static const size_t kMaxChars = 200000;
+
+	struct Variant
+	{
+		const char *name;
+		GLFontManager::Quality quality;
+		float lodThreshold;
+	};
+	GLFontManager::Quality cheap;
+	cheap.samples = 1;
+	cheap.boxWindow = true;
+	GLFontManager::Quality tight;
+	tight.tightQuads = true;
+	const Variant variants[] = {
+		{"default", GLFontManager::Quality(), 8},
+		{"no_lod", GLFontManager::Quality(), 0},
+		{"cheap", cheap, 8},
+		{"tight", tight, 8},
+	};
+
+	GLuint framebuffer, colorBuffer;
+	glGenFramebuffers(1, &framebuffer);
+	glGenRenderbuffers(1, &colorBuffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, kTargetSize, kTargetSize);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer);
+	glViewport(0, 0, kTargetSize, kTargetSize);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	GLuint query;
+	glGenQueries(1, &query);
+
+	std::shared_ptr<GLFontManager> manager = GLFontManager::GetFontManager();
+	float unitsPerEm = face->units_per_EM;
+	for (int glyphSize : kGlyphSizes) {
+		// Enough lines of enough characters to cover the target, assuming
+		// characters are about half an em wide
+		float lineHeight = glyphSize * face->height / unitsPerEm;
+		size_t lines = kTargetSize / lineHeight + 1;
+		size_t lineSize = kTargetSize / (glyphSize * 0.5f) + 1;
+		lines = std::min(lines, kMaxChars / lineSize);
+		std::u32string text;
+		for (size_t y = 0; y < lines; y++) {
+			for (size_t x = 0; x < lineSize; x++) {
+				text += U'a' + (x + y) % 26;
+			}
+			text += U'\n';
+		}
+
+		GLLabel label;
+		label.SetText(text, glm::vec4(0,0,0,1), face);
+
+		// Font units to clip space, with the first line at the top
+		float scale = glyphSize * 2.0f / kTargetSize / unitsPerEm;
+		glm::mat4 transform = glm::translate(glm::mat4(1.0),
+			glm::vec3(-1, 1 - glyphSize * 2.0f / kTargetSize, 0));
+		transform = glm::scale(transform, glm::vec3(scale, scale, 1));
+
+		for (const Variant &variant : variants) {
+			std::string name = "render_" + std::to_string(glyphSize) + "px_" + variant.name;
+			if (!selected(name)) {
+				continue;
+			}
+			std::cerr << name << "\n";
+
+			label.SetQuality(variant.quality);
+			manager->SetLODThreshold(variant.lodThreshold);
+
+			std::vector<double> cpuNs, gpuNs;
+			for (int frame = -1; frame < kFrames; frame++) {
+				glClearColor(1, 1, 1, 1);
+				glClear(GL_COLOR_BUFFER_BIT);
+
+				Clock::time_point start = Clock::now();
+				glBeginQuery(GL_TIME_ELAPSED, query);
+				label.Render(0, transform);
+				glEndQuery(GL_TIME_ELAPSED);
+				GLuint64 gpuTime = 0;
+				glGetQueryObjectui64v(query, GL_QUERY_RESULT, &gpuTime);
+
+				// The first frame uploads and compiles, so it's a warm-up
+				if (frame >= 0) {
+					cpuNs.push_back(elapsed_ns(start));
+					gpuNs.push_back(gpuTime);
+				}
+			}
+
+			std::ostringstream extra;
+			extra << ", \"glyphs\": " << label.GetTextSize() - lines;
+			report(name, kFrames, median(cpuNs), median(gpuNs), extra.str());
+		}
+	}
+
+	// A 100k line label scrolled through a screenful at a time, which only
+	// draws and uploads the blocks in view
+	if (selected("render_scroll_100k_lines")) {
+		std::cerr << "render_scroll_100k_lines\n";
+		static const int kScrollSize = 16;
+		static const size_t kScrollLines = 100000;
+		std::u32string text;
+		for (size_t y = 0; y < kScrollLines; y++) {
+			text += U"The quick brown fox jumps over the lazy dog " + std::u32string(1, U'a' + y % 26) + U"\n";
+		}
+		GLLabel label;
+		label.SetText(text, glm::vec4(0,0,0,1), face);
+
+		float scale = kScrollSize * 2.0f / kTargetSize / unitsPerEm;
+		float screen = kTargetSize / (kScrollSize * face->height / unitsPerEm) * face->height;
+		std::vector<double> cpuNs, gpuNs;
+		for (int frame = -1; frame < kFrames; frame++) {
+			glm::mat4 transform = glm::translate(glm::mat4(1.0), glm::vec3(-1, 1, 0));
+			transform = glm::scale(transform, glm::vec3(scale, scale, 1));
+			transform = glm::translate(transform, glm::vec3(0, (frame + 1) * screen, 0));
+			glClear(GL_COLOR_BUFFER_BIT);
+
+			Clock::time_point start = Clock::now();
+			glBeginQuery(GL_TIME_ELAPSED, query);
+			label.Render(0, transform);
+			glEndQuery(GL_TIME_ELAPSED);
+			GLuint64 gpuTime = 0;
+			glGetQueryObjectui64v(query, GL_QUERY_RESULT, &gpuTime);
+			if (frame >= 0) {
+				cpuNs.push_back(elapsed_ns(start));
+				gpuNs.push_back(gpuTime);
+			}
+		}
+		report("render_scroll_100k_lines", kFrames, median(cpuNs), median(gpuNs));
+	}
+
+	manager->SetLODThreshold(8);
+	glDeleteQueries(1, &query);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteRenderbuffers(1, &colorBuffer);
+	glDeleteFramebuffers(1, &framebuffer);
+}
+
+#ifdef BENCH_EGL
+static bool create_context()
+{
+	EGLDisplay display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr)) {
+		return false;
+	}
+
+	const EGLint configAttribs[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_NONE
+	};
+	EGLConfig config;
+	EGLint configCount = 0;
+	if (!eglChooseConfig(display, configAttribs, &config, 1, &configCount) || configCount == 0) {
+		return false;
+	}
+
+	// Drawing goes to a framebuffer object, so the surface is only needed
+	// to make the context current
+	const EGLint surfaceAttribs[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+	EGLSurface surface = eglCreatePbufferSurface(display, config, surfaceAttribs);
+
+	eglBindAPI(EGL_OPENGL_API);
+	const EGLint contextAttribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 3,
+		EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE
+	};
+	EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+	return context != EGL_NO_CONTEXT
+		&& eglMakeCurrent(display, surface, surface, context);
+}
+#else
+static bool create_context()
+{
+	if (!glfwInit()) {
+		return false;
+	}
+
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	GLFWwindow *window = glfwCreateWindow(64, 64, "gllabel-bench", NULL, NULL);
+	if (!window) {
+		return false;
+	}
+	glfwMakeContextCurrent(window);
+	return true;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+	if (argc > 2) {
+		std::cerr << "Usage: bench [FILTER]\n";
+		return 1;
+	}
+	if (argc == 2) {
+		filter = argv[1];
+	}
+
+	FT_Library ft;
+	FT_Face face;
+	if (FT_Init_FreeType(&ft) || FT_New_Face(ft, kFontPath, 0, &face)) {
+		std::cerr << "Failed to load " << kFontPath << "\n";
+		return 1;
+	}
+
+	// These don't need a GL context
+	bench_outlines(ft, face);
+	bench_vgrids(face);
+	bench_glyph_loads();
+	FT_Done_FreeType(ft);
+
+	if (!create_context()) {
+		std::cerr << "Failed to create a GL context, skipping GL benchmarks\n";
+		return 0;
+	}
+	glewExperimental = true;
+	GLenum err = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+	// GLEW built for GLX can't query GLX with an EGL context, but still
+	// loads every GL function
+	if (err == GLEW_ERROR_NO_GLX_DISPLAY) {
+		err = GLEW_OK;
+	}
+#endif
+	if (err != GLEW_OK) {
+		std::cerr << "Failed to initialize GLEW, skipping GL benchmarks\n";
+		return 0;
+	}
+
+	FT_Face labelFace = GLFontManager::GetFontManager()->GetFontFromPath(kFontPath);
+	bench_label_edits(labelFace);
+	bench_label_set_text(labelFace);
+	bench_uploads();
+	bench_render(labelFace);
+	return 0;
+}
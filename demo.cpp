@@ -8,7 +8,6 @@
 #include <glfw3.h>
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/transform.hpp>
-#include <codecvt>
 #include <iomanip>
 #include <string>
 #include <sstream>
@@ -29,7 +28,6 @@ void onKeyPress(GLFWwindow *window, int key, int scanCode, int action, int mods)
 void onCharTyped(GLFWwindow *window, unsigned int codePoint, int mods);
 void onScroll(GLFWwindow *window, double deltaX, double deltaY);
 void onResize(GLFWwindow *window, int width, int height);
-std::u32string toUTF32(const std::string &s);
 static glm::vec3 pt(float pt);
 
 int main()
@@ -73,10 +71,6 @@ int main()
 
 	std::cout << "GL Version: " << glGetString(GL_VERSION) << "\n";
 
-	GLuint vertexArrayId;
-	glGenVertexArrays(1, &vertexArrayId);
-	glBindVertexArray(vertexArrayId);
-
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	glEnable(GL_BLEND);
 
@@ -97,10 +91,14 @@ int main()
 	Label->AppendText(U"o", glm::vec4(1,    0.5, 0,  1), defaultFace);
 	Label->AppendText(U"w", glm::vec4(1,    0, 0,    1), defaultFace);
 	Label->AppendText(U"!\n", glm::vec4(0.5,0,0,1), defaultFace);
-	Label->SetCaretPosition(Label->GetText().size());
+	Label->SetCaretPosition(Label->GetTextSize());
 
+	// The FPS counter doesn't need to look as good as the main text, and its
+	// text changes so often that it's streamed
 	GLLabel fpsLabel;
-	fpsLabel.SetText(toUTF32("FPS:"), glm::vec4(0,0,0,1), defaultFace);
+	fpsLabel.SetQuality(GLFontManager::Quality{2, true});
+	fpsLabel.SetStreaming(true);
+	fpsLabel.SetText("FPS:", glm::vec4(0,0,0,1), defaultFace);
 
 	std::cout << "Starting render\n";
 
@@ -136,6 +134,7 @@ int main()
 		}
 		fpsMat = glm::scale(fpsMat, pt(7));
 		fpsLabel.Render(time, fpsMat);
+		GLFontManager::GetFontManager()->EndFrame();
 
 		glfwPollEvents();
 		glfwSwapBuffers(window);
@@ -151,7 +150,7 @@ int main()
 			std::ostringstream stream;
 			stream << "FPS: ";
 			stream << std::fixed << std::setprecision(1) << fps;
-			fpsLabel.SetText(toUTF32(stream.str()), glm::vec4(0,0,0,1), defaultFace);
+			fpsLabel.SetText(stream.str(), glm::vec4(0,0,0,1), defaultFace);
 		}
 	}
 
@@ -181,8 +180,7 @@ void onKeyPress(GLFWwindow *, int key, int /*scanCode*/, int action, int /*mods*
 	}
 
 	if (key == GLFW_KEY_BACKSPACE) {
-		std::u32string text = Label->GetText();
-		if (text.size() > 0 && Label->GetCaretPosition() > 0) {
+		if (Label->GetTextSize() > 0 && Label->GetCaretPosition() > 0) {
 			Label->RemoveText(Label->GetCaretPosition()-1, 1);
 			Label->SetCaretPosition(Label->GetCaretPosition() - 1);
 		}
@@ -232,12 +230,6 @@ void onResize(GLFWwindow *, int w, int h)
 	glViewport(0,0,w,h);
 }
 
-std::u32string toUTF32(const std::string &s)
-{
-	std::wstring_convert<std::codecvt_utf8<char32_t>, char32_t> conv;
-	return conv.from_bytes(s);
-}
-
 // Converts font points into a glm::vec3 scalar.
 static glm::vec3 pt(float pt)
 {
@@ -1,58 +1,365 @@
+#ifndef GLLABEL_H
+#define GLLABEL_H
+
 #include <string>
 #include <vector>
 #include <memory>
 #include <map>
+#include <deque>
+#include <utility>
+#include <functional>
 #include <glew.h>
 #include <glm/glm.hpp>
 #include <ft2build.h>
 #include FT_FREETYPE_H
 #include FT_OUTLINE_H
 
+class GlyphCache;
+class GlyphWorkerPool;
+class SharedAtlas;
+class Shaper;
+class StreamBuffer;
+struct PreparedGlyph;
+struct SharedGlyphSlot;
+
 class GLFontManager
 {
 public:
 	struct AtlasGroup
 	{
-		// Grid atlas contains an array of square grids with side length
-		// gridMaxSize. Each grid takes a single glyph and splits it into
-		// cells that inform the fragment shader which curves of the glyph
-		// intersect that cell. The cell contains coords to data in the bezier
-		// atlas. The bezier atlas contains the actual bezier curves for each
-		// glyph. All data for a single glyph must lie in a single row, although
-		// multiple glyphs can be in one row. Each bezier curve takes three
-		// "RGBA pixels" (12 bytes) of data.
-		// Both atlases also encode some extra information, which is explained
-		// where it is used in the code.
-		GLuint gridAtlasId;
-		uint8_t *gridAtlas;
-		uint16_t nextGridPos[2]; // XY pixel coordinates
+		// Grid atlas contains grids of up to gridMaxSize by gridMaxSize,
+		// sized to fit each glyph's curves. Each grid takes a single glyph
+		// and splits it into cells that inform the fragment shader which
+		// curves of the glyph intersect that cell. Each cell holds up to
+		// four 16-bit indices of the glyph's curves, which are stored in
+		// the glyph data (see GLFontManager::glyphData). Grids are packed
+		// along a skyline, lowest position first. Cells that intersect
+		// more curves than fit put the rest in a list after the glyph's
+		// curves.
+		// The grid atlas also encodes some extra information, which is
+		// explained where it is used in the code.
+		// On the GPU, each grid atlas is one layer of a texture array, so
+		// that glyphs from all atlases can be drawn together.
+		uint16_t *gridAtlas;
+		std::vector<uint16_t> gridSkyline; // Used height of each column
 		bool full; // For faster checking
-		bool uploaded;
 
-		GLuint glyphDataBufId, glyphDataBufTexId;
-		uint8_t *glyphDataBuf;
-		uint16_t glyphDataBufOffset; // pixel coordinates
+		// Part of the grid atlas changed since it was last passed on to
+		// the GPU mirrors (see GPUMirror), so that adding a glyph only
+		// uploads that glyph's grid. The rect is empty when
+		// dirtyGridRect[0] >= dirtyGridRect[2].
+		uint16_t dirtyGridRect[4]; // x0, y0, x1, y1 (exclusive)
 	};
 
+	// No glyph data, for glyphs that aren't drawn
+	static const uint32_t kNoGlyphData = 0xFFFFFFFF;
+	static const uint32_t kNoGlyphHandle = 0xFFFFFFFF;
+
 	struct Glyph
 	{
 		uint16_t size[2]; // Width and height in FT units
 		int16_t offset[2]; // Offset of glyph in FT units
-		uint16_t bezierAtlasPos[2]; // XZ pixel coordinates (Z being atlas index)
+		uint32_t glyphDataOffset; // Pixel offset into glyphData, or kNoGlyphData
+
+		// Index into the glyph handle table (see glyphHandles), or
+		// kNoGlyphHandle for glyphs that are never drawn. Instances refer to
+		// glyphs by handle, so that their glyph data can move. Handles are
+		// only meaningful in the process that assigned them.
+		uint32_t handle;
 		int16_t advance; // Amount to advance after character in FT units
+
+		// Still being prepared by a worker thread (see SetWorkerThreads).
+		// Until then, the glyph is drawn as a placeholder box the size of
+		// its advance.
+		bool pending;
+	};
+
+	typedef std::function<void(FT_Face face, uint32_t glyphIndex, Glyph *glyph)> GlyphLoadedCallback;
+
+	// Counters for monitoring (see GetStats). Everything but the atlas
+	// fields is a total since the manager was created, so rates can be
+	// found by comparing two snapshots.
+	struct Stats
+	{
+		// Glyph lookups that found the glyph cached, and that had to
+		// prepare it, queue it, or take it from a shared atlas
+		uint64_t glyphHits, glyphMisses;
+
+		// Glyphs prepared by this process, on any thread, and the time
+		// spent in each stage, in nanoseconds: loading with FreeType,
+		// converting the outline to curves, building the grid, and
+		// writing the glyph to the atlases
+		uint64_t glyphsPrepared;
+		uint64_t loadNanos, outlineNanos, gridNanos, atlasWriteNanos;
+
+		// Grid cells that had too many curves to fit, even with overflow
+		// lists, so that only some of their curves are drawn
+		uint64_t truncatedCells;
+
+		// Runs of text looked up in the shaped run cache that were found,
+		// and that had to be shaped (see Features)
+		uint64_t shapedRunHits, shapedRunMisses;
+
+		// Number of grid atlases, and how full the grid atlases and glyph
+		// data are, from 0 to 1. Layers of a shared atlas count as full.
+		size_t atlasCount;
+		float gridFill, glyphDataFill;
+
+		// Calls to UploadAtlases, which every Render makes once, and the
+		// bytes uploaded by them and by labels and batches
+		uint64_t frames;
+		uint64_t atlasBytesUploaded, labelBytesUploaded;
+
+		// Render calls timed on the GPU (see SetGPUTiming) whose results
+		// have come back, their total time, and the latest one's time, in
+		// nanoseconds
+		uint64_t gpuRenders, gpuNanos, lastGPUNanos;
+	};
+
+	// Reported to the trace callback (see SetTraceCallback) as work
+	// happens. TraceStage::Render events come a frame or more late, once
+	// the GPU has finished.
+	enum class TraceStage
+	{
+		Load, // Loading a glyph with FreeType
+		Outline, // Converting a glyph's outline to curves
+		Grid, // Building a glyph's grid
+		AtlasWrite, // Writing a glyph to the atlases
+		Upload, // UploadAtlases
+		Render // GPU time of a Render call
+	};
+
+	struct TraceEvent
+	{
+		TraceStage stage;
+		FT_Face face; // Glyph stages only
+		uint32_t glyphIndex; // Glyph stages only
+		uint64_t nanos;
+		uint64_t bytes; // Upload only
+	};
+
+	typedef std::function<void(const TraceEvent &event)> TraceCallback;
+
+	// How glyphs are drawn. Each combination is compiled into its own
+	// shader program the first time it's used, so labels and batches can
+	// each pick one (see GLLabel::SetQuality).
+	struct Quality
+	{
+		// Rays cast through each pixel, at evenly spaced angles: 1, 2,
+		// 4, or 8. Other values are rounded to the nearest of those. The
+		// cost of drawing the curves scales with this.
+		uint8_t samples = 4;
+
+		// Weights coverage with a box window instead of a parabolic one,
+		// which is a little cheaper but gives harder edges.
+		bool boxWindow = false;
+
+		// Adjusts coverage so that blending in gamma space, as with the
+		// default framebuffer, looks as if it were done in linear space.
+		// Assumes text contrasts with what's behind it.
+		bool gammaCorrect = false;
+
+		// Draws each glyph as an octagon around its curves instead of
+		// its whole box, which covers fewer pixels for diagonal glyphs
+		// like "/" and "A", at the cost of 8 vertices instead of 4.
+		bool tightQuads = false;
+	};
+
+	// How text is shaped. Kerning comes from the face's kern table, and
+	// ligatures from the presentation forms of the standard Latin
+	// ligatures (like "fi"), if the face has them. A ligature is drawn by
+	// its first character, and the rest of its characters take up no
+	// space. Both are on by default.
+	struct Features
+	{
+		bool kerning = true;
+		bool ligatures = true;
+	};
+
+	// A compiled variant of the glyph shader, and its uniforms. The values
+	// last set of uniforms that rarely change are kept, so that they're
+	// only set when they do.
+	struct GlyphShader
+	{
+		GLuint program, uGridAtlas, uTransform;
+		GLuint uGlyphData, uGlyphCurves, uGlyphHandles, uTransforms, uBatched, uLODThreshold;
+		bool batched;
+		float lodThreshold;
+	};
+
+	// GL state last set by the manager, labels and batches, so that
+	// binding what's already bound can be skipped (see ResetGLState).
+	// Zero means unknown, so it's always set the next time it's used.
+	struct GLState
+	{
+		GLuint program;
+		GLuint vertexArray;
+		GLenum activeTexture;
+		GLuint textures[5]; // By texture unit
+		bool blend;
+	};
+
+	// GPU copies of the atlases and glyph handle table, and the compiled
+	// shader variants, made in one group of GL contexts that share
+	// objects. A mirror starts out empty and is filled from the CPU copies
+	// the first time UploadAtlases is called in one of its contexts. From
+	// then on it keeps its own dirty ranges, so that each mirror only
+	// uploads what changed since it was last uploaded to.
+	struct GPUMirror
+	{
+		std::map<uint32_t, GlyphShader> glyphShaders; // By Quality (see quality_key)
+		GLuint gridAtlasArrayId;
+		GLuint glyphDataBufId, glyphDataBufTexId, glyphCurvesBufTexId;
+		GLuint glyphHandleBufId, glyphHandleBufTexId;
+		size_t gpuAtlasCapacity;
+		uint32_t gpuGlyphDataCapacity, gpuGlyphHandleCapacity;
+		std::vector<uint16_t> dirtyGridRects; // 4 per atlas, as dirtyGridRect
+		uint32_t dirtyGlyphData[2]; // begin, end (exclusive) pixel offsets
+		uint32_t dirtyGlyphHandles[2]; // begin, end (exclusive)
+		bool compacted; // The atlases may now be smaller than their copies
+	};
+
+	// A GL context the manager has drawn with (see UseContext): its GPU
+	// mirror, which contexts sharing objects share, and what isn't shared
+	// between contexts, like bindings and queries.
+	struct GLContextState
+	{
+		std::shared_ptr<GPUMirror> gpu;
+		GlyphShader *glyphShader; // The variant in use
+		GLState glState;
+		std::vector<GLuint> freeTimerQueries;
+		std::deque<GLuint> pendingTimerQueries;
+	};
+
+	// Which glyph each handle belongs to, and how much of the atlases the
+	// glyph owns, so that glyphs can be evicted (see SetMemoryBudget).
+	// Placeholders have no face, and are never evicted. Glyphs that share
+	// another glyph's glyph data, like pending glyphs, own none of it.
+	struct GlyphHandle
+	{
+		Glyph *glyph; // nullptr if the handle is free
+		FT_Face face;
+		uint32_t glyphIndex;
+		uint32_t dataPixels; // Glyph data pixels owned
+		uint32_t gridCells; // Grid atlas cells owned
+		uint32_t refs; // Labels drawing the glyph
+		uint32_t lastUsed; // Frame the glyph was last used in
 	};
 
 public: // TODO: private
 	std::vector<AtlasGroup> atlases;
-	std::map<FT_Face, std::map<uint32_t, Glyph> > glyphs;
+	std::vector<std::unique_ptr<uint16_t[]>> gridAtlasStorage; // Pages this process allocated
+	std::unique_ptr<GlyphCache> glyphs; // By glyph index
+	std::unique_ptr<Shaper> shaper;
 	FT_Library ft;
 	FT_Face defaultFace;
-	GLuint glyphShader, uGridAtlas, uTransform;
-	GLuint uGlyphData;
+
+	// Every context used so far, by the key it was given to UseContext,
+	// and the current one. The default context's key is nullptr.
+	std::map<const void *, GLContextState> glContexts;
+	GLContextState *glContext;
+
+	// The header and curves of every glyph, in "RGBA pixels" of four
+	// bytes. Each glyph takes a contiguous range, so any glyph can have any
+	// number of curves. Points into cacheMapping if it was loaded from an
+	// atlas cache, until it needs to grow.
+	uint8_t *glyphData;
+	std::vector<uint8_t> glyphDataStorage;
+	uint32_t glyphDataSize, glyphDataCapacity; // pixels
+	uint32_t dirtyGlyphData[2]; // begin, end (exclusive) pixel offsets
+
+	// The glyph handle table. glyphHandleOffsets holds the current glyph
+	// data offset of each handle, and is uploaded to a buffer texture in
+	// each GPU mirror, which the vertex shader looks instances up in.
+	std::vector<GlyphHandle> glyphHandles;
+	std::vector<uint32_t> glyphHandleOffsets;
+	std::vector<uint32_t> freeGlyphHandles;
+	uint32_t dirtyGlyphHandles[2]; // begin, end (exclusive)
+
+	// Bytes the atlases may use, or 0 for no limit, and how many they used
+	// after the last eviction. frame is incremented by every EndFrame, and
+	// compacted is set when EndFrame compacts the atlases, until it's
+	// passed on to the GPU mirrors.
+	size_t memoryBudget, memoryAfterEviction;
+	uint32_t frame;
+	bool compacted;
+
+	// See SetLODThreshold and SetCubicTargetSize
+	float lodThreshold;
+	float cubicTargetSize;
+
+	// Private, copy-on-write mapping of an atlas cache file, if one was
+	// loaded. Atlas pages and glyph data loaded from the cache point
+	// directly into this mapping, and glyphs added later are appended to
+	// them in place (without changing the file), until they need to grow
+	// or the atlases are compacted.
+	void *cacheMapping;
+	size_t cacheMappingSize;
+
+	GlyphLoadedCallback glyphLoadedCallback;
+
+	// See GetStats. GPU timer queries are reused once their results are
+	// read, and results are read in the order the queries were made.
+	Stats stats;
+	TraceCallback traceCallback;
+	bool gpuTiming;
+
+	// Set if UseSharedAtlas was called. The atlases and glyph data then
+	// point into the shared atlas, and glyphDataSize and glyphDataCapacity
+	// only cover the glyph data this process has used. Glyphs this process
+	// has queued for a worker are published once committed, and glyphs
+	// other processes are preparing are checked for in
+	// CommitPreparedGlyphs.
+	struct SharedPendingGlyph
+	{
+		FT_Face face;
+		uint32_t glyphIndex;
+		Glyph *glyph;
+	};
+	std::unique_ptr<SharedAtlas> shared;
+	std::map<Glyph *, SharedGlyphSlot *> sharedClaims;
+	std::vector<SharedPendingGlyph> sharedPending;
+
+	// Background glyph preparation. Workers need to open their own copy
+	// of each face, so the font file of each face is remembered.
+	std::unique_ptr<GlyphWorkerPool> workers;
+	std::map<FT_Face, std::string> fontPaths;
+	Glyph placeholderGlyph;
+	bool hasPlaceholderGlyph;
+	uint32_t glyphGeneration;
+
+	// Placeholders of each size share the box grid of placeholderGlyph, but
+	// each size needs its own glyph data header.
+	std::map<std::pair<uint16_t, uint16_t>, Glyph> placeholderSizes;
 
 	GLFontManager();
 
 	AtlasGroup * GetOpenAtlasGroup();
+	GlyphShader LoadGlyphShader(Quality quality);
+	Glyph CommitGlyph(FT_Face face, uint32_t glyphIndex, PreparedGlyph &prepared);
+	Glyph * GetPlaceholderGlyph(uint16_t width, uint16_t height);
+	void WritePlaceholderBox();
+	void SetGlyphHandle(Glyph *glyph, FT_Face face, uint32_t glyphIndex, uint32_t dataPixels, uint32_t gridCells);
+	bool EvictGlyphs();
+	void Trace(TraceStage stage, FT_Face face, uint32_t glyphIndex, uint64_t nanos, uint64_t bytes);
+	void CollectGPUTimers();
+
+	// Change GL state through glState. Each texture unit only ever has one
+	// target bound: unit 0 the grid atlases, and the rest buffer textures.
+	void BindTexture(GLuint unit, GLenum target, GLuint texture);
+	void BindVertexArray(GLuint vertexArray);
+	void DeleteVertexArray(GLuint *vertexArray);
+	void EnableBlend();
+
+	// Times the draw calls between them with a GL_TIME_ELAPSED query, if
+	// GPU timing is on. Render calls can't be nested in another
+	// GL_TIME_ELAPSED query while it is.
+	void BeginGPUTimer();
+	void EndGPUTimer();
+
+	// Deletes the GL objects made for a context, which must be current,
+	// and those of its mirror if no other context uses it.
+	void DeleteContextObjects(GLContextState &state);
 
 public:
 	~GLFontManager();
@@ -64,17 +371,154 @@ public:
 	FT_Face GetFontFromName(std::string fontName);
 	FT_Face GetDefaultFont();
 
+	// Loads the glyph synchronously if it isn't cached yet. If the glyph
+	// was requested with RequestGlyph and is still pending, the pending
+	// glyph is returned. With a memory budget, the glyph stays valid until
+	// the end of the next frame (the second EndFrame after it's returned)
+	// unless it is retained or used again. Glyphs are cached by glyph
+	// index, so codepoints the face doesn't have all share its missing
+	// glyph.
 	Glyph * GetGlyphForCodepoint(FT_Face face, uint32_t point);
+	Glyph * GetGlyphForIndex(FT_Face face, uint32_t glyphIndex);
 	void LoadASCII(FT_Face face);
 	void UploadAtlases();
 
+	// Call once at the end of every frame, after every label and batch has
+	// been rendered, in every context. This is the only time glyphs are
+	// evicted (see SetMemoryBudget).
+	void EndFrame();
+
+	// By default glyphs are prepared synchronously when first used. With
+	// one or more worker threads, RequestGlyph instead returns a pending
+	// glyph right away and prepares it in the background. Finished glyphs
+	// are added to the atlases by CommitPreparedGlyphs, which UploadAtlases
+	// calls every frame. Only faces loaded with GetFontFromPath can be
+	// prepared in the background.
+	void SetWorkerThreads(unsigned count);
+	Glyph * RequestGlyph(FT_Face face, uint32_t point);
+	Glyph * RequestGlyphForIndex(FT_Face face, uint32_t glyphIndex);
+	bool CommitPreparedGlyphs(bool wait = false);
+
+	// Incremented every time pending glyphs are committed.
+	inline uint32_t GetGlyphGeneration() { return glyphGeneration; }
+
+	// Atlas caches store every atlas page and glyph table in a single file
+	// (see gllabel-bake), so that glyphs don't have to be prepared at
+	// startup. Faces are matched by family and style name. A cache can only
+	// be loaded before any glyphs have been loaded. Both return false on
+	// failure.
+	bool SaveAtlasCache(std::string cachePath);
+	bool LoadAtlasCache(std::string cachePath, std::vector<FT_Face> faces);
+
+	// A shared atlas is a file, normally in /dev/shm, that holds the atlas
+	// pages and glyphs of every process that uses it. The first process to
+	// need a glyph prepares it, and the others only upload it, so each
+	// glyph is prepared once per machine and its atlas pages are in memory
+	// once. Faces are matched by family and style name, as in atlas caches.
+	// The placeholder drawn for pending glyphs isn't shared, so each
+	// process that uses it adds a few hundred pixels to the shared atlas.
+	// It must be set up before any glyphs are loaded, and can't be used
+	// with an atlas cache. Returns false on failure.
+	bool UseSharedAtlas(std::string path);
+
+	// Limits the memory used by the grid atlases and glyph data, in bytes.
+	// Once they grow past the budget, glyphs that aren't retained and
+	// weren't used in the frame just ended are evicted by EndFrame, least
+	// recently used first, until
+	// the rest fit well within the budget. The remaining glyphs are then
+	// packed into new atlases, and their handles are pointed at their new
+	// glyph data, so labels don't need to change. Evicted glyphs are
+	// prepared again when they are next used. Retained glyphs are never
+	// evicted, so they may exceed the budget. 0, the default, means no
+	// limit. Has no effect with a shared atlas.
+	void SetMemoryBudget(size_t bytes);
+
+	// Keeps a glyph from being evicted until it's released as many times
+	// as it was retained. Labels retain the glyphs of their text.
+	void RetainGlyph(Glyph *glyph);
+	void ReleaseGlyph(Glyph *glyph);
+
+	// Debugging aids. DumpAtlases writes every grid atlas as a BMP image
+	// named <pathPrefix>gridAtlas<N>.bmp, with the low byte of each index,
+	// and the glyph data as <pathPrefix>glyphData.bmp.
+	// The callback, if set, is called after each glyph is added to an
+	// atlas, with the glyph's index in its face.
+	bool DumpAtlases(std::string pathPrefix);
+	void SetGlyphLoadedCallback(GlyphLoadedCallback callback);
+
+	// Glyphs whose longer side is drawn smaller than this many pixels are
+	// drawn from a small coverage map made when the glyph is prepared,
+	// rather than from their curves. This is much cheaper, and at that size
+	// looks the same. The default is 8, and 0 always draws the curves.
+	void SetLODThreshold(float pixels);
+
+	// Glyph outlines with cubic curves, as in CFF and OTF fonts, are drawn
+	// as quadratic curves that are made to stay within a quarter of a
+	// pixel of the cubics when drawn this many pixels per em. Text drawn
+	// smaller then needs fewer curves, and text drawn larger is smoother.
+	// The default, 0, allows the quadratics to stray by 5% of the size of
+	// each glyph. Only affects glyphs prepared after it's set.
+	void SetCubicTargetSize(float pixelsPerEm);
+
+	// Counters of what the manager has done, for monitoring. Cheap enough
+	// to call every frame.
+	Stats GetStats();
+
+	// The callback, if set, is called with the time and size of every
+	// stage of work as it happens. Glyphs prepared by worker threads are
+	// reported when they are committed, on the thread that commits them.
+	void SetTraceCallback(TraceCallback callback);
+
+	// Times every GLLabel and GLTextBatch Render on the GPU with
+	// GL_TIME_ELAPSED queries, for Stats and the trace callback. Off by
+	// default.
+	void SetGPUTiming(bool enabled);
+
+	// Every GL context that labels are drawn in needs its own GPU copy of
+	// the atlases, but the glyphs themselves are only prepared once, and
+	// kept once on the CPU. Call UseContext whenever the current GL context
+	// changes, with a key that identifies it, like its window. A context
+	// created to share objects with another one (as with the share argument
+	// of glfwCreateWindow or wglShareLists) can pass the key of that
+	// context, once it has been used, as shareWith the first time it's
+	// used itself, and the two then share one GPU copy. GL can't tell
+	// whether contexts share objects, so this must match how they were
+	// created. Each copy is only made, and kept up to date, when
+	// UploadAtlases (or a Render) is called in one of its contexts.
+	// Without UseContext, everything is drawn with a default context,
+	// whose key is nullptr.
+	// Labels and batches keep vertex arrays, which aren't shared between
+	// contexts, so each must only be rendered in one context.
+	// ReleaseContext deletes the GL objects the manager made for a context,
+	// so it must be called with that context current, before it's
+	// destroyed. The manager's destructor releases the current context.
+	void UseContext(const void *context, const void *shareWith = nullptr);
+	void ReleaseContext(const void *context);
+
+	// GLLabel and GLTextBatch leave their shader program, vertex array and
+	// textures bound, and blending enabled, after they draw, and skip
+	// setting any of them that are still set from last time. Call this
+	// after changing any of them (or the active texture unit) outside of
+	// gllabel, so that they are all set again by the next Render.
+	void ResetGLState();
+
 	void UseGlyphShader();
+	void UseGlyphShader(Quality quality);
+
+	// Number of triangle strip vertices each glyph instance is drawn with
+	static GLsizei GetGlyphVertexCount(Quality quality);
 	void SetShaderTransform(glm::mat4 transform);
-	void UseAtlasTextures(uint16_t atlasIndex);
+	void UseAtlasTextures();
+
+	// Binds a buffer texture of per-label transforms (see GLTextBatch), or
+	// stops using one if transformsTexId is 0.
+	void UseBatchTransforms(GLuint transformsTexId);
 };
 
 class GLLabel
 {
+	friend class GLTextBatch;
+
 public:
 	enum class Align
 	{
@@ -89,60 +533,234 @@ public:
 	};
 
 private:
-	struct GlyphVertex
+	// One instance per glyph. The vertex shader expands each instance into
+	// a quad, using the glyph's size from its glyph data header.
+	struct GlyphInstance
 	{
-		// XY coords of the vertex
+		// XY coords of the bottom left corner of the glyph
 		glm::vec2 pos;
 
-		// Bit 0 (low) is norm coord X (varies per vertex)
-		// Bit 1 is norm coord Y (varies per vertex)
-		// Bits 2-31 are texel offset (byte offset / 4) into
-		//   glyphDataBuf (same for all verticies of a glyph)
+		// Handle of the glyph, or GLFontManager::kNoGlyphHandle for
+		// glyphs that aren't drawn
 		uint32_t data;
 
 		// RGBA color [0,255]
 		Color color;
 	};
 
-	// Each of these arrays store the same "set" of data, but different versions
-	// of it. Consequently, each of these will be exactly the same length
-	// (except verts, which is six times longer than the other two, since
-	// six verts per glyph).
-	// Can't put them all into one array, because verts is needed alone as a
-	// buffer to upload to the GPU, and text is needed alone mostly for GetText.
-	std::u32string text;
-	std::vector<GlyphVertex> verts;
-	std::vector<GLFontManager::Glyph *> glyphs;
+	// Text is stored in blocks of whole lines. Instance positions are
+	// relative to the block's origin, which is only applied when drawing,
+	// so an edit only lays out and uploads the blocks it touches. Every
+	// block except the last ends with a newline.
+	struct Block
+	{
+		// Each of these arrays store the same "set" of data, but different
+		// versions of it. Consequently, each of these will be exactly the
+		// same length. Can't put them all into one array, because instances
+		// is needed alone as a buffer to upload to the GPU. Characters that
+		// aren't drawn, including those drawn by the ligature glyph of a
+		// character before them, have a nullptr glyph, and the position of
+		// their instance is the pen position. spacing is the extra advance
+		// after each character from shaping (see Shaper::Shape).
+		std::u32string text;
+		std::vector<FT_Face> faces;
+		std::vector<GLFontManager::Glyph *> glyphs;
+		std::vector<GlyphInstance> instances;
+		std::vector<int16_t> spacing;
+
+		// Whether each glyph was still pending when its instance was
+		// written, meaning it describes a placeholder and must be
+		// rewritten once the glyph is ready.
+		std::vector<bool> placeholders;
+		size_t pendingGlyphs;
+
+		glm::vec2 origin; // Pen position at the start of the block
+		float height; // How far down the pen moves over the whole block
+
+		// Box around the glyphs of the block, relative to its origin, so
+		// that blocks out of view can be skipped. Empty if min > max.
+		glm::vec2 boundsMin, boundsMax;
+
+		// Changes whenever the instances change. Versions are unique
+		// across all blocks of all labels, so a GLTextBatch can tell
+		// whether it needs to upload a block.
+		uint32_t version;
+		uint32_t uploadedVersion;
+
+		// Both 0 until first uploaded. The vertex array draws the
+		// buffer's instances, and is set up once with the buffer.
+		GLuint buffer;
+		GLuint vertexArray;
+	};
+
+	// Blocks are split once they are longer than this, as long as they
+	// contain more than one line.
+	static const size_t kMaxBlockSize = 2048;
+
+	std::vector<Block> blocks;
+	size_t textSize;
+	size_t pendingGlyphs;
+	uint32_t pendingGeneration;
+	static uint32_t lastVersion;
 
 	std::shared_ptr<GLFontManager> manager;
-	GLuint vertBuffer, caretBuffer;
+	GLFontManager::Quality quality;
+	GLFontManager::Features features;
+
+	// Set in streaming mode (see SetStreaming), instead of each block
+	// having its own buffer. The vertex array is pointed at this frame's
+	// part of the stream buffer every time it's drawn, and is 0 until then.
+	std::unique_ptr<StreamBuffer> stream;
+	GLuint streamVertexArray;
+
+	// The caret glyph and its instance, positioned at the origin. The
+	// instance is uploaded to caretBuffer once, and again if it was made
+	// while the glyph was pending, once the glyph is ready. It's drawn
+	// moved to the caret's position by the transform.
+	GLFontManager::Glyph *caretGlyph;
+	GlyphInstance caretInstance;
+	bool caretPending;
+	GLuint caretBuffer, caretVertexArray;
 	bool showingCaret;
 	size_t caretPosition;
 	float prevTime, caretTime;
 
+	static GlyphInstance MakeGlyphInstance(
+		GLFontManager::Glyph *glyph,
+		glm::vec2 origin,
+		Color color);
+	static void SetInstanceAttribs(GLuint buffer, size_t offset = 0);
+	static glm::vec2 PenAfter(Block &block, size_t index);
+	static glm::vec2 PenAt(Block &block, size_t index);
+	static void LayoutBlock(Block &block, size_t from);
+	static void ExtendBounds(Block &block, size_t index);
+	static bool IsBlockVisible(const Block &block, const glm::mat4 &transform);
+	size_t FindBlock(size_t index, size_t *blockIndex);
+	void LayoutAndSplitBlock(size_t b, size_t from);
+	static void MoveBlockChars(Block &from, size_t start, Block &to);
+	size_t ShapeBlock(Block &block, size_t from, size_t to);
+	GLFontManager::Glyph * LoadGlyph(FT_Face face, uint32_t glyphIndex, bool *placeholder);
+	void InsertLongText(size_t b, size_t local, const char32_t *text, size_t length, Color color, FT_Face face);
+	void MergeNextBlock(size_t b);
+	void DeleteBlock(size_t b);
+	void UpdateBlockOrigins(size_t from);
+	void UploadBlock(Block &block);
+	void DeleteBlockBuffers(Block &block);
+	void DrawStreamed(GLsizei vertexCount, const glm::mat4 &transform);
+	void RefreshPendingGlyphs();
+	bool UpdateCaret(float time, glm::vec2 *offset);
+
 public:
 	GLLabel();
 	~GLLabel();
 
-	void InsertText(std::u32string text, size_t index, glm::vec4 color, FT_Face face);
+	void InsertText(const char32_t *text, size_t length, size_t index, glm::vec4 color, FT_Face face);
 	void RemoveText(size_t index, size_t length);
-	inline void SetText(std::u32string text, glm::vec4 color, FT_Face face) {
-		this->RemoveText(0, this->text.size());
+	inline void InsertText(const std::u32string &text, size_t index, glm::vec4 color, FT_Face face) {
+		this->InsertText(text.data(), text.size(), index, color, face);
+	}
+	inline void SetText(const std::u32string &text, glm::vec4 color, FT_Face face) {
+		this->RemoveText(0, this->textSize);
 		this->InsertText(text, 0, color, face);
 	}
-	inline void AppendText(std::u32string text, glm::vec4 color, FT_Face face) {
-		this->InsertText(text, this->text.size(), color, face);
+	inline void AppendText(const std::u32string &text, glm::vec4 color, FT_Face face) {
+		this->InsertText(text, this->textSize, color, face);
+	}
+
+	// UTF-8 versions of the above. Invalid sequences are inserted as
+	// U+FFFD. Indices are still in characters.
+	void InsertText(const char *utf8, size_t length, size_t index, glm::vec4 color, FT_Face face);
+	inline void InsertText(const std::string &utf8, size_t index, glm::vec4 color, FT_Face face) {
+		this->InsertText(utf8.data(), utf8.size(), index, color, face);
+	}
+	inline void SetText(const std::string &utf8, glm::vec4 color, FT_Face face) {
+		this->RemoveText(0, this->textSize);
+		this->InsertText(utf8, 0, color, face);
+	}
+	inline void AppendText(const std::string &utf8, glm::vec4 color, FT_Face face) {
+		this->InsertText(utf8, this->textSize, color, face);
 	}
 
-	inline std::u32string GetText() { return this->text; }
+	std::u32string GetText();
+	inline size_t GetTextSize() { return this->textSize; }
 
 	void SetHorzAlignment(Align horzAlign);
 	void SetVertAlignment(Align vertAlign);
 	void ShowCaret(bool show) { showingCaret = show; }
-	void SetCaretPosition(int position) { caretTime = 0; caretPosition = glm::clamp(position, 0, (int)text.size()); }
+	void SetCaretPosition(int position) { caretTime = 0; caretPosition = glm::clamp(position, 0, (int)textSize); }
 	int GetCaretPosition() { return caretPosition; }
 
+	// Antialiasing used to draw the label. Ignored when the label is drawn
+	// by a GLTextBatch, which has its own.
+	void SetQuality(GLFontManager::Quality quality) { this->quality = quality; }
+
+	// Kerning and ligatures used to lay out the label. Changing them
+	// shapes all of the text again.
+	void SetFeatures(GLFontManager::Features features);
+
+	// In streaming mode, every Render writes the label's glyphs straight
+	// into a buffer shared by all of its blocks, which is mapped once and
+	// rotated through a few frames' worth of space, rather than uploading
+	// each block to its own buffer when it changes. That's better for
+	// labels whose text changes most frames, like counters and clocks,
+	// and worse for large labels that rarely change. Off by default.
+	// Ignored when the label is drawn by a GLTextBatch.
+	void SetStreaming(bool streaming);
+
 	// Render the label. Also uploads modified textures as necessary. 'time'
 	// should be passed in monotonic seconds (no specific zero time necessary).
+	// Blocks of text that 'transform' puts outside of the clip volume are
+	// neither drawn nor uploaded, so scrolling through a large label only
+	// costs as much as the text in view.
 	void Render(float time, glm::mat4 transform);
 };
+
+// Draws many labels at once, with a single draw call and a single setup of
+// GL state. Each frame, Add every label to draw along with its transform,
+// then call Render. Blocks of text that haven't changed since the previous
+// frame, and are added in the same order, aren't uploaded again. Added labels must
+// stay alive until Render returns.
+class GLTextBatch
+{
+public:
+	GLTextBatch();
+	~GLTextBatch();
+
+	void Add(GLLabel *label, glm::mat4 transform);
+
+	// Antialiasing used to draw every label in the batch
+	void SetQuality(GLFontManager::Quality quality) { this->quality = quality; }
+
+	// Draws all labels added since the last Render, then clears them.
+	// 'transform' is applied after each label's own transform, and 'time'
+	// is as in GLLabel::Render.
+	void Render(float time, glm::mat4 transform = glm::mat4(1.0));
+
+private:
+	// One block of a label
+	struct Entry
+	{
+		const GLLabel::Block *block; // Only valid during Render
+		uint32_t version;
+		uint32_t transform; // Index into transforms
+		size_t first; // Index of the block's first instance
+	};
+
+	std::shared_ptr<GLFontManager> manager;
+	GLFontManager::Quality quality;
+	std::vector<std::pair<GLLabel *, glm::mat4>> labels;
+	std::vector<Entry> entries, prevEntries;
+	std::vector<glm::mat4> transforms;
+	std::vector<GLLabel::GlyphInstance> carets;
+	std::vector<uint32_t> caretTransforms;
+	std::vector<uint32_t> transformIndices; // Scratch for uploads
+
+	// Instances of all blocks followed by all carets, and the index of
+	// each instance's transform. The vertex array draws both, and is set up
+	// once, since reallocating the buffers keeps their names.
+	GLuint instanceBuffer, transformIndexBuffer, vertexArray;
+	size_t capacity;
+	GLuint transformsBuffer, transformsTexId;
+};
+
+#endif
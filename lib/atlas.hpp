@@ -0,0 +1,117 @@
+#ifndef ATLAS_H
+#define ATLAS_H
+
+#include <gllabel.hpp>
+#include "vgrid.hpp"
+#include <stdint.h>
+#include <algorithm>
+
+static const uint8_t kGridMaxSize = 20;
+static const uint16_t kGridAtlasSize = 256; // Fits exactly 1024 8x8 grids
+static const uint8_t kAtlasChannels = 4; // Must be 4 (RGBA), otherwise code breaks
+
+// Grid atlas cells are RGBA16UI, one 16-bit curve index per channel
+static const size_t kGridAtlasBytes = size_t(kGridAtlasSize) * kGridAtlasSize * kAtlasChannels * sizeof(uint16_t);
+
+// Glyph data starts out with room for this many pixels, and doubles in size
+// whenever it runs out. Fits around 700-1000 glyphs, depending on their
+// curves.
+static const uint32_t kGlyphDataInitialSize = 256 * 256;
+
+// The glyph handle table starts out with room for this many handles, and
+// doubles in size whenever it runs out.
+static const uint32_t kGlyphHandlesInitialSize = 1024;
+
+// Each glyph's glyph data starts with its grid rect, grid atlas layer, number
+// of curves, and size, followed by its curves, its coverage map, its hull,
+// and then its overflow lists. Glyphs without curves have no coverage map
+// or hull.
+static const uint8_t kGlyphHeaderPixels = 4;
+
+// Each curve takes one 16 byte texel of the glyph data's RGBA32UI view
+// (see write_bezier_to_buffer), so glyph data is reserved in multiples of
+// that to keep every glyph's curves aligned to it. That's 4 bytes of
+// padding per curve, for a single fetch. Packing the points into 10 bits
+// each would fit 8 bytes, but curves are shared by every cell they cross,
+// so they can only be relative to the glyph, and 1/1024 of a glyph shows
+// as uneven edges once text is drawn a few hundred pixels tall.
+static const uint8_t kCurvePixels = 4;
+static const uint8_t kGlyphDataAlign = 4;
+static const uint8_t kGlyphCoveragePixels = kVGridCoverageSize * kVGridCoverageSize / kAtlasChannels;
+
+// The hull is an octagon around the glyph's curves: the glyph's box with
+// each corner cut off by a 45 degree line (see write_glyph_hull_to_buffer).
+static const uint8_t kGlyphHullPixels = 2;
+
+// Pixel offset of a glyph's overflow lists from the start of its glyph data
+static inline uint32_t glyph_overflow_offset(uint32_t curveCount)
+{
+	return kGlyphHeaderPixels + curveCount*kCurvePixels
+		+ (curveCount > 0 ? kGlyphCoveragePixels + kGlyphHullPixels : 0);
+}
+
+// Rounds a number of glyph data pixels up to a multiple of kGlyphDataAlign
+static inline uint32_t align_glyph_pixels(uint32_t pixels)
+{
+	return (pixels + kGlyphDataAlign - 1) & ~(uint32_t)(kGlyphDataAlign - 1);
+}
+
+// Grows a dirty grid rect (x0, y0, x1, y1, exclusive) to include a grid rect.
+static inline void grow_dirty_rect(
+	uint16_t *rect,
+	uint16_t x,
+	uint16_t y,
+	uint16_t w,
+	uint16_t h)
+{
+	if (rect[0] >= rect[2]) {
+		rect[0] = x;
+		rect[1] = y;
+		rect[2] = x + w;
+		rect[3] = y + h;
+	} else {
+		rect[0] = std::min(rect[0], x);
+		rect[1] = std::min(rect[1], y);
+		rect[2] = std::max(rect[2], uint16_t(x + w));
+		rect[3] = std::max(rect[3], uint16_t(y + h));
+	}
+}
+
+// Grows a dirty range (begin, end, exclusive) to include a range.
+static inline void grow_dirty_range(uint32_t *range, uint32_t begin, uint32_t end)
+{
+	if (range[0] >= range[1]) {
+		range[0] = begin;
+		range[1] = end;
+	} else {
+		range[0] = std::min(range[0], begin);
+		range[1] = std::max(range[1], end);
+	}
+}
+
+// Grows the atlas group's dirty grid rect to include a grid rect.
+static inline void mark_grid_dirty(
+	GLFontManager::AtlasGroup *group,
+	uint16_t x,
+	uint16_t y,
+	uint16_t w,
+	uint16_t h)
+{
+	grow_dirty_rect(group->dirtyGridRect, x, y, w, h);
+}
+
+static inline void mark_grid_all_dirty(GLFontManager::AtlasGroup *group)
+{
+	mark_grid_dirty(group, 0, 0, kGridAtlasSize, kGridAtlasSize);
+}
+
+// Grows the dirty range of glyph data to include a range of pixels.
+static inline void mark_glyph_data_dirty(
+	GLFontManager &manager,
+	uint32_t begin,
+	uint32_t end)
+{
+	grow_dirty_range(manager.dirtyGlyphData, begin, end);
+}
+
+#endif
@@ -0,0 +1,399 @@
+#include <gllabel.hpp>
+#include "atlas.hpp"
+#include "glyph_cache.hpp"
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define sq(x) ((x)*(x))
+
+// An atlas cache file is laid out as follows (all values are native-endian,
+// which is verified by kCacheByteOrder):
+//
+//   CacheHeader
+//   CacheAtlas[atlasCount]
+//   CacheFace[faceCount]
+//   CacheGlyph[glyphCount] (the glyphs of each face are contiguous)
+//   Grid atlas pages, one per atlas
+//   Glyph data, padded with free space up to the end of the file
+//
+// The pages and the glyph data are each aligned to kCachePageAlign, so that
+// they can be used straight from a memory mapping of the file.
+//
+// kCacheVersion must be bumped whenever the layout of any of these structs,
+// the Glyph struct, or the contents of the atlases changes.
+static const char kCacheMagic[4] = {'G', 'L', 'L', 'C'};
+static const uint32_t kCacheVersion = 12;
+static const uint32_t kCacheByteOrder = 0x01020304;
+static const uint64_t kCachePageAlign = 4096;
+static const size_t kCacheNameLen = 64;
+
+struct CacheHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint16_t gridAtlasSize;
+	uint16_t gridIndexSize; // bytes per curve index in the grid atlas
+	uint8_t gridMaxSize;
+	uint8_t atlasChannels;
+	uint16_t padding;
+	uint32_t atlasCount;
+	uint32_t faceCount;
+	uint32_t glyphCount;
+	uint32_t glyphDataSize; // pixels used
+	uint32_t glyphDataCapacity; // pixels in the file
+	uint32_t padding2;
+	uint64_t glyphDataOffset; // file offset
+};
+
+struct CacheAtlas
+{
+	uint64_t gridAtlasOffset; // file offset
+	uint16_t gridSkyline[kGridAtlasSize];
+	uint8_t full;
+	uint8_t padding[7];
+};
+
+struct CacheFace
+{
+	char family[kCacheNameLen];
+	char style[kCacheNameLen];
+	uint32_t firstGlyph;
+	uint32_t glyphCount;
+};
+
+struct CacheGlyph
+{
+	uint32_t glyphIndex;
+	GLFontManager::Glyph glyph;
+};
+
+static uint64_t align_up(uint64_t offset, uint64_t align)
+{
+	return (offset + align - 1) / align * align;
+}
+
+static void copy_name(char dst[kCacheNameLen], const char *src)
+{
+	memset(dst, 0, kCacheNameLen);
+	if (src) {
+		strncpy(dst, src, kCacheNameLen - 1);
+	}
+}
+
+static bool face_matches(FT_Face face, CacheFace *cacheFace)
+{
+	char family[kCacheNameLen], style[kCacheNameLen];
+	copy_name(family, face->family_name);
+	copy_name(style, face->style_name);
+	return memcmp(family, cacheFace->family, kCacheNameLen) == 0
+		&& memcmp(style, cacheFace->style, kCacheNameLen) == 0;
+}
+
+static bool write_padding(FILE *f, uint64_t to)
+{
+	static const uint8_t zeros[kCachePageAlign] = {};
+	long pos = ftell(f);
+	if (pos < 0 || (uint64_t)pos > to) {
+		return false;
+	}
+	return fwrite(zeros, 1, to - pos, f) == to - pos;
+}
+
+// Number of glyph data pixels a glyph loaded from an atlas cache owns: its
+// header, its curves, its coverage map and hull, and the overflow lists of
+// its grid cells, which each end with a 0 index (see
+// VGridAtlas::WriteVGridAt), rounded up like it was when reserved. Needed
+// for compacting the atlases (see SetMemoryBudget). Read straight from the
+// mapped file, whose size has already been checked, so returns false if the
+// glyph's data doesn't fit in the cache's glyph data or its grid doesn't fit
+// in its grid atlas.
+static bool cached_glyph_pixels(
+	const uint8_t *base,
+	const CacheHeader *cache,
+	const CacheAtlas *atlases,
+	uint32_t offset,
+	uint32_t *pixels)
+{
+	uint32_t available = cache->glyphDataSize;
+	if (offset % kGlyphDataAlign != 0 || offset > available
+		|| available - offset < kGlyphHeaderPixels) {
+		return false;
+	}
+	available -= offset;
+
+	const uint16_t *header = (const uint16_t *)(base + cache->glyphDataOffset
+		+ (uint64_t)offset*kAtlasChannels);
+	uint32_t overflowStart = glyph_overflow_offset(header[5]);
+	if (overflowStart > available) {
+		return false;
+	}
+	*pixels = overflowStart;
+	if (header[2] == 0 || header[3] == 0) {
+		*pixels = align_glyph_pixels(*pixels);
+		return *pixels <= available;
+	}
+	if (header[4] >= cache->atlasCount
+		|| (uint32_t)header[0] + header[2] > kGridAtlasSize
+		|| (uint32_t)header[1] + header[3] > kGridAtlasSize) {
+		return false;
+	}
+
+	const uint16_t *atlas = (const uint16_t *)(base + atlases[header[4]].gridAtlasOffset);
+	for (uint32_t y = header[1]; y < (uint32_t)header[1] + header[3]; y++) {
+		for (uint32_t x = header[0]; x < (uint32_t)header[0] + header[2]; x++) {
+			const uint16_t *cell = atlas + (y*kGridAtlasSize + x)*kAtlasChannels;
+			if (cell[3] != 1) {
+				continue;
+			}
+
+			// The list must end with a 0 index within the glyph data
+			if (cell[2] >= available - overflowStart) {
+				return false;
+			}
+			const uint16_t *list = header + (overflowStart + cell[2])*2;
+			uint32_t maxCount = (available - overflowStart - cell[2])*2;
+			uint32_t count = 0;
+			while (count < maxCount && list[count] != 0) {
+				count++;
+			}
+			if (count == maxCount) {
+				return false;
+			}
+			*pixels = std::max(*pixels, overflowStart + cell[2] + (count + 2)/2);
+		}
+	}
+	*pixels = align_glyph_pixels(*pixels);
+	return *pixels <= available;
+}
+
+bool GLFontManager::SaveAtlasCache(std::string cachePath)
+{
+	this->CommitPreparedGlyphs(true);
+
+	CacheHeader header{};
+	memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+	header.version = kCacheVersion;
+	header.byteOrder = kCacheByteOrder;
+	header.gridAtlasSize = kGridAtlasSize;
+	header.gridIndexSize = sizeof(uint16_t);
+	header.gridMaxSize = kGridMaxSize;
+	header.atlasChannels = kAtlasChannels;
+	header.atlasCount = this->atlases.size();
+
+	// Group the glyphs by face
+	std::vector<FT_Face> faceOrder;
+	std::map<FT_Face, std::vector<const GlyphCache::Entry *>> faceGlyphs;
+	for (const GlyphCache::Entry &entry : this->glyphs->Entries()) {
+		if (!entry.face) {
+			continue;
+		}
+		if (faceGlyphs.find(entry.face) == faceGlyphs.end()) {
+			faceOrder.push_back(entry.face);
+		}
+		faceGlyphs[entry.face].push_back(&entry);
+	}
+
+	std::vector<CacheFace> faces;
+	std::vector<CacheGlyph> glyphs;
+	for (FT_Face ftFace : faceOrder) {
+		CacheFace face{};
+		copy_name(face.family, ftFace->family_name);
+		copy_name(face.style, ftFace->style_name);
+		face.firstGlyph = glyphs.size();
+		face.glyphCount = faceGlyphs[ftFace].size();
+		faces.push_back(face);
+
+		for (const GlyphCache::Entry *entry : faceGlyphs[ftFace]) {
+			glyphs.push_back(CacheGlyph{entry->glyphIndex, entry->glyph});
+		}
+
+		// Sorted, so that loading can check each glyph index is unique
+		std::sort(glyphs.begin() + face.firstGlyph, glyphs.end(),
+			[](const CacheGlyph &a, const CacheGlyph &b) {
+				return a.glyphIndex < b.glyphIndex;
+			});
+	}
+	header.faceCount = faces.size();
+	header.glyphCount = glyphs.size();
+
+	uint64_t pageOffset = align_up(sizeof(CacheHeader)
+		+ this->atlases.size() * sizeof(CacheAtlas)
+		+ faces.size() * sizeof(CacheFace)
+		+ glyphs.size() * sizeof(CacheGlyph), kCachePageAlign);
+
+	std::vector<CacheAtlas> atlases;
+	for (AtlasGroup &group : this->atlases) {
+		CacheAtlas atlas{};
+		atlas.gridAtlasOffset = pageOffset;
+		pageOffset = align_up(pageOffset + kGridAtlasBytes, kCachePageAlign);
+		std::copy(group.gridSkyline.begin(), group.gridSkyline.end(), atlas.gridSkyline);
+		atlas.full = group.full;
+		atlases.push_back(atlas);
+	}
+
+	// The free space up to the next page boundary can be appended to once
+	// the cache is loaded.
+	uint64_t glyphDataBytes = (uint64_t)this->glyphDataSize * kAtlasChannels;
+	header.glyphDataOffset = pageOffset;
+	header.glyphDataSize = this->glyphDataSize;
+	header.glyphDataCapacity = align_up(glyphDataBytes, kCachePageAlign) / kAtlasChannels;
+	uint64_t fileSize = pageOffset + (uint64_t)header.glyphDataCapacity * kAtlasChannels;
+
+	FILE *f = fopen(cachePath.c_str(), "wb");
+	if (!f) {
+		std::cerr << "Failed to open atlas cache " << cachePath << "\n";
+		return false;
+	}
+
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1
+		&& fwrite(atlases.data(), sizeof(CacheAtlas), atlases.size(), f) == atlases.size()
+		&& fwrite(faces.data(), sizeof(CacheFace), faces.size(), f) == faces.size()
+		&& fwrite(glyphs.data(), sizeof(CacheGlyph), glyphs.size(), f) == glyphs.size();
+
+	for (size_t i = 0; ok && i < atlases.size(); i++) {
+		ok = write_padding(f, atlases[i].gridAtlasOffset)
+			&& fwrite(this->atlases[i].gridAtlas, kGridAtlasBytes, 1, f) == 1;
+	}
+	ok = ok && write_padding(f, header.glyphDataOffset)
+		&& (glyphDataBytes == 0 || fwrite(this->glyphData, glyphDataBytes, 1, f) == 1)
+		&& write_padding(f, fileSize);
+
+	if (fclose(f) != 0 || !ok) {
+		std::cerr << "Failed to write atlas cache " << cachePath << "\n";
+		return false;
+	}
+	return true;
+}
+
+bool GLFontManager::LoadAtlasCache(std::string cachePath, std::vector<FT_Face> faces)
+{
+	if (this->atlases.size() > 0 || this->cacheMapping || this->shared) {
+		std::cerr << "Atlas cache must be loaded before any glyphs\n";
+		return false;
+	}
+
+	int fd = open(cachePath.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+		close(fd);
+		return false;
+	}
+
+	// The mapping is private, so atlas pages that still have room can be
+	// appended to without modifying the file.
+	size_t size = st.st_size;
+	void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		return false;
+	}
+
+	uint8_t *base = (uint8_t *)mapping;
+	CacheHeader *header = (CacheHeader *)base;
+	CacheAtlas *atlases = (CacheAtlas *)(header + 1);
+	CacheFace *cacheFaces = (CacheFace *)(atlases + header->atlasCount);
+	CacheGlyph *glyphs = (CacheGlyph *)(cacheFaces + header->faceCount);
+
+	bool valid = memcmp(header->magic, kCacheMagic, sizeof(kCacheMagic)) == 0
+		&& header->version == kCacheVersion
+		&& header->byteOrder == kCacheByteOrder
+		&& header->gridAtlasSize == kGridAtlasSize
+		&& header->gridIndexSize == sizeof(uint16_t)
+		&& header->gridMaxSize == kGridMaxSize
+		&& header->atlasChannels == kAtlasChannels
+		&& sizeof(CacheHeader)
+			+ (uint64_t)header->atlasCount * sizeof(CacheAtlas)
+			+ (uint64_t)header->faceCount * sizeof(CacheFace)
+			+ (uint64_t)header->glyphCount * sizeof(CacheGlyph) <= size
+		&& header->glyphDataSize <= header->glyphDataCapacity
+		&& header->glyphDataOffset
+			+ (uint64_t)header->glyphDataCapacity * kAtlasChannels <= size;
+
+	for (uint32_t i = 0; valid && i < header->atlasCount; i++) {
+		valid = atlases[i].gridAtlasOffset + kGridAtlasBytes <= size;
+	}
+	for (uint32_t i = 0; valid && i < header->faceCount; i++) {
+		valid = (uint64_t)cacheFaces[i].firstGlyph
+			+ cacheFaces[i].glyphCount <= header->glyphCount;
+	}
+
+	// Every glyph's data and grid must be within the file, and each face's
+	// glyphs sorted by glyph index, without duplicates
+	std::vector<uint32_t> glyphPixels(valid ? header->glyphCount : 0);
+	for (uint32_t i = 0; valid && i < header->faceCount; i++) {
+		CacheGlyph *faceGlyphs = glyphs + cacheFaces[i].firstGlyph;
+		for (uint32_t j = 0; valid && j < cacheFaces[i].glyphCount; j++) {
+			valid = j == 0 || faceGlyphs[j - 1].glyphIndex < faceGlyphs[j].glyphIndex;
+		}
+	}
+	// Glyphs are all committed before saving, so none can be pending
+	for (uint32_t i = 0; valid && i < header->glyphCount; i++) {
+		uint32_t offset = glyphs[i].glyph.glyphDataOffset;
+		valid = !glyphs[i].glyph.pending && (offset == kNoGlyphData
+			|| cached_glyph_pixels(base, header, atlases, offset, &glyphPixels[i]));
+	}
+
+	if (!valid) {
+		std::cerr << "Invalid or outdated atlas cache " << cachePath << "\n";
+		munmap(mapping, size);
+		return false;
+	}
+
+	this->cacheMapping = mapping;
+	this->cacheMappingSize = size;
+
+	for (uint32_t i = 0; i < header->atlasCount; i++) {
+		AtlasGroup group{};
+		group.gridAtlas = (uint16_t *)(base + atlases[i].gridAtlasOffset);
+		group.gridSkyline.assign(atlases[i].gridSkyline, atlases[i].gridSkyline + kGridAtlasSize);
+		group.full = atlases[i].full;
+		mark_grid_all_dirty(&group);
+		this->atlases.push_back(group);
+	}
+
+	this->glyphData = base + header->glyphDataOffset;
+	this->glyphDataSize = header->glyphDataSize;
+	this->glyphDataCapacity = header->glyphDataCapacity;
+	mark_glyph_data_dirty(*this, 0, this->glyphDataSize);
+
+	for (FT_Face face : faces) {
+		for (uint32_t i = 0; i < header->faceCount; i++) {
+			if (!face || !face_matches(face, &cacheFaces[i])) {
+				continue;
+			}
+
+			// Handles in the cache were assigned by the process that
+			// saved it
+			CacheGlyph *faceGlyphs = glyphs + cacheFaces[i].firstGlyph;
+			for (uint32_t j = 0; j < cacheFaces[i].glyphCount; j++) {
+				uint32_t glyphIndex = faceGlyphs[j].glyphIndex;
+				Glyph *glyph = this->glyphs->Insert(face, glyphIndex, faceGlyphs[j].glyph);
+				glyph->handle = kNoGlyphHandle;
+
+				uint32_t pixels = 0, cells = 0;
+				if (glyph->glyphDataOffset != kNoGlyphData) {
+					const uint16_t *header = (const uint16_t *)(this->glyphData
+						+ (size_t)glyph->glyphDataOffset*kAtlasChannels);
+					pixels = glyphPixels[cacheFaces[i].firstGlyph + j];
+					cells = header[2]*header[3];
+				}
+				this->SetGlyphHandle(glyph, face, glyphIndex, pixels, cells);
+			}
+			break;
+		}
+	}
+
+	return true;
+}
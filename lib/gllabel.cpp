@@ -19,618 +19,2615 @@
 #include <gllabel.hpp>
 #include "vgrid.hpp"
 #include "outline.hpp"
+#include "atlas.hpp"
+#include "glyph_cache.hpp"
+#include "glyph_prep.hpp"
+#include "shared_atlas.hpp"
+#include "shaper.hpp"
+#include "stream_buffer.hpp"
 #include <set>
+#include <cmath>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <sys/mman.h>
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include FT_ADVANCES_H
 
 #define sq(x) ((x)*(x))
 
 static GLuint loadShaderProgram(const char *vsCodeC, const char *fsCodeC);
 
+// How far quadratics may stray from the cubics they approximate, in pixels
+// at the cubic target size (see SetCubicTargetSize)
+static const double kCubicTolerancePixels = 0.25;
+
+// Coverage maps are kVGridCoverageSize texels square, so they look fine up
+// to about that many pixels
+static const float kDefaultLODThreshold = kVGridCoverageSize;
+
 std::shared_ptr<GLFontManager> GLFontManager::singleton = nullptr;
+const uint32_t GLFontManager::kNoGlyphData;
+const uint32_t GLFontManager::kNoGlyphHandle;
 
 namespace {
 extern const char *kGlyphVertexShader;
 extern const char *kGlyphFragmentShader;
 }
 
-static const uint8_t kGridMaxSize = 20;
-static const uint16_t kGridAtlasSize = 256; // Fits exactly 1024 8x8 grids
-static const uint16_t kBezierAtlasSize = 256; // Fits around 700-1000 glyphs, depending on their curves
-static const uint8_t kAtlasChannels = 4; // Must be 4 (RGBA), otherwise code breaks
+
+uint32_t GLLabel::lastVersion = 0;
+
+static const GLLabel::Color kCaretColor = {0,0,255,100};
 
 GLLabel::GLLabel()
-: showingCaret(false), caretPosition(0), prevTime(0)
+: textSize(0), pendingGlyphs(0), pendingGeneration(0), streamVertexArray(0),
+  caretGlyph(nullptr), caretInstance{}, caretPending(false), showingCaret(false), caretPosition(0), prevTime(0), caretTime(0)
 {
 	// this->lastColor = {0,0,0,255};
 	this->manager = GLFontManager::GetFontManager();
 	// this->lastFace = this->manager->GetDefaultFont();
 	// this->manager->LoadASCII(this->lastFace);
 
-	glGenBuffers(1, &this->vertBuffer);
 	glGenBuffers(1, &this->caretBuffer);
+	glGenVertexArrays(1, &this->caretVertexArray);
+	this->manager->BindVertexArray(this->caretVertexArray);
+	SetInstanceAttribs(this->caretBuffer);
 }
 
 GLLabel::~GLLabel()
 {
-	glDeleteBuffers(1, &this->vertBuffer);
+	for (Block &block : this->blocks) {
+		for (GLFontManager::Glyph *glyph : block.glyphs) {
+			this->manager->ReleaseGlyph(glyph);
+		}
+		this->DeleteBlockBuffers(block);
+	}
+	if (this->caretGlyph) {
+		this->manager->ReleaseGlyph(this->caretGlyph);
+	}
 	glDeleteBuffers(1, &this->caretBuffer);
+	this->manager->DeleteVertexArray(&this->caretVertexArray);
+	this->manager->DeleteVertexArray(&this->streamVertexArray);
+}
+
+GLLabel::GlyphInstance GLLabel::MakeGlyphInstance(
+	GLFontManager::Glyph *glyph,
+	glm::vec2 origin,
+	Color color)
+{
+	GlyphInstance instance;
+	instance.pos = origin + glm::vec2(glyph->offset[0], glyph->offset[1]);
+	instance.color = color;
+
+	// Glyphs without glyph data (no curves, or too many) have no handle,
+	// or a handle without glyph data, and aren't drawn
+	instance.data = glyph->handle;
+	return instance;
 }
 
-void GLLabel::InsertText(std::u32string text, size_t index, glm::vec4 color, FT_Face face)
+// Pen position after the character at index, relative to the block origin.
+glm::vec2 GLLabel::PenAfter(Block &block, size_t index)
 {
-	if (index > this->text.size()) {
-		index = this->text.size();
+	GLFontManager::Glyph *glyph = block.glyphs[index];
+	glm::vec2 pen = block.instances[index].pos;
+	if (glyph) {
+		return pen - glm::vec2(glyph->offset[0], glyph->offset[1])
+			+ glm::vec2(glyph->advance + block.spacing[index], 0);
 	}
 
-	this->text.insert(index, text);
-	this->glyphs.insert(this->glyphs.begin() + index, text.size(), nullptr);
+	if (block.text[index] == '\n') {
+		return glm::vec2(0, pen.y - block.faces[index]->height);
+	}
+	return pen + glm::vec2(block.spacing[index], 0);
+}
 
-	size_t prevCapacity = this->verts.capacity();
-	GlyphVertex emptyVert{};
-	this->verts.insert(this->verts.begin() + index*6, text.size()*6, emptyVert);
+// Pen position before the character at index, relative to the block origin.
+// Index may be the size of the block.
+glm::vec2 GLLabel::PenAt(Block &block, size_t index)
+{
+	return index > 0 ? PenAfter(block, index - 1) : glm::vec2(0, 0);
+}
 
-	glm::vec2 appendOffset(0, 0);
-	if (index > 0) {
-		appendOffset = this->verts[(index-1)*6].pos;
-		if (this->glyphs[index-1]) {
-			appendOffset += -glm::vec2(this->glyphs[index-1]->offset[0], this->glyphs[index-1]->offset[1]) + glm::vec2(this->glyphs[index-1]->advance, 0);
+// Recomputes the positions of every character from 'from' to the end of
+// the block, and the block's height and bounds.
+void GLLabel::LayoutBlock(Block &block, size_t from)
+{
+	glm::vec2 pen = PenAt(block, from);
+	for (size_t i = from; i < block.text.size(); i++) {
+		GlyphInstance &instance = block.instances[i];
+		if (block.glyphs[i]) {
+			instance = MakeGlyphInstance(block.glyphs[i], pen, instance.color);
+		} else {
+			instance.pos = pen;
 		}
+		pen = PenAfter(block, i);
 	}
-	glm::vec2 initialAppendOffset = appendOffset;
 
-	for (size_t i = 0; i < text.size(); i++) {
-		if (text[i] == '\r') {
-			this->verts[(index + i)*6].pos = appendOffset;
-			continue;
-		} else if (text[i] == '\n') {
-			appendOffset.x = 0;
-			appendOffset.y -= face->height;
-			this->verts[(index + i)*6].pos = appendOffset;
-			continue;
-		} else if (text[i] == '\t') {
-			appendOffset.x += 2000;
-			this->verts[(index + i)*6].pos = appendOffset;
+	// Characters before 'from' may have moved too, if they were removed
+	// since, so the bounds are found again from scratch
+	block.boundsMin = glm::vec2(INFINITY);
+	block.boundsMax = glm::vec2(-INFINITY);
+	for (size_t i = 0; i < block.text.size(); i++) {
+		ExtendBounds(block, i);
+	}
+
+	block.height = -pen.y;
+	block.version = ++lastVersion;
+}
+
+// Grows the block's bounds to cover the instance of the character at index.
+void GLLabel::ExtendBounds(Block &block, size_t index)
+{
+	GLFontManager::Glyph *glyph = block.glyphs[index];
+	if (!glyph || glyph->size[0] == 0 || glyph->size[1] == 0) {
+		return;
+	}
+	glm::vec2 pos = block.instances[index].pos;
+	block.boundsMin = glm::min(block.boundsMin, pos);
+	block.boundsMax = glm::max(block.boundsMax, pos + glm::vec2(glyph->size[0], glyph->size[1]));
+}
+
+// Whether any of the block's bounds, moved to its origin and transformed, is
+// inside the clip volume. Bounds that reach behind the viewer are assumed
+// to be in view.
+bool GLLabel::IsBlockVisible(const Block &block, const glm::mat4 &transform)
+{
+	if (block.boundsMin.x > block.boundsMax.x) {
+		return false;
+	}
+
+	glm::vec2 min = block.origin + block.boundsMin;
+	glm::vec2 max = block.origin + block.boundsMax;
+	glm::vec4 corners[4] = {
+		transform * glm::vec4(min.x, min.y, 0, 1),
+		transform * glm::vec4(max.x, min.y, 0, 1),
+		transform * glm::vec4(min.x, max.y, 0, 1),
+		transform * glm::vec4(max.x, max.y, 0, 1),
+	};
+
+	// Out of view if every corner is past the same side
+	bool left = true, right = true, below = true, above = true;
+	for (const glm::vec4 &c : corners) {
+		if (c.w <= 0) {
+			return true;
+		}
+		left = left && c.x < -c.w;
+		right = right && c.x > c.w;
+		below = below && c.y < -c.w;
+		above = above && c.y > c.w;
+	}
+	return !(left || right || below || above);
+}
+
+// Returns the block containing the character at index, and sets *local to
+// the character's index in that block. An index at the end of the text is
+// in the last block.
+size_t GLLabel::FindBlock(size_t index, size_t *local)
+{
+	size_t b = 0;
+	while (b + 1 < this->blocks.size() && index >= this->blocks[b].text.size()) {
+		index -= this->blocks[b].text.size();
+		b++;
+	}
+	*local = index;
+	return b;
+}
+
+// Lays out the block from 'from', and splits it at newlines until each part
+// is at most kMaxBlockSize long, or is a single line. Each part ends after
+// the newline closest to half of kMaxBlockSize into it, so that parts have
+// room to grow. This takes one pass however long the block is, and each
+// character is only laid out once, so inserting a whole file at once is
+// about as fast as copying it.
+void GLLabel::LayoutAndSplitBlock(size_t b, size_t from)
+{
+	Block &block = this->blocks[b];
+	const std::u32string &text = block.text;
+	size_t size = text.size();
+
+	std::vector<size_t> splits; // Start of each new block
+	size_t start = 0;
+	while (size - start > kMaxBlockSize) {
+		// Never split after the last character, since then the last
+		// block would be empty
+		size_t mid = start + kMaxBlockSize / 2;
+		size_t before = text.rfind('\n', mid);
+		size_t after = text.find('\n', mid);
+		if (before != std::u32string::npos && before < start) {
+			before = std::u32string::npos;
+		}
+		if (after != std::u32string::npos
+			&& (after == size - 1 || (before != std::u32string::npos && after - start >= kMaxBlockSize))) {
+			after = std::u32string::npos;
+		}
+
+		size_t split;
+		if (before == std::u32string::npos && after == std::u32string::npos) {
+			break;
+		} else if (before == std::u32string::npos) {
+			split = after + 1;
+		} else if (after == std::u32string::npos) {
+			split = before + 1;
+		} else {
+			split = (mid - before < after - mid) ? before + 1 : after + 1;
+		}
+		splits.push_back(split);
+		start = split;
+	}
+	if (splits.empty()) {
+		LayoutBlock(block, from);
+		return;
+	}
+
+	std::vector<Block> parts(splits.size());
+	for (size_t i = 0; i < parts.size(); i++) {
+		size_t from = splits[i];
+		size_t to = i + 1 < splits.size() ? splits[i + 1] : size;
+		Block &part = parts[i];
+		part.text.assign(text, from, to - from);
+		part.faces.assign(block.faces.begin() + from, block.faces.begin() + to);
+		part.glyphs.assign(block.glyphs.begin() + from, block.glyphs.begin() + to);
+		part.instances.assign(block.instances.begin() + from, block.instances.begin() + to);
+		part.placeholders.assign(block.placeholders.begin() + from, block.placeholders.begin() + to);
+		part.spacing.assign(block.spacing.begin() + from, block.spacing.begin() + to);
+		for (size_t j = 0; j < part.placeholders.size(); j++) {
+			part.pendingGlyphs += part.placeholders[j];
+		}
+		block.pendingGlyphs -= part.pendingGlyphs;
+		LayoutBlock(part, 0);
+	}
+
+	block.text.erase(splits[0]);
+	block.faces.resize(splits[0]);
+	block.glyphs.resize(splits[0]);
+	block.instances.resize(splits[0]);
+	block.placeholders.resize(splits[0]);
+	block.spacing.resize(splits[0]);
+	LayoutBlock(block, std::min(from, splits[0]));
+
+	this->blocks.insert(this->blocks.begin() + b + 1,
+		std::make_move_iterator(parts.begin()),
+		std::make_move_iterator(parts.end()));
+}
+
+// Appends the next block to this one. The appended characters must then be
+// laid out again.
+void GLLabel::MergeNextBlock(size_t b)
+{
+	Block &block = this->blocks[b];
+	Block &next = this->blocks[b + 1];
+	block.text += next.text;
+	block.faces.insert(block.faces.end(), next.faces.begin(), next.faces.end());
+	block.glyphs.insert(block.glyphs.end(), next.glyphs.begin(), next.glyphs.end());
+	block.instances.insert(block.instances.end(), next.instances.begin(), next.instances.end());
+	block.placeholders.insert(block.placeholders.end(), next.placeholders.begin(), next.placeholders.end());
+	block.spacing.insert(block.spacing.end(), next.spacing.begin(), next.spacing.end());
+	block.pendingGlyphs += next.pendingGlyphs;
+	this->DeleteBlock(b + 1);
+}
+
+void GLLabel::DeleteBlock(size_t b)
+{
+	this->DeleteBlockBuffers(this->blocks[b]);
+	this->blocks.erase(this->blocks.begin() + b);
+}
+
+void GLLabel::DeleteBlockBuffers(Block &block)
+{
+	if (block.buffer) {
+		glDeleteBuffers(1, &block.buffer);
+		block.buffer = 0;
+	}
+	this->manager->DeleteVertexArray(&block.vertexArray);
+}
+
+void GLLabel::UpdateBlockOrigins(size_t from)
+{
+	for (size_t b = std::max(from, (size_t)1); b < this->blocks.size(); b++) {
+		Block &prev = this->blocks[b - 1];
+		this->blocks[b].origin = glm::vec2(0, prev.origin.y - prev.height);
+	}
+}
+
+void GLLabel::UploadBlock(Block &block)
+{
+	if (block.uploadedVersion == block.version && block.buffer) {
+		return;
+	}
+	if (!block.buffer) {
+		glGenBuffers(1, &block.buffer);
+		glGenVertexArrays(1, &block.vertexArray);
+		this->manager->BindVertexArray(block.vertexArray);
+		SetInstanceAttribs(block.buffer);
+	}
+
+	size_t bytes = block.instances.size() * sizeof(GlyphInstance);
+	glBindBuffer(GL_ARRAY_BUFFER, block.buffer);
+	glBufferData(GL_ARRAY_BUFFER, bytes, block.instances.data(), GL_DYNAMIC_DRAW);
+	block.uploadedVersion = block.version;
+	this->manager->stats.labelBytesUploaded += bytes;
+}
+
+// Writes the instances of every visible block into this frame's part of the
+// stream buffer, moved by their block's origin, and draws them all at once.
+void GLLabel::DrawStreamed(GLsizei vertexCount, const glm::mat4 &transform)
+{
+	size_t count = 0;
+	for (const Block &block : this->blocks) {
+		if (IsBlockVisible(block, transform)) {
+			count += block.instances.size();
+		}
+	}
+	if (count == 0) {
+		return;
+	}
+
+	size_t bytes = count * sizeof(GlyphInstance);
+	GlyphInstance *out = static_cast<GlyphInstance *>(this->stream->Begin(bytes));
+	if (!out) {
+		return;
+	}
+	// The mapping may be write-combined, so it's only ever written to
+	for (const Block &block : this->blocks) {
+		if (!IsBlockVisible(block, transform)) {
 			continue;
 		}
+		for (GlyphInstance instance : block.instances) {
+			instance.pos += block.origin;
+			*out++ = instance;
+		}
+	}
+	this->stream->End();
+	this->manager->stats.labelBytesUploaded += bytes;
+
+	if (!this->streamVertexArray) {
+		glGenVertexArrays(1, &this->streamVertexArray);
+	}
+	this->manager->BindVertexArray(this->streamVertexArray);
+	SetInstanceAttribs(this->stream->Buffer(), this->stream->Offset());
+	glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, vertexCount, count);
+	this->stream->Fence();
+}
+
+void GLLabel::SetStreaming(bool streaming)
+{
+	if (streaming == (bool)this->stream) {
+		return;
+	}
+	if (!streaming) {
+		this->stream.reset();
+		this->manager->DeleteVertexArray(&this->streamVertexArray);
+		return;
+	}
+
+	// Blocks are uploaded again if streaming is turned back off
+	this->stream.reset(new StreamBuffer());
+	for (Block &block : this->blocks) {
+		this->DeleteBlockBuffers(block);
+	}
+}
+
+// Rewrites the instances of glyphs that were drawn as placeholders and have
+// since been prepared.
+void GLLabel::RefreshPendingGlyphs()
+{
+	uint32_t generation = this->manager->GetGlyphGeneration();
+	if (this->pendingGlyphs == 0 || this->pendingGeneration == generation) {
+		return;
+	}
+	this->pendingGeneration = generation;
 
-		GLFontManager::Glyph *glyph = this->manager->GetGlyphForCodepoint(face, text[i]);
-		if (!glyph) {
-			this->verts[(index + i)*6].pos = appendOffset;
+	this->pendingGlyphs = 0;
+	for (Block &block : this->blocks) {
+		if (block.pendingGlyphs == 0) {
 			continue;
 		}
 
-		GlyphVertex v[6]{}; // Insertion code depends on v[0] equaling appendOffset (therefore it is also set before continue;s above)
-		v[0].pos = glm::vec2(0, 0);
-		v[1].pos = glm::vec2(glyph->size[0], 0);
-		v[2].pos = glm::vec2(0, glyph->size[1]);
-		v[3].pos = glm::vec2(glyph->size[0], glyph->size[1]);
-		v[4].pos = glm::vec2(0, glyph->size[1]);
-		v[5].pos = glm::vec2(glyph->size[0], 0);
-		for (unsigned int j = 0; j < 6; j++) {
-			v[j].pos += appendOffset;
-			v[j].pos[0] += glyph->offset[0];
-			v[j].pos[1] += glyph->offset[1];
-
-			v[j].color = {(uint8_t)(color.r*255), (uint8_t)(color.g*255), (uint8_t)(color.b*255), (uint8_t)(color.a*255)};
-
-			// Encode both the bezier position and the norm coord into one int
-			// This theoretically could overflow, but the atlas position will
-			// never be over half the size of a uint16, so it's fine.
-			unsigned int k = (j < 4) ? j : 6 - j;
-			unsigned int normX = k & 1;
-			unsigned int normY = k > 1;
-			unsigned int norm = (normX << 1) + normY;
-			v[j].data = (glyph->bezierAtlasPos[0] << 2) + norm;
-			this->verts[(index + i)*6 + j] = v[j];
-		}
-
-		appendOffset.x += glyph->advance;
-		this->glyphs[index + i] = glyph;
-	}
-
-	// Shift everything after, if necessary
-	glm::vec2 deltaAppend = appendOffset - initialAppendOffset;
-	for (size_t i = index+text.size(); i < this->text.size(); i++) {
-		// If a newline is reached and no change in the y has happened, all
-		// glyphs which need to be moved have been moved.
-		if (this->text[i] == '\n') {
-			if (deltaAppend.y == 0) {
-				break;
-			}
-			if (deltaAppend.x < 0) {
-				deltaAppend.x = 0;
+		size_t landed = 0;
+		for (size_t i = 0; i < block.glyphs.size(); i++) {
+			if (!block.placeholders[i] || block.glyphs[i]->pending) {
+				continue;
 			}
+
+			// Placeholders have no offset, so their position is the origin
+			GlyphInstance &instance = block.instances[i];
+			instance = MakeGlyphInstance(block.glyphs[i], instance.pos, instance.color);
+			ExtendBounds(block, i);
+			block.placeholders[i] = false;
+			landed++;
 		}
 
-		for (unsigned int j = 0; j < 6; j++) {
-			this->verts[i*6 + j].pos += deltaAppend;
+		if (landed > 0) {
+			block.pendingGlyphs -= landed;
+			block.version = ++lastVersion;
 		}
+		this->pendingGlyphs += block.pendingGlyphs;
 	}
+}
+
+// Decodes UTF-8 into out, replacing it. Sequences that are invalid, overlong,
+// or encode surrogates become U+FFFD, one for each byte that can't start a
+// valid sequence.
+static void decode_utf8(const char *utf8, size_t length, std::u32string &out)
+{
+	out.resize(length); // Never needs more characters than bytes
+	const uint8_t *s = (const uint8_t *)utf8;
+	size_t n = 0;
+	for (size_t i = 0; i < length; ) {
+		uint8_t c = s[i];
+		if (c < 0x80) {
+			out[n++] = c;
+			i++;
+			continue;
+		}
+
+		size_t extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+		char32_t point = c & (0x3F >> extra);
+		bool valid = extra > 0 && c < 0xF5 && i + extra < length;
+		for (size_t j = 1; valid && j <= extra; j++) {
+			valid = (s[i + j] & 0xC0) == 0x80;
+			point = point << 6 | (s[i + j] & 0x3F);
+		}
+		static const char32_t kMinPoint[4] = {0, 0x80, 0x800, 0x10000};
+		if (valid && (point < kMinPoint[extra] || point > 0x10FFFF
+			|| (point >= 0xD800 && point <= 0xDFFF))) {
+			valid = false;
+		}
 
-	glBindBuffer(GL_ARRAY_BUFFER, this->vertBuffer);
+		out[n++] = valid ? point : 0xFFFD;
+		i += valid ? extra + 1 : 1;
+	}
+	out.resize(n);
+}
 
-	if (this->verts.capacity() != prevCapacity) {
-		// If the capacity changed, completely reupload the buffer
-		glBufferData(GL_ARRAY_BUFFER, this->verts.capacity() * sizeof(GlyphVertex), NULL, GL_DYNAMIC_DRAW);
-		glBufferSubData(GL_ARRAY_BUFFER, 0, this->verts.size() * sizeof(GlyphVertex), &this->verts[0]);
-	} else {
-		// Otherwise only upload the changed parts
-		glBufferSubData(GL_ARRAY_BUFFER,
-			index*6*sizeof(GlyphVertex),
-			(this->verts.size() - index*6)*sizeof(GlyphVertex),
-			&this->verts[index*6]);
+void GLLabel::InsertText(const char *utf8, size_t length, size_t index, glm::vec4 color, FT_Face face)
+{
+	// Reused, so that decoding doesn't allocate once it's big enough
+	static thread_local std::u32string text;
+	decode_utf8(utf8, length, text);
+	this->InsertText(text.data(), text.size(), index, color, face);
+}
+
+void GLLabel::InsertText(const char32_t *text, size_t length, size_t index, glm::vec4 color, FT_Face face)
+{
+	if (index > this->textSize) {
+		index = this->textSize;
+	}
+	if (length == 0) {
+		return;
+	}
+
+	this->RefreshPendingGlyphs();
+
+	if (this->blocks.empty()) {
+		this->blocks.push_back(Block{});
 	}
+
+	size_t local;
+	size_t b = this->FindBlock(index, &local);
+	Color c = {(uint8_t)(color.r*255), (uint8_t)(color.g*255), (uint8_t)(color.b*255), (uint8_t)(color.a*255)};
+	this->textSize += length;
 	caretTime = 0;
+
+	if (this->blocks[b].text.size() + length > kMaxBlockSize) {
+		this->InsertLongText(b, local, text, length, c, face);
+		return;
+	}
+
+	Block &block = this->blocks[b];
+	block.text.insert(local, text, length);
+	block.faces.insert(block.faces.begin() + local, length, face);
+	block.glyphs.insert(block.glyphs.begin() + local, length, nullptr);
+	block.placeholders.insert(block.placeholders.begin() + local, length, false);
+	block.spacing.insert(block.spacing.begin() + local, length, 0);
+
+	GlyphInstance emptyInstance{glm::vec2(0, 0), GLFontManager::kNoGlyphHandle, c};
+	block.instances.insert(block.instances.begin() + local, length, emptyInstance);
+
+	size_t from = this->ShapeBlock(block, local, local + length);
+	this->LayoutAndSplitBlock(b, from);
+	this->UpdateBlockOrigins(b + 1);
+}
+
+// Shapes the characters from 'from' to 'to', along with the rest of the runs
+// they are in, and replaces their glyphs. Runs never cross blocks, since
+// blocks end with a newline. Returns the start of the first run, from which
+// the block must be laid out again.
+size_t GLLabel::ShapeBlock(Block &block, size_t from, size_t to)
+{
+	auto endsRun = [&](size_t i) {
+		return i == 0 || i == block.text.size() || Shaper::EndsRun(block.text[i - 1])
+			|| block.faces[i - 1] != block.faces[i];
+	};
+	while (!endsRun(from)) {
+		from--;
+	}
+	while (!endsRun(to)) {
+		to++;
+	}
+
+	// Reused, so that shaping doesn't allocate once they're big enough
+	static thread_local std::vector<uint32_t> glyphIndices;
+	static thread_local std::vector<int16_t> spacing;
+	glyphIndices.resize(to - from);
+	spacing.resize(to - from);
+	for (size_t start = from; start < to; ) {
+		size_t end = start + 1;
+		while (!endsRun(end)) {
+			end++;
+		}
+		this->manager->shaper->Shape(
+			block.faces[start],
+			block.text.data() + start,
+			end - start,
+			this->features,
+			glyphIndices.data() + (start - from),
+			spacing.data() + (start - from));
+		start = end;
+	}
+
+	// The new glyph is retained before the old one is released, so that
+	// characters that keep their glyph never let go of it
+	for (size_t i = from; i < to; i++) {
+		bool placeholder;
+		GLFontManager::Glyph *glyph = this->LoadGlyph(block.faces[i], glyphIndices[i - from], &placeholder);
+		if (block.placeholders[i]) {
+			block.pendingGlyphs--;
+			this->pendingGlyphs--;
+		}
+		this->manager->ReleaseGlyph(block.glyphs[i]);
+
+		block.glyphs[i] = glyph;
+		block.placeholders[i] = placeholder;
+		block.pendingGlyphs += placeholder;
+		block.spacing[i] = spacing[i - from];
+	}
+	return from;
+}
+
+void GLLabel::SetFeatures(GLFontManager::Features features)
+{
+	this->features = features;
+	this->RefreshPendingGlyphs();
+	for (Block &block : this->blocks) {
+		this->ShapeBlock(block, 0, block.text.size());
+		LayoutBlock(block, 0);
+	}
+	this->UpdateBlockOrigins(0);
+}
+
+// Returns the retained glyph of a glyph index, or nullptr for characters
+// that aren't drawn (Shaper::kNoGlyph). Sets *placeholder if the glyph is
+// still pending.
+GLFontManager::Glyph * GLLabel::LoadGlyph(FT_Face face, uint32_t glyphIndex, bool *placeholder)
+{
+	*placeholder = false;
+	if (glyphIndex == Shaper::kNoGlyph) {
+		return nullptr;
+	}
+
+	GLFontManager::Glyph *glyph = this->manager->RequestGlyphForIndex(face, glyphIndex);
+	this->manager->RetainGlyph(glyph);
+	if (glyph && glyph->pending) {
+		*placeholder = true;
+		this->pendingGlyphs++;
+	}
+	return glyph;
+}
+
+// Moves the characters of a block from 'start' on to the end of another,
+// without laying out either.
+void GLLabel::MoveBlockChars(Block &from, size_t start, Block &to)
+{
+	to.text.append(from.text, start, std::u32string::npos);
+	to.faces.insert(to.faces.end(), from.faces.begin() + start, from.faces.end());
+	to.glyphs.insert(to.glyphs.end(), from.glyphs.begin() + start, from.glyphs.end());
+	to.instances.insert(to.instances.end(), from.instances.begin() + start, from.instances.end());
+	to.placeholders.insert(to.placeholders.end(), from.placeholders.begin() + start, from.placeholders.end());
+	to.spacing.insert(to.spacing.end(), from.spacing.begin() + start, from.spacing.end());
+
+	size_t moved = 0;
+	for (size_t i = start; i < from.placeholders.size(); i++) {
+		moved += from.placeholders[i];
+	}
+	from.pendingGlyphs -= moved;
+	to.pendingGlyphs += moved;
+
+	from.text.erase(start);
+	from.faces.resize(start);
+	from.glyphs.resize(start);
+	from.instances.resize(start);
+	from.placeholders.resize(start);
+	from.spacing.resize(start);
+}
+
+// Inserts text that makes the block too long. Rather than inserting it all
+// into the block and then splitting it, the block's characters and the text
+// are split into new blocks as they are copied. A block ends after the first
+// newline past half of kMaxBlockSize, or, if it gets longer than
+// kMaxBlockSize before then, after its last newline. The sizes of the new
+// blocks are found first, so that each is allocated once, and every
+// character is copied, shaped and laid out once. Inserting a whole file into a label
+// takes about as long as copying it.
+void GLLabel::InsertLongText(size_t b, size_t local, const char32_t *text, size_t length, Color color, FT_Face face)
+{
+	// The block's characters come before and after the text
+	Block old{};
+	MoveBlockChars(this->blocks[b], 0, old);
+	size_t total = old.text.size() + length;
+	auto charAt = [&](size_t i) {
+		return i < local ? old.text[i]
+			: i < local + length ? text[i - local]
+			: old.text[i - length];
+	};
+
+	std::vector<size_t> sizes(1, 0);
+	size_t lastNewline = std::u32string::npos; // In the last block
+	for (size_t i = 0; i < total; i++) {
+		if (sizes.back() >= kMaxBlockSize && lastNewline != std::u32string::npos) {
+			size_t moved = sizes.back() - (lastNewline + 1);
+			sizes.back() -= moved;
+			sizes.push_back(moved);
+			lastNewline = std::u32string::npos;
+		}
+
+		sizes.back()++;
+		if (charAt(i) == '\n') {
+			if (sizes.back() >= kMaxBlockSize / 2 && i + 1 < total) {
+				sizes.push_back(0);
+				lastNewline = std::u32string::npos;
+			} else {
+				lastNewline = sizes.back() - 1;
+			}
+		}
+	}
+
+	// The first block stays in place, keeping its buffer
+	std::vector<Block> parts(sizes.size() - 1);
+	GlyphInstance emptyInstance{glm::vec2(0, 0), GLFontManager::kNoGlyphHandle, color};
+	size_t i = 0;
+	for (size_t p = 0; p < sizes.size(); p++) {
+		Block &part = p == 0 ? this->blocks[b] : parts[p - 1];
+		part.text.reserve(sizes[p]);
+		part.faces.reserve(sizes[p]);
+		part.glyphs.reserve(sizes[p]);
+		part.instances.reserve(sizes[p]);
+		part.placeholders.reserve(sizes[p]);
+		part.spacing.reserve(sizes[p]);
+
+		// The text's glyphs are loaded once the part is filled, by
+		// shaping it along with the runs around it
+		size_t start = i;
+		for (size_t end = i + sizes[p]; i < end; i++) {
+			if (i >= local && i < local + length) {
+				part.text.push_back(text[i - local]);
+				part.faces.push_back(face);
+				part.glyphs.push_back(nullptr);
+				part.instances.push_back(emptyInstance);
+				part.placeholders.push_back(false);
+				part.spacing.push_back(0);
+			} else {
+				size_t o = i < local ? i : i - length;
+				part.text.push_back(old.text[o]);
+				part.faces.push_back(old.faces[o]);
+				part.glyphs.push_back(old.glyphs[o]);
+				part.instances.push_back(old.instances[o]);
+				part.placeholders.push_back(old.placeholders[o]);
+				part.spacing.push_back(old.spacing[o]);
+				part.pendingGlyphs += old.placeholders[o];
+			}
+		}
+
+		// Only the first block's characters before the text, and before
+		// the run the text starts in, are still where they were
+		size_t from = p == 0 ? std::min(local, sizes[0]) : 0;
+		size_t textFrom = std::max(local, start) - start;
+		size_t textTo = std::max(std::min(local + length, i), start) - start;
+		if (textFrom < textTo) {
+			from = std::min(from, this->ShapeBlock(part, textFrom, textTo));
+		}
+		LayoutBlock(part, from);
+	}
+
+	this->blocks.insert(this->blocks.begin() + b + 1,
+		std::make_move_iterator(parts.begin()),
+		std::make_move_iterator(parts.end()));
+	this->UpdateBlockOrigins(b + 1);
 }
 
 void GLLabel::RemoveText(size_t index, size_t length)
 {
-	if (index >= this->text.size()) {
+	if (index >= this->textSize) {
+		return;
+	}
+	if (index + length > this->textSize) {
+		length = this->textSize - index;
+	}
+	if (length == 0) {
+		return;
+	}
+
+	// Removing everything, as SetText does, doesn't need to merge blocks
+	if (length == this->textSize) {
+		for (Block &block : this->blocks) {
+			for (GLFontManager::Glyph *glyph : block.glyphs) {
+				this->manager->ReleaseGlyph(glyph);
+			}
+			this->DeleteBlockBuffers(block);
+		}
+		this->blocks.clear();
+		this->textSize = 0;
+		this->pendingGlyphs = 0;
+		caretTime = 0;
 		return;
 	}
-	if (index + length > this->text.size()) {
-		length = this->text.size() - index;
+
+	this->RefreshPendingGlyphs();
+
+	size_t local;
+	size_t b = this->FindBlock(index, &local);
+	size_t from = local;
+
+	// Erase the range from each block it covers, deleting emptied blocks
+	size_t remaining = length;
+	for (size_t cur = b; remaining > 0; ) {
+		Block &block = this->blocks[cur];
+		size_t n = std::min(remaining, block.text.size() - local);
+		for (size_t i = local; i < local + n; i++) {
+			block.pendingGlyphs -= block.placeholders[i];
+			this->pendingGlyphs -= block.placeholders[i];
+			this->manager->ReleaseGlyph(block.glyphs[i]);
+		}
+
+		block.text.erase(local, n);
+		block.faces.erase(block.faces.begin() + local, block.faces.begin() + local + n);
+		block.glyphs.erase(block.glyphs.begin() + local, block.glyphs.begin() + local + n);
+		block.instances.erase(block.instances.begin() + local, block.instances.begin() + local + n);
+		block.placeholders.erase(block.placeholders.begin() + local, block.placeholders.begin() + local + n);
+		block.spacing.erase(block.spacing.begin() + local, block.spacing.begin() + local + n);
+		remaining -= n;
+
+		if (block.text.empty()) {
+			this->DeleteBlock(cur);
+			if (cur == b) {
+				from = 0;
+			}
+		} else {
+			cur++;
+		}
+		local = 0;
+	}
+	this->textSize -= length;
+
+	if (b < this->blocks.size()) {
+		// If the block lost its trailing newline, its last line continues
+		// into the next block. Small neighbours are merged too, so that
+		// deletes don't leave behind lots of tiny blocks.
+		while (b + 1 < this->blocks.size()
+			&& (this->blocks[b].text.back() != '\n'
+			|| this->blocks[b].text.size() + this->blocks[b + 1].text.size() <= kMaxBlockSize / 2)) {
+			this->MergeNextBlock(b);
+		}
+
+		// The runs either side of the removed text may now be one
+		from = this->ShapeBlock(this->blocks[b], from, from);
+		this->LayoutAndSplitBlock(b, from);
+	}
+	this->UpdateBlockOrigins(b);
+	caretTime = 0;
+}
+
+std::u32string GLLabel::GetText()
+{
+	std::u32string text;
+	text.reserve(this->textSize);
+	for (Block &block : this->blocks) {
+		text += block.text;
+	}
+	return text;
+}
+
+// Points the instance attributes of the bound vertex array at the instances
+// in buffer, starting offset bytes in.
+void GLLabel::SetInstanceAttribs(GLuint buffer, size_t offset)
+{
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(GlyphInstance), (void*)(offset + offsetof(GlyphInstance, pos)));
+	glVertexAttribIPointer(1, 1, GL_UNSIGNED_INT, sizeof(GlyphInstance), (void*)(offset + offsetof(GlyphInstance, data)));
+	glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(GlyphInstance), (void*)(offset + offsetof(GlyphInstance, color)));
+	for (GLuint i = 0; i < 3; i++) {
+		glEnableVertexAttribArray(i);
+		glVertexAttribDivisor(i, 1);
+	}
+}
+
+// Advances the caret blink timer, and returns whether the caret should be
+// drawn this frame. If so, its position is written to offset. The first time
+// the caret is drawn, this loads the caret glyph, so it must be called
+// before the atlases are uploaded.
+bool GLLabel::UpdateCaret(float time, glm::vec2 *offset)
+{
+	float deltaTime = time - prevTime;
+	this->caretTime += deltaTime;
+	this->prevTime = time;
+
+	if (!this->showingCaret || ((int)(this->caretTime*3/2)) % 2) {
+		return false;
+	}
+
+	this->RefreshPendingGlyphs();
+	bool makeInstance = false;
+	if (!this->caretGlyph) {
+		GLFontManager::Glyph *pipe = this->manager->GetGlyphForCodepoint(this->manager->GetDefaultFont(), '|');
+		if (!pipe) {
+			return false;
+		}
+		this->manager->RetainGlyph(pipe);
+		this->caretGlyph = pipe;
+		makeInstance = true;
+	}
+
+	// An instance made while the glyph was pending has the placeholder's
+	// offset, so it's made again once the glyph is ready
+	if (makeInstance || (this->caretPending && !this->caretGlyph->pending)) {
+		this->caretPending = this->caretGlyph->pending;
+		this->caretInstance = MakeGlyphInstance(this->caretGlyph, glm::vec2(0, 0), kCaretColor);
+
+		glBindBuffer(GL_ARRAY_BUFFER, this->caretBuffer);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(GlyphInstance), &this->caretInstance, GL_STATIC_DRAW);
+		this->manager->stats.labelBytesUploaded += sizeof(GlyphInstance);
+	}
+
+	*offset = glm::vec2(0, 0);
+	if (!this->blocks.empty()) {
+		size_t local;
+		size_t b = this->FindBlock(std::min(this->caretPosition, this->textSize), &local);
+		*offset = this->blocks[b].origin + PenAt(this->blocks[b], local);
 	}
+	return true;
+}
+
+void GLLabel::Render(float time, glm::mat4 transform)
+{
+	glm::vec2 caretOffset;
+	bool drawCaret = this->UpdateCaret(time, &caretOffset);
 
-	glm::vec2 startOffset(0, 0);
-	if (index > 0) {
-		startOffset = this->verts[(index-1)*6].pos;
-		if (this->glyphs[index-1]) {
-			startOffset += -glm::vec2(this->glyphs[index-1]->offset[0], this->glyphs[index-1]->offset[1]) + glm::vec2(this->glyphs[index-1]->advance, 0);
+	this->manager->UseGlyphShader(this->quality);
+	this->manager->UploadAtlases();
+	this->RefreshPendingGlyphs();
+	this->manager->UseAtlasTextures();
+	this->manager->UseBatchTransforms(0);
+
+	GLsizei vertexCount = GLFontManager::GetGlyphVertexCount(this->quality);
+	this->manager->BeginGPUTimer();
+	this->manager->EnableBlend();
+	if (this->stream) {
+		this->manager->SetShaderTransform(transform);
+		this->DrawStreamed(vertexCount, transform);
+	} else {
+		for (Block &block : this->blocks) {
+			if (!IsBlockVisible(block, transform)) {
+				continue;
+			}
+			this->UploadBlock(block);
+			this->manager->SetShaderTransform(glm::translate(transform, glm::vec3(block.origin.x, block.origin.y, 0)));
+			this->manager->BindVertexArray(block.vertexArray);
+			glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, vertexCount, block.instances.size());
 		}
 	}
 
-	// Since all the glyphs between index-1 and index+length have been erased,
-	// the end offset will be at index until it gets shifted back
-	glm::vec2 endOffset(0, 0);
-	// if (this->glyphs[index+length-1])
-	// {
-		endOffset = this->verts[index*6].pos;
-		if (this->glyphs[index+length-1]) {
-			endOffset += -glm::vec2(this->glyphs[index+length-1]->offset[0], this->glyphs[index+length-1]->offset[1]) + glm::vec2(this->glyphs[index+length-1]->advance, 0);
+	if (drawCaret) {
+		this->manager->SetShaderTransform(glm::translate(transform, glm::vec3(caretOffset.x, caretOffset.y, 0)));
+		this->manager->BindVertexArray(this->caretVertexArray);
+		glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, vertexCount, 1);
+	}
+
+	this->manager->EndGPUTimer();
+}
+
+
+GLFontManager::GLFontManager()
+: glyphs(new GlyphCache()), shaper(new Shaper()), defaultFace(nullptr), glContext(nullptr),
+  glyphData(nullptr), glyphDataSize(0), glyphDataCapacity(0), dirtyGlyphData{0, 0},
+  dirtyGlyphHandles{0, 0}, memoryBudget(0), memoryAfterEviction(0), frame(0), compacted(false),
+  lodThreshold(kDefaultLODThreshold), cubicTargetSize(0),
+  cacheMapping(nullptr), cacheMappingSize(0), stats{}, gpuTiming(false),
+  placeholderGlyph{}, hasPlaceholderGlyph(false), glyphGeneration(0)
+{
+	if (FT_Init_FreeType(&this->ft) != FT_Err_Ok) {
+		std::cerr << "Failed to load freetype\n";
+	}
+	this->UseContext(nullptr);
+}
+
+GLFontManager::~GLFontManager()
+{
+	this->workers.reset();
+
+	// Other contexts' objects can't be deleted from this one. They're
+	// freed with their contexts if they weren't released.
+	this->DeleteContextObjects(*this->glContext);
+	if (this->cacheMapping) {
+		munmap(this->cacheMapping, this->cacheMappingSize);
+	}
+	FT_Done_FreeType(this->ft);
+}
+
+// Packs the options of a quality into a key for glyphShaders. Sample counts
+// are rounded to the nearest of 1, 2, 4 and 8, and up when halfway between.
+static uint32_t quality_key(GLFontManager::Quality quality)
+{
+	uint32_t samples = 1;
+	while (samples < 8 && (uint32_t)quality.samples*2 >= samples*3) {
+		samples *= 2;
+	}
+	return samples | quality.boxWindow << 4 | quality.gammaCorrect << 5
+		| quality.tightQuads << 6;
+}
+
+// GL objects are only created once they are first needed for rendering, so
+// that glyphs can be prepared without a GL context (e.g. by gllabel-bake).
+// The options of the variant are #defines put before the shader's code,
+// along with the layout of the glyph data (see atlas.hpp).
+GLFontManager::GlyphShader GLFontManager::LoadGlyphShader(Quality quality)
+{
+	uint32_t key = quality_key(quality);
+	std::string defines = std::string("#version 330 core\n")
+		+ "#define numSS " + std::to_string(key & 0xF) + "\n"
+		+ "#define kBoxWindow " + std::to_string(quality.boxWindow) + "\n"
+		+ "#define kGammaCorrect " + std::to_string(quality.gammaCorrect) + "\n"
+		+ "#define kTightQuads " + std::to_string(quality.tightQuads) + "\n"
+		+ "#define kGlyphHeaderPixels " + std::to_string(kGlyphHeaderPixels) + "\n"
+		+ "#define kCurvePixels " + std::to_string(kCurvePixels) + "\n"
+		+ "#define kGlyphCoveragePixels " + std::to_string(kGlyphCoveragePixels) + "\n"
+		+ "#define kGlyphHullPixels " + std::to_string(kGlyphHullPixels) + "\n"
+		+ "#define kCoverageSize " + std::to_string(kVGridCoverageSize) + "\n";
+	std::string vertexShader = defines + kGlyphVertexShader;
+	std::string fragmentShader = defines + kGlyphFragmentShader;
+
+	GlyphShader shader;
+	GLuint program = loadShaderProgram(vertexShader.c_str(), fragmentShader.c_str());
+	shader.program = program;
+	shader.uGridAtlas = glGetUniformLocation(program, "uGridAtlas");
+	shader.uGlyphData = glGetUniformLocation(program, "uGlyphData");
+	shader.uGlyphCurves = glGetUniformLocation(program, "uGlyphCurves");
+	shader.uGlyphHandles = glGetUniformLocation(program, "uGlyphHandles");
+	shader.uTransform = glGetUniformLocation(program, "uTransform");
+	shader.uTransforms = glGetUniformLocation(program, "uTransforms");
+	shader.uBatched = glGetUniformLocation(program, "uBatched");
+	shader.uLODThreshold = glGetUniformLocation(program, "uLODThreshold");
+
+	glUseProgram(program);
+	this->glContext->glState.program = program;
+	glUniform1i(shader.uGridAtlas, 0);
+	glUniform1i(shader.uGlyphData, 1);
+	glUniform1i(shader.uTransforms, 2);
+	glUniform1i(shader.uGlyphHandles, 3);
+	glUniform1i(shader.uGlyphCurves, 4);
+	glUniform1i(shader.uBatched, 0);
+	shader.batched = false;
+	shader.lodThreshold = -1; // Set by UseGlyphShader
+
+	glm::mat4 iden = glm::mat4(1.0);
+	glUniformMatrix4fv(shader.uTransform, 1, GL_FALSE, glm::value_ptr(iden));
+	return shader;
+}
+
+std::shared_ptr<GLFontManager> GLFontManager::GetFontManager()
+{
+	if (!GLFontManager::singleton) {
+		GLFontManager::singleton = std::shared_ptr<GLFontManager>(new GLFontManager());
+	}
+	return GLFontManager::singleton;
+}
+
+// TODO: FT_Faces don't get destroyed... FT_Done_FreeType cleans them eventually,
+// but maybe use shared pointers?
+FT_Face GLFontManager::GetFontFromPath(std::string fontPath)
+{
+	FT_Face face;
+	if (FT_New_Face(this->ft, fontPath.c_str(), 0, &face)) {
+		return nullptr;
+	}
+	this->fontPaths[face] = fontPath;
+	return face;
+}
+
+FT_Face GLFontManager::GetFontFromName(std::string fontName)
+{
+	std::string path = fontName; // TODO
+	return GLFontManager::GetFontFromPath(path);
+}
+
+FT_Face GLFontManager::GetDefaultFont()
+{
+	// TODO
+	if (!defaultFace) {
+		defaultFace = GLFontManager::GetFontFromPath("fonts/LiberationSans-Regular.ttf");
+	}
+	return defaultFace;
+}
+
+// Adds an empty atlas group, allocating its grid atlas in storage.
+static GLFontManager::AtlasGroup * add_atlas_group(
+	std::vector<GLFontManager::AtlasGroup> &atlases,
+	std::vector<std::unique_ptr<uint16_t[]>> &storage)
+{
+	storage.emplace_back(new uint16_t[sq(kGridAtlasSize)*kAtlasChannels]());
+	GLFontManager::AtlasGroup group{};
+	group.gridAtlas = storage.back().get();
+	group.gridSkyline.assign(kGridAtlasSize, 0);
+	atlases.push_back(group);
+	return &atlases.back();
+}
+
+GLFontManager::AtlasGroup * GLFontManager::GetOpenAtlasGroup()
+{
+	if (this->atlases.size() == 0 || this->atlases[this->atlases.size()-1].full) {
+		return add_atlas_group(this->atlases, this->gridAtlasStorage);
+	}
+
+	return &this->atlases[this->atlases.size()-1];
+}
+
+#pragma pack(push, 1)
+struct bitmapdata
+{
+	char magic[2];
+	uint32_t size;
+	uint16_t res1;
+	uint16_t res2;
+	uint32_t offset;
+
+	uint32_t biSize;
+	uint32_t width;
+	uint32_t height;
+	uint16_t planes;
+	uint16_t bitCount;
+	uint32_t compression;
+	uint32_t imageSizeBytes;
+	uint32_t xpelsPerMeter;
+	uint32_t ypelsPerMeter;
+	uint32_t clrUsed;
+	uint32_t clrImportant;
+};
+#pragma pack(pop)
+
+static bool writeBMP(const char *path, uint32_t width, uint32_t height, uint16_t channels, uint8_t *data)
+{
+	FILE *f = fopen(path, "wb");
+	if (!f) {
+		return false;
+	}
+
+	bitmapdata head;
+	head.magic[0] = 'B';
+	head.magic[1] = 'M';
+	head.size = sizeof(bitmapdata) + width*height*channels;
+	head.res1 = 0;
+	head.res2 = 0;
+	head.offset = sizeof(bitmapdata);
+	head.biSize = 40;
+	head.width = width;
+	head.height = height;
+	head.planes = 1;
+	head.bitCount = 8*channels;
+	head.compression = 0;
+	head.imageSizeBytes = width*height*channels;
+	head.xpelsPerMeter = 0;
+	head.ypelsPerMeter = 0;
+	head.clrUsed = 0;
+	head.clrImportant = 0;
+
+	bool ok = fwrite(&head, sizeof(head), 1, f) == 1
+		&& fwrite(data, head.imageSizeBytes, 1, f) == 1;
+	return fclose(f) == 0 && ok;
+}
+
+bool GLFontManager::DumpAtlases(std::string pathPrefix)
+{
+	bool ok = true;
+	std::vector<uint8_t> lowBytes(sq(kGridAtlasSize)*kAtlasChannels);
+	for (size_t i = 0; i < this->atlases.size(); i++) {
+		std::string gridPath = pathPrefix + "gridAtlas" + std::to_string(i) + ".bmp";
+		std::copy(this->atlases[i].gridAtlas, this->atlases[i].gridAtlas + lowBytes.size(), lowBytes.begin());
+		ok = writeBMP(gridPath.c_str(), kGridAtlasSize, kGridAtlasSize, 4, lowBytes.data()) && ok;
+	}
+
+	// Written as rows of 256 pixels, padding out the last row
+	static const uint32_t kRowPixels = 256;
+	uint32_t rows = (this->glyphDataSize + kRowPixels - 1) / kRowPixels;
+	std::vector<uint8_t> glyphData(rows*kRowPixels*kAtlasChannels);
+	if (this->glyphDataSize > 0) {
+		memcpy(glyphData.data(), this->glyphData, this->glyphDataSize*kAtlasChannels);
+	}
+	std::string glyphDataPath = pathPrefix + "glyphData.bmp";
+	ok = writeBMP(glyphDataPath.c_str(), kRowPixels, rows, 4, glyphData.data()) && ok;
+	return ok;
+}
+
+void GLFontManager::SetGlyphLoadedCallback(GlyphLoadedCallback callback)
+{
+	this->glyphLoadedCallback = callback;
+}
+
+// A bezier is written as 6 16-bit integers and 2 of padding (16 bytes), so
+// the fragment shader fetches it as one RGBA32UI texel. Increments buffer by
+// the number of bytes written (always 16). Coords are scaled from
+// [0,glyphSize] to [0,UINT16_MAX].
+void write_bezier_to_buffer(uint16_t **pbuffer, Bezier2 *bezier, Vec2 *glyphSize)
+{
+	uint16_t *buffer = *pbuffer;
+	buffer[0] = bezier->e0.x * UINT16_MAX / glyphSize->w;
+	buffer[1] = bezier->e0.y * UINT16_MAX / glyphSize->h;
+	buffer[2] = bezier->c.x  * UINT16_MAX / glyphSize->w;
+	buffer[3] = bezier->c.y  * UINT16_MAX / glyphSize->h;
+	buffer[4] = bezier->e1.x * UINT16_MAX / glyphSize->w;
+	buffer[5] = bezier->e1.y * UINT16_MAX / glyphSize->h;
+	buffer[6] = 0;
+	buffer[7] = 0;
+	*pbuffer += kCurvePixels*2;
+}
+
+// The hull of a glyph is its box with each corner cut off by a 45 degree
+// line (in the glyph's normalized coordinates) that touches the curves'
+// control points, which the curves never go outside of. It's written as how
+// far each cut is from its corner along the box's edges, from 0 (no cut) to
+// UINT16_MAX (the whole edge), in the order bottom-left, bottom-right,
+// top-right, top-left. Rounding always makes the cuts smaller.
+static void write_glyph_hull_to_buffer(
+	uint16_t *buffer,
+	std::vector<Bezier2> &beziers,
+	Vec2 &glyphSize)
+{
+	float cuts[4] = {1, 1, 1, 1};
+	auto addPoint = [&](Vec2 p) {
+		float x = std::min(std::max(p.x / glyphSize.w, 0.0f), 1.0f);
+		float y = std::min(std::max(p.y / glyphSize.h, 0.0f), 1.0f);
+		cuts[0] = std::min(cuts[0], x + y);
+		cuts[1] = std::min(cuts[1], (1 - x) + y);
+		cuts[2] = std::min(cuts[2], (1 - x) + (1 - y));
+		cuts[3] = std::min(cuts[3], x + (1 - y));
+	};
+	for (const Bezier2 &bezier : beziers) {
+		addPoint(bezier.e0);
+		addPoint(bezier.c);
+		addPoint(bezier.e1);
+	}
+
+	// The cuts at either end of an edge must not overlap, which they only
+	// could if the glyph's box doesn't fit its curves exactly
+	for (int i = 0; i < 4; i++) {
+		float &a = cuts[i];
+		float &b = cuts[(i + 1) % 4];
+		if (a + b > 1) {
+			float scale = 1 / (a + b);
+			a *= scale;
+			b *= scale;
+		}
+	}
+
+	for (int i = 0; i < 4; i++) {
+		buffer[i] = std::floor(cuts[i] * UINT16_MAX);
+	}
+}
+
+void write_glyph_data_to_buffer(
+	uint8_t *buffer8,
+	std::vector<Bezier2> &beziers,
+	std::vector<uint8_t> &coverage,
+	Vec2 &glyphSize,
+	uint16_t gridX,
+	uint16_t gridY,
+	uint16_t gridWidth,
+	uint16_t gridHeight,
+	uint16_t atlasIndex,
+	uint16_t *size)
+{
+	uint16_t *buffer = (uint16_t *)buffer8;
+	buffer[0] = gridX;
+	buffer[1] = gridY;
+	buffer[2] = gridWidth;
+	buffer[3] = gridHeight;
+	buffer[4] = atlasIndex; // grid atlas texture array layer
+	buffer[5] = beziers.size(); // overflow lists start after the curves
+	buffer[6] = size[0]; // glyph quad size, in font units
+	buffer[7] = size[1];
+	buffer += 8;
+
+	for (size_t i = 0; i < beziers.size(); i++) {
+		write_bezier_to_buffer(&buffer, &beziers[i], &glyphSize);
+	}
+
+	// One byte per texel, so each pixel holds four
+	if (!beziers.empty()) {
+		uint8_t *coverageData = (uint8_t *)buffer;
+		memset(coverageData, 0, kGlyphCoveragePixels*kAtlasChannels);
+		memcpy(coverageData, coverage.data(),
+			std::min(coverage.size(), (size_t)kGlyphCoveragePixels*kAtlasChannels));
+		buffer += kGlyphCoveragePixels*2;
+		write_glyph_hull_to_buffer(buffer, beziers, glyphSize);
+	}
+}
+
+// Finds the lowest (then leftmost) position where a width by height grid
+// fits on top of the atlas' skyline, and raises the skyline over it.
+// Returns false if the grid doesn't fit anywhere.
+static bool pack_grid(
+	GLFontManager::AtlasGroup *atlas,
+	uint16_t width,
+	uint16_t height,
+	uint16_t pos[2])
+{
+	const std::vector<uint16_t> &skyline = atlas->gridSkyline;
+	uint16_t bestX = 0, bestY = kGridAtlasSize;
+	for (uint16_t x = 0; x + width <= kGridAtlasSize; x++) {
+		uint16_t y = *std::max_element(skyline.begin() + x, skyline.begin() + x + width);
+		if (y < bestY) {
+			bestX = x;
+			bestY = y;
+		}
+	}
+
+	if (bestY + height > kGridAtlasSize) {
+		return false;
+	}
+
+	std::fill(atlas->gridSkyline.begin() + bestX, atlas->gridSkyline.begin() + bestX + width, bestY + height);
+	pos[0] = bestX;
+	pos[1] = bestY;
+	return true;
+}
+
+// Number of glyph data pixels a glyph takes: its header, its curves, its
+// coverage map, and the overflow lists of its grid (see
+// VGridAtlas::WriteVGridAt), rounded up so the next glyph stays aligned.
+static uint32_t glyph_data_pixels(std::vector<Bezier2> &curves, VGrid &grid)
+{
+	size_t overflowPixels = std::min(grid.OverflowPixelCount(kAtlasChannels), kMaxOverflowPixels);
+	return align_glyph_pixels(glyph_overflow_offset(curves.size()) + overflowPixels);
+}
+
+// Extends the part of the shared glyph data this process uses, and so
+// uploads, to include a range of pixels.
+static void use_shared_glyph_data(GLFontManager &manager, uint32_t begin, uint32_t end)
+{
+	manager.glyphDataSize = std::max(manager.glyphDataSize, end);
+	while (manager.glyphDataCapacity < manager.glyphDataSize) {
+		manager.glyphDataCapacity = std::max(kGlyphDataInitialSize, manager.glyphDataCapacity * 2);
+	}
+	manager.glyphDataCapacity = std::min(manager.glyphDataCapacity, manager.shared->GlyphDataCapacity());
+	mark_glyph_data_dirty(manager, begin, end);
+}
+
+// Returns the atlas group of a layer of the shared atlas, adding groups for
+// it and every layer before it. Shared atlases are packed by SharedAtlas, so
+// the groups are always full.
+static GLFontManager::AtlasGroup * use_shared_atlas(GLFontManager &manager, uint16_t layer)
+{
+	while (manager.atlases.size() <= layer) {
+		GLFontManager::AtlasGroup group{};
+		group.gridAtlas = manager.shared->GridAtlas(manager.atlases.size());
+		group.gridSkyline.assign(kGridAtlasSize, kGridAtlasSize);
+		group.full = true;
+		manager.atlases.push_back(group);
+	}
+	return &manager.atlases[layer];
+}
+
+// Marks the grid and glyph data of a glyph from the shared atlas, which may
+// have been prepared by another process, to be uploaded.
+static void use_shared_glyph(
+	GLFontManager &manager,
+	const GLFontManager::Glyph &glyph,
+	uint32_t dataPixels)
+{
+	if (glyph.glyphDataOffset == GLFontManager::kNoGlyphData) {
+		return;
+	}
+
+	uint32_t offset = glyph.glyphDataOffset;
+	const uint16_t *header = (const uint16_t *)(manager.glyphData + offset*kAtlasChannels);
+	GLFontManager::AtlasGroup *atlas = use_shared_atlas(manager, header[4]);
+	mark_grid_dirty(atlas, header[0], header[1], header[2], header[3]);
+	use_shared_glyph_data(manager, offset, offset + dataPixels);
+}
+
+// Reserves `pixels` pixels at the end of the glyph data, growing it if it's
+// full, and returns their offset. Growing moves the glyph data, so pointers
+// into it must not be kept across calls. The shared atlas can't grow, so
+// with one this returns kNoGlyphData when it is full.
+static uint32_t reserve_glyph_data(GLFontManager &manager, uint32_t pixels)
+{
+	if (manager.shared) {
+		uint32_t offset;
+		if (!manager.shared->ReserveGlyphData(pixels, &offset)) {
+			return GLFontManager::kNoGlyphData;
+		}
+		use_shared_glyph_data(manager, offset, offset + pixels);
+		return offset;
+	}
+
+	uint32_t offset = manager.glyphDataSize;
+	uint64_t needed = (uint64_t)offset + pixels;
+	if (needed > manager.glyphDataCapacity) {
+		uint64_t capacity = std::max((uint64_t)kGlyphDataInitialSize, (uint64_t)manager.glyphDataCapacity * 2);
+		capacity = std::max(capacity, needed);
+
+		std::vector<uint8_t> storage(capacity*kAtlasChannels);
+		if (offset > 0) {
+			memcpy(storage.data(), manager.glyphData, offset*kAtlasChannels);
+		}
+		manager.glyphDataStorage.swap(storage);
+		manager.glyphData = manager.glyphDataStorage.data();
+		manager.glyphDataCapacity = capacity;
+	}
+
+	manager.glyphDataSize += pixels;
+	mark_glyph_data_dirty(manager, offset, offset + pixels);
+	return offset;
+}
+
+// Finds space for the glyph's grid in the open atlas group and for its
+// curves in the glyph data, writes them there, and fills in
+// glyph->glyphDataOffset. Returns false if a shared atlas is full.
+static bool write_glyph_to_atlas(
+	GLFontManager &manager,
+	std::vector<Bezier2> &curves,
+	VGrid &grid,
+	Vec2 glyphSize,
+	GLFontManager::Glyph *glyph)
+{
+	// Find an open position in the grid atlas
+	GLFontManager::AtlasGroup *atlas;
+	uint16_t atlasIndex;
+	uint16_t gridPos[2];
+	if (manager.shared) {
+		if (!manager.shared->PackGrid(grid.width, grid.height, &atlasIndex, gridPos)) {
+			return false;
+		}
+		atlas = use_shared_atlas(manager, atlasIndex);
+	} else {
+		atlas = manager.GetOpenAtlasGroup();
+		if (!pack_grid(atlas, grid.width, grid.height, gridPos)) {
+			atlas->full = true;
+			atlas = manager.GetOpenAtlasGroup(); // Should only ever happen once per glyph
+			pack_grid(atlas, grid.width, grid.height, gridPos);
+		}
+		atlasIndex = manager.atlases.size()-1;
+	}
+
+	// Although the data is represented as a 32bit texture, it's actually
+	// two 16bit ints per pixel, each with an x and y coordinate for
+	// the bezier. Every eight 16bit ints (4 pixels) is a full bezier
+	// and its padding.
+	// Plus four pixels for grid position and size information, the
+	// coverage map, and the overflow lists of cells with too many curves
+	// at the end
+	uint32_t bezierPixelLength = glyph_data_pixels(curves, grid);
+	uint32_t overflowPixelOffset = glyph_overflow_offset(curves.size());
+	uint32_t offset = reserve_glyph_data(manager, bezierPixelLength);
+	if (offset == GLFontManager::kNoGlyphData) {
+		return false;
+	}
+	uint8_t *bezierData = manager.glyphData + offset*kAtlasChannels;
+
+	write_glyph_data_to_buffer(
+		bezierData,
+		curves,
+		grid.coverage,
+		glyphSize,
+		gridPos[0],
+		gridPos[1],
+		grid.width,
+		grid.height,
+		atlasIndex,
+		glyph->size);
+
+	// TODO: Integrate with AtlasGroup / replace AtlasGroup
+	VGridAtlas gridAtlas{};
+	gridAtlas.data = atlas->gridAtlas;
+	gridAtlas.width = kGridAtlasSize;
+	gridAtlas.height = kGridAtlasSize;
+	gridAtlas.depth = kAtlasChannels;
+	uint16_t *overflow = nullptr;
+	if (bezierPixelLength > overflowPixelOffset) {
+		overflow = (uint16_t *)(bezierData + overflowPixelOffset*kAtlasChannels);
+	}
+	manager.stats.truncatedCells += gridAtlas.WriteVGridAt(grid, gridPos[0], gridPos[1], overflow);
+
+	glyph->glyphDataOffset = offset;
+	mark_grid_dirty(atlas, gridPos[0], gridPos[1], grid.width, grid.height);
+	return true;
+}
+
+// Gives the glyph its own glyph data header, copied from the source glyph
+// but with the glyph's size. The copy has no curves and points at the
+// source's grid.
+static void write_glyph_header_copy(
+	GLFontManager &manager,
+	const GLFontManager::Glyph &source,
+	GLFontManager::Glyph *glyph)
+{
+	glyph->glyphDataOffset = GLFontManager::kNoGlyphData;
+	if (source.glyphDataOffset == GLFontManager::kNoGlyphData) {
+		return;
+	}
+
+	uint16_t header[kGlyphHeaderPixels*2];
+	memcpy(header,
+		manager.glyphData + source.glyphDataOffset*kAtlasChannels,
+		sizeof(header));
+	header[5] = 0;
+	header[6] = glyph->size[0];
+	header[7] = glyph->size[1];
+
+	uint32_t offset = reserve_glyph_data(manager, kGlyphHeaderPixels);
+	if (offset != GLFontManager::kNoGlyphData) {
+		memcpy(manager.glyphData + offset*kAtlasChannels, header, sizeof(header));
+		glyph->glyphDataOffset = offset;
+	}
+}
+
+// Adds a prepared glyph to the atlases, and adds the time it took to prepare
+// to the stats.
+GLFontManager::Glyph GLFontManager::CommitGlyph(FT_Face face, uint32_t glyphIndex, PreparedGlyph &prepared)
+{
+	this->stats.glyphsPrepared++;
+	this->stats.loadNanos += prepared.loadNanos;
+	this->stats.outlineNanos += prepared.outlineNanos;
+	this->stats.gridNanos += prepared.gridNanos;
+	this->Trace(TraceStage::Load, face, glyphIndex, prepared.loadNanos, 0);
+	this->Trace(TraceStage::Outline, face, glyphIndex, prepared.outlineNanos, 0);
+	this->Trace(TraceStage::Grid, face, glyphIndex, prepared.gridNanos, 0);
+
+	FT_Pos glyphWidth = prepared.metrics.width;
+	FT_Pos glyphHeight = prepared.metrics.height;
+
+	GLFontManager::Glyph glyph{};
+	glyph.size[0] = glyphWidth;
+	glyph.size[1] = glyphHeight;
+	glyph.handle = kNoGlyphHandle;
+	glyph.offset[0] = prepared.metrics.horiBearingX;
+	glyph.offset[1] = prepared.metrics.horiBearingY - glyphHeight;
+	glyph.advance = prepared.metrics.horiAdvance;
+
+	bool tooManyCurves = prepared.curves.size() > kMaxBeziersPerGrid;
+
+	if (prepared.curves.size() == 0 || tooManyCurves) {
+		if (tooManyCurves) {
+			std::cerr << "WARN: Glyph " << glyphIndex << " has too many curves\n";
+		}
+
+		glyph.glyphDataOffset = kNoGlyphData;
+		return glyph;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	if (!write_glyph_to_atlas(
+		*this,
+		prepared.curves,
+		prepared.grid,
+		Vec2(glyphWidth, glyphHeight),
+		&glyph)) {
+		std::cerr << "WARN: Shared atlas is full, glyph " << glyphIndex << " is not drawn\n";
+		glyph.glyphDataOffset = kNoGlyphData;
+	}
+	uint64_t nanos = nanos_since(start);
+	this->stats.atlasWriteNanos += nanos;
+	this->Trace(TraceStage::AtlasWrite, face, glyphIndex, nanos, 0);
+	return glyph;
+}
+
+// Number of glyph data pixels a committed glyph uses, for sharing it.
+static uint32_t committed_glyph_pixels(const GLFontManager::Glyph &glyph, PreparedGlyph &prepared)
+{
+	if (glyph.glyphDataOffset == GLFontManager::kNoGlyphData) {
+		return 0;
+	}
+	return glyph_data_pixels(prepared.curves, prepared.grid);
+}
+
+static void mark_glyph_handles_dirty(GLFontManager &manager, uint32_t begin, uint32_t end)
+{
+	grow_dirty_range(manager.dirtyGlyphHandles, begin, end);
+}
+
+// Gives the glyph a handle if it doesn't have one yet, and points the handle
+// at the glyph's current glyph data. A handle keeps its references, so a
+// pending glyph stays retained once it's ready.
+void GLFontManager::SetGlyphHandle(
+	Glyph *glyph,
+	FT_Face face,
+	uint32_t glyphIndex,
+	uint32_t dataPixels,
+	uint32_t gridCells)
+{
+	if (glyph->handle == kNoGlyphHandle) {
+		if (glyph->glyphDataOffset == kNoGlyphData) {
+			return;
+		}
+		if (this->freeGlyphHandles.empty()) {
+			glyph->handle = this->glyphHandles.size();
+			this->glyphHandles.push_back(GlyphHandle{});
+			this->glyphHandleOffsets.push_back(kNoGlyphData);
+		} else {
+			glyph->handle = this->freeGlyphHandles.back();
+			this->freeGlyphHandles.pop_back();
+		}
+	}
+
+	GlyphHandle &handle = this->glyphHandles[glyph->handle];
+	handle.glyph = glyph;
+	handle.face = face;
+	handle.glyphIndex = glyphIndex;
+	handle.dataPixels = dataPixels;
+	handle.gridCells = gridCells;
+	handle.lastUsed = this->frame;
+	this->glyphHandleOffsets[glyph->handle] = glyph->glyphDataOffset;
+	mark_glyph_handles_dirty(*this, glyph->handle, glyph->handle + 1);
+}
+
+static void free_glyph_handle(GLFontManager &manager, uint32_t handle)
+{
+	manager.glyphHandles[handle] = GLFontManager::GlyphHandle{};
+	manager.glyphHandleOffsets[handle] = GLFontManager::kNoGlyphData;
+	manager.freeGlyphHandles.push_back(handle);
+	mark_glyph_handles_dirty(manager, handle, handle + 1);
+}
+
+// Points the handle of a glyph committed from `prepared` at its glyph data.
+static void set_committed_glyph_handle(
+	GLFontManager &manager,
+	GLFontManager::Glyph *glyph,
+	FT_Face face,
+	uint32_t glyphIndex,
+	PreparedGlyph &prepared)
+{
+	uint32_t pixels = committed_glyph_pixels(*glyph, prepared);
+	uint32_t cells = pixels > 0 ? prepared.grid.width * prepared.grid.height : 0;
+	manager.SetGlyphHandle(glyph, face, glyphIndex, pixels, cells);
+}
+
+// Keeps a glyph that was looked up this frame from being evicted.
+static void touch_glyph(GLFontManager &manager, GLFontManager::Glyph *glyph)
+{
+	if (glyph->handle != GLFontManager::kNoGlyphHandle) {
+		manager.glyphHandles[glyph->handle].lastUsed = manager.frame;
+	}
+}
+
+// Tolerance for approximating a face's cubics, in its font units (see
+// SetCubicTargetSize), or 0 for the default.
+static double cubic_tolerance(GLFontManager &manager, FT_Face face)
+{
+	if (manager.cubicTargetSize <= 0) {
+		return 0;
+	}
+	return face->units_per_EM * kCubicTolerancePixels / manager.cubicTargetSize;
+}
+
+// Adds a glyph from the shared atlas to the glyph cache. Shared glyphs are
+// never evicted, so their handles own nothing.
+static GLFontManager::Glyph * insert_shared_glyph(
+	GLFontManager &manager,
+	FT_Face face,
+	uint32_t glyphIndex,
+	GLFontManager::Glyph glyph,
+	uint32_t dataPixels)
+{
+	use_shared_glyph(manager, glyph, dataPixels);
+	glyph.handle = GLFontManager::kNoGlyphHandle;
+	GLFontManager::Glyph *inserted = manager.glyphs->Insert(face, glyphIndex, glyph);
+	manager.SetGlyphHandle(inserted, face, glyphIndex, 0, 0);
+	if (manager.glyphLoadedCallback) {
+		manager.glyphLoadedCallback(face, glyphIndex, inserted);
+	}
+	return inserted;
+}
+
+GLFontManager::Glyph * GLFontManager::GetGlyphForCodepoint(FT_Face face, uint32_t point)
+{
+	return this->GetGlyphForIndex(face, this->shaper->GlyphIndex(face, point));
+}
+
+GLFontManager::Glyph * GLFontManager::GetGlyphForIndex(FT_Face face, uint32_t glyphIndex)
+{
+	Glyph *cached = this->glyphs->Find(face, glyphIndex);
+	if (cached) {
+		this->stats.glyphHits++;
+		touch_glyph(*this, cached);
+		return cached;
+	}
+	this->stats.glyphMisses++;
+
+	// Use the glyph if another process has already prepared it, or else
+	// claim it so that other processes wait for this one
+	SharedGlyphSlot *slot = nullptr;
+	if (this->shared) {
+		Glyph glyph;
+		uint32_t dataPixels;
+		switch (this->shared->Acquire(face, glyphIndex, true, &glyph, &dataPixels, &slot)) {
+		case SharedAtlas::Result::Ready:
+			return insert_shared_glyph(*this, face, glyphIndex, glyph, dataPixels);
+		case SharedAtlas::Result::Missing:
+			return nullptr;
+		default:
+			break;
+		}
+	}
+
+	static thread_local PreparedGlyph prepared;
+	if (!prepare_glyph(face, glyphIndex, cubic_tolerance(*this, face), &prepared)) {
+		if (this->shared) {
+			this->shared->Publish(slot, nullptr, 0);
+		}
+		return nullptr;
+	}
+
+	Glyph *glyph = this->glyphs->Insert(face, glyphIndex, this->CommitGlyph(face, glyphIndex, prepared));
+	set_committed_glyph_handle(*this, glyph, face, glyphIndex, prepared);
+	if (this->shared) {
+		this->shared->Publish(slot, glyph, committed_glyph_pixels(*glyph, prepared));
+	}
+	if (this->glyphLoadedCallback) {
+		this->glyphLoadedCallback(face, glyphIndex, glyph);
+	}
+	return glyph;
+}
+
+// The placeholder drawn for pending glyphs is an outlined box: a grid with no
+// curves, where only the ring of cells one in from the edge is inside.
+GLFontManager::Glyph * GLFontManager::GetPlaceholderGlyph(uint16_t width, uint16_t height)
+{
+	auto sized = this->placeholderSizes.find(std::make_pair(width, height));
+	if (sized != this->placeholderSizes.end()) {
+		return &sized->second;
+	}
+
+	if (!this->hasPlaceholderGlyph) {
+		this->WritePlaceholderBox();
+	}
+
+	Glyph glyph = this->placeholderGlyph;
+	glyph.size[0] = width;
+	glyph.size[1] = height;
+	glyph.handle = kNoGlyphHandle;
+	write_glyph_header_copy(*this, this->placeholderGlyph, &glyph);
+
+	Glyph *placeholder = &(this->placeholderSizes[std::make_pair(width, height)] = glyph);
+	this->SetGlyphHandle(placeholder, nullptr, 0, kGlyphHeaderPixels, 0);
+	return placeholder;
+}
+
+void GLFontManager::WritePlaceholderBox()
+{
+	static const int kBoxGridSize = 10;
+
+	VGrid grid;
+	grid.width = kBoxGridSize;
+	grid.height = kBoxGridSize;
+	grid.cellOffsets.assign(sq(kBoxGridSize) + 1, 0);
+	grid.cellMids.assign(sq(kBoxGridSize), false);
+	for (int y = 1; y < kBoxGridSize - 1; y++) {
+		for (int x = 1; x < kBoxGridSize - 1; x++) {
+			bool ring = x == 1 || y == 1 || x == kBoxGridSize - 2 || y == kBoxGridSize - 2;
+			grid.cellMids[y * kBoxGridSize + x] = ring;
+		}
+	}
+
+	// The box itself is never drawn, but its handle owns the grid that every
+	// size shares
+	std::vector<Bezier2> noCurves;
+	this->placeholderGlyph = Glyph{};
+	this->placeholderGlyph.handle = kNoGlyphHandle;
+	this->placeholderGlyph.glyphDataOffset = kNoGlyphData;
+	write_glyph_to_atlas(*this, noCurves, grid, Vec2(1, 1), &this->placeholderGlyph);
+	this->SetGlyphHandle(&this->placeholderGlyph, nullptr, 0, kGlyphHeaderPixels, sq(kBoxGridSize));
+	this->hasPlaceholderGlyph = true;
+}
+
+void GLFontManager::SetWorkerThreads(unsigned count)
+{
+	this->CommitPreparedGlyphs(true);
+	this->workers.reset(count > 0 ? new GlyphWorkerPool(count) : nullptr);
+}
+
+GLFontManager::Glyph * GLFontManager::RequestGlyph(FT_Face face, uint32_t point)
+{
+	return this->RequestGlyphForIndex(face, this->shaper->GlyphIndex(face, point));
+}
+
+GLFontManager::Glyph * GLFontManager::RequestGlyphForIndex(FT_Face face, uint32_t glyphIndex)
+{
+	Glyph *cached = this->glyphs->Find(face, glyphIndex);
+	if (cached) {
+		this->stats.glyphHits++;
+		touch_glyph(*this, cached);
+		return cached;
+	}
+
+	auto pathIt = this->fontPaths.find(face);
+	if (!this->workers || pathIt == this->fontPaths.end()) {
+		return this->GetGlyphForIndex(face, glyphIndex);
+	}
+	this->stats.glyphMisses++;
+
+	SharedGlyphSlot *slot = nullptr;
+	bool otherProcess = false;
+	if (this->shared) {
+		Glyph glyph;
+		uint32_t dataPixels;
+		switch (this->shared->Acquire(face, glyphIndex, false, &glyph, &dataPixels, &slot)) {
+		case SharedAtlas::Result::Ready:
+			return insert_shared_glyph(*this, face, glyphIndex, glyph, dataPixels);
+		case SharedAtlas::Result::Missing:
+			return nullptr;
+		case SharedAtlas::Result::Pending:
+			otherProcess = true;
+			break;
+		case SharedAtlas::Result::Claimed:
+			break;
+		}
+	}
+
+	// The advance is cheap to read without loading the glyph, and lets
+	// text be laid out correctly before the glyph is ready.
+	FT_Fixed advance;
+	if (FT_Get_Advance(face, glyphIndex, FT_LOAD_NO_SCALE, &advance)) {
+		return nullptr;
+	}
+
+	Glyph glyph = *this->GetPlaceholderGlyph(
+		std::max((int)advance, 0),
+		std::max((int)face->ascender, 0));
+	glyph.advance = advance;
+	glyph.pending = true;
+	glyph.handle = kNoGlyphHandle;
+
+	// The pending glyph gets its own handle, pointing at the placeholder's
+	// glyph data until it's ready, so instances don't change handles
+	Glyph *pending = this->glyphs->Insert(face, glyphIndex, glyph);
+	this->SetGlyphHandle(pending, face, glyphIndex, 0, 0);
+	if (otherProcess) {
+		this->sharedPending.push_back(SharedPendingGlyph{face, glyphIndex, pending});
+	} else {
+		this->workers->Queue(face, pathIt->second, glyphIndex, cubic_tolerance(*this, face), pending);
+		if (slot) {
+			this->sharedClaims[pending] = slot;
+		}
+	}
+	return pending;
+}
+
+// Ends a pending glyph that couldn't be loaded. Its layout is kept, but
+// nothing is drawn.
+static void end_pending_glyph_undrawn(
+	GLFontManager &manager,
+	FT_Face face,
+	uint32_t glyphIndex,
+	GLFontManager::Glyph *glyph)
+{
+	glyph->size[0] = glyph->size[1] = 0;
+	glyph->glyphDataOffset = GLFontManager::kNoGlyphData;
+	glyph->pending = false;
+	manager.SetGlyphHandle(glyph, face, glyphIndex, 0, 0);
+}
+
+// Checks on the pending glyphs that other processes were preparing. Glyphs
+// left behind by a process that died are queued to be prepared here. Returns
+// true if any glyph is no longer pending.
+static bool commit_shared_pending_glyphs(GLFontManager &manager, bool wait)
+{
+	bool landed = false;
+	std::vector<GLFontManager::SharedPendingGlyph> &pending = manager.sharedPending;
+	for (size_t i = 0; i < pending.size(); ) {
+		GLFontManager::SharedPendingGlyph p = pending[i];
+		GLFontManager::Glyph glyph;
+		uint32_t dataPixels;
+		SharedGlyphSlot *slot;
+		switch (manager.shared->Acquire(p.face, p.glyphIndex, wait, &glyph, &dataPixels, &slot)) {
+		case SharedAtlas::Result::Pending:
+			i++;
+			continue;
+		case SharedAtlas::Result::Ready:
+			use_shared_glyph(manager, glyph, dataPixels);
+			glyph.handle = p.glyph->handle;
+			*p.glyph = glyph;
+			manager.SetGlyphHandle(p.glyph, p.face, p.glyphIndex, 0, 0);
+			break;
+		case SharedAtlas::Result::Missing:
+			end_pending_glyph_undrawn(manager, p.face, p.glyphIndex, p.glyph);
+			break;
+		case SharedAtlas::Result::Claimed:
+			manager.workers->Queue(p.face, manager.fontPaths[p.face], p.glyphIndex,
+				cubic_tolerance(manager, p.face), p.glyph);
+			if (slot) {
+				manager.sharedClaims[p.glyph] = slot;
+			}
+			break;
+		}
+
+		if (!p.glyph->pending) {
+			landed = true;
+			if (manager.glyphLoadedCallback) {
+				manager.glyphLoadedCallback(p.face, p.glyphIndex, p.glyph);
+			}
+		}
+		pending.erase(pending.begin() + i);
+	}
+	return landed;
+}
+
+bool GLFontManager::CommitPreparedGlyphs(bool wait)
+{
+	if (!this->workers) {
+		return false;
+	}
+
+	// Done first, since glyphs that are taken over from other processes
+	// are queued to the workers
+	bool landed = false;
+	if (this->shared) {
+		landed = commit_shared_pending_glyphs(*this, wait);
+	}
+
+	std::vector<GlyphWorkerPool::Job> done;
+	this->workers->TakeFinished(done, wait);
+
+	for (GlyphWorkerPool::Job &job : done) {
+		Glyph *glyph = static_cast<Glyph *>(job.userData);
+		if (job.ok) {
+			uint32_t handle = glyph->handle;
+			*glyph = this->CommitGlyph(job.face, job.glyphIndex, job.prepared);
+			glyph->handle = handle;
+			set_committed_glyph_handle(*this, glyph, job.face, job.glyphIndex, job.prepared);
+		} else {
+			end_pending_glyph_undrawn(*this, job.face, job.glyphIndex, glyph);
+		}
+
+		auto claim = this->sharedClaims.find(glyph);
+		if (claim != this->sharedClaims.end()) {
+			this->shared->Publish(claim->second,
+				job.ok ? glyph : nullptr,
+				job.ok ? committed_glyph_pixels(*glyph, job.prepared) : 0);
+			this->sharedClaims.erase(claim);
+		}
+
+		if (this->glyphLoadedCallback) {
+			this->glyphLoadedCallback(job.face, job.glyphIndex, glyph);
+		}
+	}
+
+	if (done.empty() && !landed) {
+		return false;
+	}
+	this->glyphGeneration++;
+	return true;
+}
+
+void GLFontManager::SetMemoryBudget(size_t bytes)
+{
+	this->memoryBudget = bytes;
+	this->memoryAfterEviction = 0;
+}
+
+void GLFontManager::RetainGlyph(Glyph *glyph)
+{
+	if (glyph && glyph->handle != kNoGlyphHandle) {
+		this->glyphHandles[glyph->handle].refs++;
+	}
+}
+
+void GLFontManager::ReleaseGlyph(Glyph *glyph)
+{
+	if (glyph && glyph->handle != kNoGlyphHandle) {
+		GlyphHandle &handle = this->glyphHandles[glyph->handle];
+		handle.refs--;
+		handle.lastUsed = this->frame;
+	}
+}
+
+// Bytes used by the grid atlases and glyph data of this process.
+static size_t atlas_memory_used(GLFontManager &manager)
+{
+	return manager.atlases.size()*kGridAtlasBytes
+		+ (size_t)manager.glyphDataCapacity*kAtlasChannels;
+}
+
+static uint64_t grid_key(uint16_t layer, uint16_t x, uint16_t y)
+{
+	return (uint64_t)layer << 32 | (uint32_t)y << 16 | x;
+}
+
+// Moves the glyph data and grids of the glyphs that have handles into new
+// atlases, in glyph data order, and points the handles and glyphs at their
+// new glyph data. Grid cells only refer to curves and overflow lists
+// relative to their glyph, so they are copied as they are, and only the grid
+// position in each glyph data header changes. Glyphs that share glyph data,
+// like placeholders of each size, keep sharing it.
+static void compact_atlases(GLFontManager &manager)
+{
+	std::vector<uint32_t> owners;
+	uint64_t pixels = 0;
+	for (uint32_t h = 0; h < manager.glyphHandles.size(); h++) {
+		if (manager.glyphHandles[h].glyph && manager.glyphHandles[h].dataPixels > 0) {
+			owners.push_back(h);
+			pixels += manager.glyphHandles[h].dataPixels;
+		}
+	}
+	std::sort(owners.begin(), owners.end(), [&manager](uint32_t a, uint32_t b) {
+		return manager.glyphHandleOffsets[a] < manager.glyphHandleOffsets[b];
+	});
+
+	// Leave room to grow, so the next glyphs don't reallocate right away
+	uint32_t capacity = std::max((uint64_t)kGlyphDataInitialSize, pixels + pixels/2);
+	std::vector<uint8_t> storage((size_t)capacity*kAtlasChannels);
+	std::vector<GLFontManager::AtlasGroup> atlases;
+	std::vector<std::unique_ptr<uint16_t[]>> atlasStorage;
+	std::map<uint64_t, uint64_t> movedGrids;
+	std::map<uint32_t, uint32_t> movedData;
+	const size_t rowSize = kGridAtlasSize*kAtlasChannels;
+
+	uint32_t size = 0;
+	for (uint32_t h : owners) {
+		uint32_t from = manager.glyphHandleOffsets[h];
+		uint32_t n = manager.glyphHandles[h].dataPixels;
+		uint8_t *to = storage.data() + (size_t)size*kAtlasChannels;
+		memcpy(to, manager.glyphData + (size_t)from*kAtlasChannels, (size_t)n*kAtlasChannels);
+		movedData[from] = size;
+		size += n;
+
+		uint16_t *header = (uint16_t *)to;
+		uint64_t key = grid_key(header[4], header[0], header[1]);
+		auto moved = movedGrids.find(key);
+		if (moved == movedGrids.end()) {
+			uint16_t pos[2];
+			GLFontManager::AtlasGroup *atlas = atlases.empty() ? nullptr : &atlases.back();
+			if (!atlas || !pack_grid(atlas, header[2], header[3], pos)) {
+				if (atlas) {
+					atlas->full = true;
+				}
+				atlas = add_atlas_group(atlases, atlasStorage);
+				pack_grid(atlas, header[2], header[3], pos);
+			}
+
+			const uint16_t *src = manager.atlases[header[4]].gridAtlas
+				+ header[1]*rowSize + header[0]*kAtlasChannels;
+			uint16_t *dst = atlas->gridAtlas + pos[1]*rowSize + pos[0]*kAtlasChannels;
+			for (uint16_t y = 0; y < header[3]; y++) {
+				memcpy(dst + y*rowSize, src + y*rowSize, header[2]*kAtlasChannels*sizeof(uint16_t));
+			}
+			moved = movedGrids.insert(std::make_pair(key,
+				grid_key(atlases.size() - 1, pos[0], pos[1]))).first;
+		}
+
+		header[0] = moved->second & 0xFFFF;
+		header[1] = (moved->second >> 16) & 0xFFFF;
+		header[4] = moved->second >> 32;
+	}
+
+	for (uint32_t h = 0; h < manager.glyphHandles.size(); h++) {
+		GLFontManager::GlyphHandle &handle = manager.glyphHandles[h];
+		uint32_t &offset = manager.glyphHandleOffsets[h];
+		if (!handle.glyph || offset == GLFontManager::kNoGlyphData) {
+			continue;
+		}
+		auto moved = movedData.find(offset);
+		offset = moved != movedData.end() ? moved->second : GLFontManager::kNoGlyphData;
+		handle.glyph->glyphDataOffset = offset;
+	}
+
+	for (GLFontManager::AtlasGroup &atlas : atlases) {
+		mark_grid_all_dirty(&atlas);
+	}
+	manager.atlases.swap(atlases);
+	manager.gridAtlasStorage.swap(atlasStorage);
+	manager.glyphDataStorage.swap(storage);
+	manager.glyphData = manager.glyphDataStorage.data();
+	manager.glyphDataSize = size;
+	manager.glyphDataCapacity = capacity;
+	mark_glyph_data_dirty(manager, 0, size);
+	mark_glyph_handles_dirty(manager, 0, manager.glyphHandleOffsets.size());
+
+	// Nothing points into an atlas cache anymore
+	if (manager.cacheMapping) {
+		munmap(manager.cacheMapping, manager.cacheMappingSize);
+		manager.cacheMapping = nullptr;
+		manager.cacheMappingSize = 0;
+	}
+}
+
+// Evicts glyphs, least recently used first, if the atlases are over the
+// memory budget, then compacts the atlases. Returns true if the atlases were
+// compacted.
+bool GLFontManager::EvictGlyphs()
+{
+	// If most glyphs are retained, the atlases can still be over budget
+	// after evicting, so eviction waits until they have grown some more
+	size_t used = atlas_memory_used(*this);
+	if (this->memoryBudget == 0 || this->shared || used <= this->memoryBudget
+		|| used < this->memoryAfterEviction + this->memoryBudget/8) {
+		return false;
+	}
+
+	// What the glyphs take up once compacted, not counting the space lost
+	// to packing
+	uint64_t live = 0;
+	std::vector<uint32_t> evictable;
+	for (uint32_t h = 0; h < this->glyphHandles.size(); h++) {
+		GlyphHandle &handle = this->glyphHandles[h];
+		if (!handle.glyph) {
+			continue;
+		}
+		live += (uint64_t)handle.dataPixels*kAtlasChannels
+			+ (uint64_t)handle.gridCells*kAtlasChannels*sizeof(uint16_t);
+		if (handle.face && handle.refs == 0 && handle.lastUsed < this->frame
+			&& !handle.glyph->pending) {
+			evictable.push_back(h);
+		}
+	}
+	std::stable_sort(evictable.begin(), evictable.end(), [this](uint32_t a, uint32_t b) {
+		return this->glyphHandles[a].lastUsed < this->glyphHandles[b].lastUsed;
+	});
+
+	// Evict down to well under the budget, so that compacting isn't needed
+	// again straight away
+	uint64_t target = this->memoryBudget/4*3;
+	size_t evicted = 0;
+	for (; evicted < evictable.size() && live > target; evicted++) {
+		GlyphHandle &handle = this->glyphHandles[evictable[evicted]];
+		live -= (uint64_t)handle.dataPixels*kAtlasChannels
+			+ (uint64_t)handle.gridCells*kAtlasChannels*sizeof(uint16_t);
+		this->glyphs->Erase(handle.face, handle.glyphIndex);
+		free_glyph_handle(*this, evictable[evicted]);
+	}
+
+	if (evicted > 0) {
+		compact_atlases(*this);
+	}
+	this->memoryAfterEviction = atlas_memory_used(*this);
+	return evicted > 0;
+}
+
+// Glyphs used during the frame have lastUsed == frame, so they're kept by
+// this eviction, and only become evictable at the end of the next frame.
+void GLFontManager::EndFrame()
+{
+	if (this->EvictGlyphs()) {
+		this->compacted = true;
+	}
+	this->frame++;
+}
+
+void GLFontManager::LoadASCII(FT_Face face)
+{
+	if (!face) {
+		return;
+	}
+
+	this->GetGlyphForIndex(face, 0);
+
+	for (int i = 32; i < 128; i++) {
+		this->GetGlyphForCodepoint(face, i);
+	}
+}
+
+// Makes every context using a GPU mirror, other than `except`, bind its
+// textures again before it next draws. Changes made in one context are
+// only guaranteed to be seen by another once it binds the objects again.
+static void forget_gpu_textures(
+	GLFontManager &manager,
+	GLFontManager::GPUMirror &gpu,
+	GLFontManager::GLContextState *except)
+{
+	for (auto &context : manager.glContexts) {
+		GLFontManager::GLContextState &state = context.second;
+		if (state.gpu.get() == &gpu && &state != except) {
+			for (GLuint &texture : state.glState.textures) {
+				texture = 0;
+			}
+		}
+	}
+}
+
+static void create_grid_atlas_array(GLFontManager &manager, GLFontManager::GPUMirror &gpu)
+{
+	glGenTextures(1, &gpu.gridAtlasArrayId);
+	manager.BindTexture(0, GL_TEXTURE_2D_ARRAY, gpu.gridAtlasArrayId);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+}
+
+// Reallocates the grid atlas texture array with room for `capacity` atlases.
+// The previous contents are lost, so all atlases must be uploaded again.
+static void resize_grid_atlas_array(GLFontManager &manager, GLFontManager::GPUMirror &gpu, size_t capacity)
+{
+	GLint maxLayers = 0;
+	glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+	if (capacity > (size_t)maxLayers) {
+		std::cerr << "WARN: Too many atlases (max: " << maxLayers
+			<< ", need: " << capacity << ")\n";
+		capacity = maxLayers;
+	}
+
+	// Immutable storage can't be resized, so growing needs a new texture.
+	// Its name may be reused, so every context sharing the old one forgets
+	// it's bound.
+	if (GLEW_ARB_texture_storage) {
+		if (gpu.gridAtlasArrayId) {
+			glDeleteTextures(1, &gpu.gridAtlasArrayId);
+			forget_gpu_textures(manager, gpu, nullptr);
+		}
+		create_grid_atlas_array(manager, gpu);
+		glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_RGBA16UI, kGridAtlasSize, kGridAtlasSize, capacity);
+	} else {
+		if (!gpu.gridAtlasArrayId) {
+			create_grid_atlas_array(manager, gpu);
+		}
+		manager.BindTexture(0, GL_TEXTURE_2D_ARRAY, gpu.gridAtlasArrayId);
+		glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA16UI, kGridAtlasSize, kGridAtlasSize, capacity, 0, GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, NULL);
+	}
+
+	gpu.gpuAtlasCapacity = capacity;
+	for (size_t i = 0; i < manager.atlases.size(); i++) {
+		grow_dirty_rect(&gpu.dirtyGridRects[i*4], 0, 0, kGridAtlasSize, kGridAtlasSize);
+	}
+}
+
+// Reallocates the glyph data buffer texture with room for `capacity` pixels,
+// up to GL_MAX_TEXTURE_BUFFER_SIZE. The previous contents are lost, so all
+// glyph data must be uploaded again. The same buffer is also viewed as
+// RGBA32UI texels of 4 pixels each, for fetching curves.
+static void resize_glyph_data_buffer(GLFontManager &manager, GLFontManager::GPUMirror &gpu, uint32_t capacity)
+{
+	if (!gpu.glyphDataBufId) {
+		// https://www.khronos.org/opengl/wiki/Buffer_Texture
+		glGenBuffers(1, &gpu.glyphDataBufId);
+		glGenTextures(1, &gpu.glyphDataBufTexId);
+		glGenTextures(1, &gpu.glyphCurvesBufTexId);
+	}
+
+	GLint maxPixels = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxPixels);
+	if (capacity > (uint32_t)maxPixels) {
+		std::cerr << "WARN: Too much glyph data (max: " << maxPixels
+			<< ", need: " << capacity << ")\n";
+		capacity = maxPixels;
+	}
+	capacity &= ~(uint32_t)(kGlyphDataAlign - 1);
+
+	glBindBuffer(GL_TEXTURE_BUFFER, gpu.glyphDataBufId);
+	glBufferData(GL_TEXTURE_BUFFER, (size_t)capacity*kAtlasChannels, NULL, GL_DYNAMIC_DRAW);
+	manager.BindTexture(1, GL_TEXTURE_BUFFER, gpu.glyphDataBufTexId);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA8, gpu.glyphDataBufId);
+	manager.BindTexture(4, GL_TEXTURE_BUFFER, gpu.glyphCurvesBufTexId);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32UI, gpu.glyphDataBufId);
+
+	gpu.gpuGlyphDataCapacity = capacity;
+	grow_dirty_range(gpu.dirtyGlyphData, 0, manager.glyphDataSize);
+}
+
+// Reallocates the glyph handle buffer texture with room for `capacity`
+// handles. The previous contents are lost, so all handles must be uploaded
+// again.
+static void resize_glyph_handle_buffer(GLFontManager &manager, GLFontManager::GPUMirror &gpu, uint32_t capacity)
+{
+	if (!gpu.glyphHandleBufId) {
+		glGenBuffers(1, &gpu.glyphHandleBufId);
+		glGenTextures(1, &gpu.glyphHandleBufTexId);
+	}
+
+	glBindBuffer(GL_TEXTURE_BUFFER, gpu.glyphHandleBufId);
+	glBufferData(GL_TEXTURE_BUFFER, (size_t)capacity*sizeof(uint32_t), NULL, GL_DYNAMIC_DRAW);
+	manager.BindTexture(3, GL_TEXTURE_BUFFER, gpu.glyphHandleBufTexId);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, gpu.glyphHandleBufId);
+
+	gpu.gpuGlyphHandleCapacity = capacity;
+	grow_dirty_range(gpu.dirtyGlyphHandles, 0, manager.glyphHandleOffsets.size());
+}
+
+// Passes what changed in the atlases and glyph handles since the last call
+// on to every GPU mirror, each of which uploads it the next time one of its
+// contexts calls UploadAtlases.
+static void dirty_gpu_mirrors(GLFontManager &manager)
+{
+	std::set<GLFontManager::GPUMirror *> mirrors;
+	for (auto &context : manager.glContexts) {
+		mirrors.insert(context.second.gpu.get());
+	}
+
+	for (GLFontManager::GPUMirror *gpu : mirrors) {
+		gpu->dirtyGridRects.resize(manager.atlases.size()*4, 0);
+		for (size_t i = 0; i < manager.atlases.size(); i++) {
+			uint16_t *rect = manager.atlases[i].dirtyGridRect;
+			if (rect[0] < rect[2]) {
+				grow_dirty_rect(&gpu->dirtyGridRects[i*4],
+					rect[0], rect[1], rect[2] - rect[0], rect[3] - rect[1]);
+			}
 		}
-	// }
-
-	this->text.erase(index, length);
-	this->glyphs.erase(this->glyphs.begin() + index, this->glyphs.begin() + (index+length));
-	this->verts.erase(this->verts.begin() + index*6, this->verts.begin() + (index+length)*6);
-
-	glm::vec2 deltaOffset = endOffset - startOffset;
-	// Shift everything after, if necessary
-	for (size_t i = index; i < this->text.size(); i++) {
-		if (this->text[i] == '\n') {
-			deltaOffset.x = 0;
+		uint32_t *data = manager.dirtyGlyphData;
+		if (data[0] < data[1]) {
+			grow_dirty_range(gpu->dirtyGlyphData, data[0], data[1]);
 		}
-
-		for (unsigned int j = 0; j < 6; j++) {
-			this->verts[i*6 + j].pos -= deltaOffset;
+		uint32_t *handles = manager.dirtyGlyphHandles;
+		if (handles[0] < handles[1]) {
+			grow_dirty_range(gpu->dirtyGlyphHandles, handles[0], handles[1]);
 		}
+		gpu->compacted = gpu->compacted || manager.compacted;
 	}
 
-	glBindBuffer(GL_ARRAY_BUFFER, this->vertBuffer);
-	if (this->verts.size() > 0) {
-		glBufferSubData(GL_ARRAY_BUFFER,
-			index*6*sizeof(GlyphVertex),
-			(this->verts.size() - index*6)*sizeof(GlyphVertex),
-			&this->verts[index*6]);
+	for (GLFontManager::AtlasGroup &group : manager.atlases) {
+		uint16_t *rect = group.dirtyGridRect;
+		rect[0] = rect[1] = rect[2] = rect[3] = 0;
 	}
-
-	caretTime = 0;
+	manager.dirtyGlyphData[0] = manager.dirtyGlyphData[1] = 0;
+	manager.dirtyGlyphHandles[0] = manager.dirtyGlyphHandles[1] = 0;
+	manager.compacted = false;
 }
 
-void GLLabel::Render(float time, glm::mat4 transform)
+void GLFontManager::UploadAtlases()
 {
-	float deltaTime = time - prevTime;
-	this->caretTime += deltaTime;
-
-	this->manager->UseGlyphShader();
-	this->manager->UploadAtlases();
-	this->manager->UseAtlasTextures(0); // TODO: Textures based on each glyph
-	this->manager->SetShaderTransform(transform);
-
-	glEnable(GL_BLEND);
-	glBindBuffer(GL_ARRAY_BUFFER, this->vertBuffer);
-	glEnableVertexAttribArray(0);
-	glEnableVertexAttribArray(1);
-	glEnableVertexAttribArray(2);
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(GLLabel::GlyphVertex), (void*)offsetof(GLLabel::GlyphVertex, pos));
-	glVertexAttribIPointer(1, 1, GL_UNSIGNED_INT, sizeof(GLLabel::GlyphVertex), (void*)offsetof(GLLabel::GlyphVertex, data));
-	glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(GLLabel::GlyphVertex), (void*)offsetof(GLLabel::GlyphVertex, color));
-
-	glDrawArrays(GL_TRIANGLES, 0, this->verts.size());
-
-	if (this->showingCaret && !(((int)(this->caretTime*3/2)) % 2)) {
-		GLFontManager::Glyph *pipe = this->manager->GetGlyphForCodepoint(this->manager->GetDefaultFont(), '|');
-
-		size_t index = this->caretPosition;
+	auto start = std::chrono::steady_clock::now();
+	uint64_t bytes = 0;
+	this->CollectGPUTimers();
+	this->CommitPreparedGlyphs();
+
+	dirty_gpu_mirrors(*this);
+	GPUMirror &gpu = *this->glContext->gpu;
+
+	// Compacted atlases can be smaller than their GPU copies
+	bool compacted = gpu.compacted;
+	gpu.compacted = false;
+
+	if (this->atlases.size() > gpu.gpuAtlasCapacity) {
+		resize_grid_atlas_array(*this, gpu, std::max(this->atlases.size(), gpu.gpuAtlasCapacity * 2));
+	} else if (compacted && this->atlases.size() < gpu.gpuAtlasCapacity) {
+		resize_grid_atlas_array(*this, gpu, std::max(this->atlases.size(), (size_t)1));
+	}
+	if (this->glyphDataCapacity > gpu.gpuGlyphDataCapacity || !gpu.glyphDataBufId
+		|| (compacted && this->glyphDataCapacity < gpu.gpuGlyphDataCapacity)) {
+		resize_glyph_data_buffer(*this, gpu, std::max(this->glyphDataCapacity, kGlyphDataInitialSize));
+	}
 
-		glm::vec2 offset(0, 0);
-		if (index > 0) {
-			offset = this->verts[(index-1)*6].pos;
-			if (this->glyphs[index-1]) {
-				offset += -glm::vec2(this->glyphs[index-1]->offset[0], this->glyphs[index-1]->offset[1]) + glm::vec2(this->glyphs[index-1]->advance, 0);
-			}
+	uint32_t handleCount = this->glyphHandleOffsets.size();
+	if (handleCount > gpu.gpuGlyphHandleCapacity || !gpu.glyphHandleBufId) {
+		uint32_t capacity = std::max(gpu.gpuGlyphHandleCapacity, kGlyphHandlesInitialSize);
+		while (capacity < handleCount) {
+			capacity *= 2;
 		}
+		resize_glyph_handle_buffer(*this, gpu, capacity);
+	}
 
-		GlyphVertex x[6]{};
-		x[0].pos = glm::vec2(0, 0);
-		x[1].pos = glm::vec2(pipe->size[0], 0);
-		x[2].pos = glm::vec2(0, pipe->size[1]);
-		x[3].pos = glm::vec2(pipe->size[0], pipe->size[1]);
-		x[4].pos = glm::vec2(0, pipe->size[1]);
-		x[5].pos = glm::vec2(pipe->size[0], 0);
-		for (unsigned int j = 0; j < 6; j++) {
-			x[j].pos += offset;
-			x[j].pos[0] += pipe->offset[0];
-			x[j].pos[1] += pipe->offset[1];
-
-			x[j].color = {0,0,255,100};
-
-			// Encode both the bezier position and the norm coord into one int
-			// This theoretically could overflow, but the atlas position will
-			// never be over half the size of a uint16, so it's fine.
-			unsigned int k = (j < 4) ? j : 6 - j;
-			unsigned int normX = k & 1;
-			unsigned int normY = k > 1;
-			unsigned int norm = (normX << 1) + normY;
-			x[j].data = (pipe->bezierAtlasPos[0] << 2) + norm;
-			// this->verts[(index + i)*6 + j] = v[j];
+	uint32_t *handles = gpu.dirtyGlyphHandles;
+	handles[1] = std::min(handles[1], handleCount);
+	if (handles[0] < handles[1]) {
+		bytes += (size_t)(handles[1] - handles[0])*sizeof(uint32_t);
+		glBindBuffer(GL_TEXTURE_BUFFER, gpu.glyphHandleBufId);
+		glBufferSubData(GL_TEXTURE_BUFFER,
+			(size_t)handles[0]*sizeof(uint32_t),
+			(size_t)(handles[1] - handles[0])*sizeof(uint32_t),
+			&this->glyphHandleOffsets[handles[0]]);
+	}
+	handles[0] = handles[1] = 0;
+
+	// Only the dirty parts of each atlas are uploaded. The grid rect is
+	// read straight out of the full atlas using GL_UNPACK_ROW_LENGTH.
+	uint32_t *range = gpu.dirtyGlyphData;
+	range[1] = std::min(range[1], gpu.gpuGlyphDataCapacity);
+	if (range[0] < range[1]) {
+		bytes += (size_t)(range[1] - range[0])*kAtlasChannels;
+		glBindBuffer(GL_TEXTURE_BUFFER, gpu.glyphDataBufId);
+		glBufferSubData(GL_TEXTURE_BUFFER,
+			(size_t)range[0]*kAtlasChannels,
+			(size_t)(range[1] - range[0])*kAtlasChannels,
+			this->glyphData + (size_t)range[0]*kAtlasChannels);
+	}
+	range[0] = range[1] = 0;
+
+	this->BindTexture(0, GL_TEXTURE_2D_ARRAY, gpu.gridAtlasArrayId);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, kGridAtlasSize);
+
+	size_t count = std::min(this->atlases.size(), gpu.gpuAtlasCapacity);
+	for (size_t i = 0; i < count; i++) {
+		uint16_t *rect = &gpu.dirtyGridRects[i*4];
+		if (rect[0] < rect[2]) {
+			uint16_t *data = this->atlases[i].gridAtlas
+				+ (rect[1]*kGridAtlasSize + rect[0])*kAtlasChannels;
+			glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0,
+				rect[0], rect[1], i,
+				rect[2] - rect[0], rect[3] - rect[1], 1,
+				GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, data);
+			bytes += (size_t)(rect[2] - rect[0])*(rect[3] - rect[1])*kAtlasChannels*sizeof(uint16_t);
+			rect[0] = rect[1] = rect[2] = rect[3] = 0;
 		}
+	}
 
-		glBindBuffer(GL_ARRAY_BUFFER, this->caretBuffer);
-		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(GLLabel::GlyphVertex), (void*)offsetof(GLLabel::GlyphVertex, pos));
-		glVertexAttribIPointer(1, 1, GL_UNSIGNED_INT, sizeof(GLLabel::GlyphVertex), (void*)offsetof(GLLabel::GlyphVertex, data));
-		glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(GLLabel::GlyphVertex), (void*)offsetof(GLLabel::GlyphVertex, color));
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 
-		glBufferData(GL_ARRAY_BUFFER, 6 * sizeof(GlyphVertex), &x[0], GL_STREAM_DRAW);
-		glDrawArrays(GL_TRIANGLES, 0, 6);
+	// Other contexts sharing the mirror see the changes once they're
+	// flushed and the textures are bound again
+	if (bytes > 0 && this->glContext->gpu.use_count() > 1) {
+		glFlush();
+		forget_gpu_textures(*this, gpu, this->glContext);
 	}
 
-	glDisableVertexAttribArray(0);
-	glDisableVertexAttribArray(1);
-	glDisableVertexAttribArray(2);
-	glDisable(GL_BLEND);
-	prevTime = time;
+	this->stats.frames++;
+	this->stats.atlasBytesUploaded += bytes;
+	this->Trace(TraceStage::Upload, nullptr, 0, nanos_since(start), bytes);
 }
 
-
-GLFontManager::GLFontManager() : defaultFace(nullptr)
+GLFontManager::Stats GLFontManager::GetStats()
 {
-	if (FT_Init_FreeType(&this->ft) != FT_Err_Ok) {
-		std::cerr << "Failed to load freetype\n";
+	Stats stats = this->stats;
+	stats.shapedRunHits = this->shaper->hits;
+	stats.shapedRunMisses = this->shaper->misses;
+	stats.atlasCount = this->atlases.size();
+
+	uint64_t gridUsed = 0;
+	for (AtlasGroup &group : this->atlases) {
+		for (uint16_t height : group.gridSkyline) {
+			gridUsed += height;
+		}
 	}
-
-	this->glyphShader = loadShaderProgram(kGlyphVertexShader, kGlyphFragmentShader);
-	this->uGridAtlas = glGetUniformLocation(glyphShader, "uGridAtlas");
-	this->uGlyphData = glGetUniformLocation(glyphShader, "uGlyphData");
-	this->uTransform = glGetUniformLocation(glyphShader, "uTransform");
-
-	this->UseGlyphShader();
-	glUniform1i(this->uGridAtlas, 0);
-	glUniform1i(this->uGlyphData, 1);
-
-	glm::mat4 iden = glm::mat4(1.0);
-	glUniformMatrix4fv(this->uTransform, 1, GL_FALSE, glm::value_ptr(iden));
+	stats.gridFill = stats.atlasCount > 0
+		? (double)gridUsed / ((uint64_t)stats.atlasCount*sq(kGridAtlasSize))
+		: 0;
+	stats.glyphDataFill = this->glyphDataCapacity > 0
+		? (double)this->glyphDataSize / this->glyphDataCapacity
+		: 0;
+	return stats;
 }
 
-GLFontManager::~GLFontManager()
+void GLFontManager::SetTraceCallback(TraceCallback callback)
 {
-	// TODO: Destroy atlases
-	glDeleteProgram(this->glyphShader);
-	FT_Done_FreeType(this->ft);
+	this->traceCallback = callback;
 }
 
-std::shared_ptr<GLFontManager> GLFontManager::GetFontManager()
+void GLFontManager::Trace(TraceStage stage, FT_Face face, uint32_t glyphIndex, uint64_t nanos, uint64_t bytes)
 {
-	if (!GLFontManager::singleton) {
-		GLFontManager::singleton = std::shared_ptr<GLFontManager>(new GLFontManager());
+	if (this->traceCallback) {
+		this->traceCallback(TraceEvent{stage, face, glyphIndex, nanos, bytes});
 	}
-	return GLFontManager::singleton;
 }
 
-// TODO: FT_Faces don't get destroyed... FT_Done_FreeType cleans them eventually,
-// but maybe use shared pointers?
-FT_Face GLFontManager::GetFontFromPath(std::string fontPath)
+void GLFontManager::SetGPUTiming(bool enabled)
 {
-	FT_Face face;
-	return FT_New_Face(this->ft, fontPath.c_str(), 0, &face) ? nullptr : face;
+	this->gpuTiming = enabled;
 }
 
-FT_Face GLFontManager::GetFontFromName(std::string fontName)
+void GLFontManager::BeginGPUTimer()
 {
-	std::string path = fontName; // TODO
-	return GLFontManager::GetFontFromPath(path);
+	if (!this->gpuTiming) {
+		return;
+	}
+
+	GLuint query;
+	if (this->glContext->freeTimerQueries.empty()) {
+		glGenQueries(1, &query);
+	} else {
+		query = this->glContext->freeTimerQueries.back();
+		this->glContext->freeTimerQueries.pop_back();
+	}
+	glBeginQuery(GL_TIME_ELAPSED, query);
+	this->glContext->pendingTimerQueries.push_back(query);
 }
 
-FT_Face GLFontManager::GetDefaultFont()
+void GLFontManager::EndGPUTimer()
 {
-	// TODO
-	if (!defaultFace) {
-		defaultFace = GLFontManager::GetFontFromPath("fonts/LiberationSans-Regular.ttf");
+	if (this->gpuTiming) {
+		glEndQuery(GL_TIME_ELAPSED);
 	}
-	return defaultFace;
 }
 
-GLFontManager::AtlasGroup * GLFontManager::GetOpenAtlasGroup()
+// Reads the results of GPU timer queries that have finished, without
+// waiting for any.
+void GLFontManager::CollectGPUTimers()
 {
-	if (this->atlases.size() == 0 || this->atlases[this->atlases.size()-1].full) {
-		AtlasGroup group{};
-		group.glyphDataBuf = new uint8_t[sq(kBezierAtlasSize)*kAtlasChannels]();
-		group.gridAtlas = new uint8_t[sq(kGridAtlasSize)*kAtlasChannels]();
-		group.uploaded = true;
-
-		// https://www.khronos.org/opengl/wiki/Buffer_Texture
-		// TODO: Check GL_MAX_TEXTURE_BUFFER_SIZE
-		glGenBuffers(1, &group.glyphDataBufId);
-		glBindBuffer(GL_TEXTURE_BUFFER, group.glyphDataBufId);
-		glGenTextures(1, &group.glyphDataBufTexId);
-		glBindTexture(GL_TEXTURE_BUFFER, group.glyphDataBufTexId);
-		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA8, group.glyphDataBufId);
+	while (!this->glContext->pendingTimerQueries.empty()) {
+		GLuint query = this->glContext->pendingTimerQueries.front();
+		GLint available = 0;
+		glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) {
+			break;
+		}
 
-		glGenTextures(1, &group.gridAtlasId);
-		glBindTexture(GL_TEXTURE_2D, group.gridAtlasId);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, kGridAtlasSize, kGridAtlasSize, 0, GL_RGBA, GL_UNSIGNED_BYTE, group.gridAtlas);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+		GLuint64 nanos = 0;
+		glGetQueryObjectui64v(query, GL_QUERY_RESULT, &nanos);
+		this->glContext->pendingTimerQueries.pop_front();
+		this->glContext->freeTimerQueries.push_back(query);
 
-		this->atlases.push_back(group);
+		this->stats.gpuRenders++;
+		this->stats.gpuNanos += nanos;
+		this->stats.lastGPUNanos = nanos;
+		this->Trace(TraceStage::Render, nullptr, 0, nanos, 0);
 	}
-
-	return &this->atlases[this->atlases.size()-1];
 }
 
-#pragma pack(push, 1)
-struct bitmapdata
+void GLFontManager::UseGlyphShader()
 {
-	char magic[2];
-	uint32_t size;
-	uint16_t res1;
-	uint16_t res2;
-	uint32_t offset;
-
-	uint32_t biSize;
-	uint32_t width;
-	uint32_t height;
-	uint16_t planes;
-	uint16_t bitCount;
-	uint32_t compression;
-	uint32_t imageSizeBytes;
-	uint32_t xpelsPerMeter;
-	uint32_t ypelsPerMeter;
-	uint32_t clrUsed;
-	uint32_t clrImportant;
-};
-#pragma pack(pop)
+	this->UseGlyphShader(Quality());
+}
 
-void writeBMP(const char *path, uint32_t width, uint32_t height, uint16_t channels, uint8_t *data)
+void GLFontManager::UseGlyphShader(Quality quality)
 {
-	FILE *f = fopen(path, "wb");
+	uint32_t key = quality_key(quality);
+	std::map<uint32_t, GlyphShader> &shaders = this->glContext->gpu->glyphShaders;
+	auto found = shaders.find(key);
+	if (found == shaders.end()) {
+		found = shaders.insert(std::make_pair(key, this->LoadGlyphShader(quality))).first;
+	}
+	GlyphShader *shader = &found->second;
+	this->glContext->glyphShader = shader;
+	if (this->glContext->glState.program != shader->program) {
+		glUseProgram(shader->program);
+		this->glContext->glState.program = shader->program;
+	}
 
-	bitmapdata head;
-	head.magic[0] = 'B';
-	head.magic[1] = 'M';
-	head.size = sizeof(bitmapdata) + width*height*channels;
-	head.res1 = 0;
-	head.res2 = 0;
-	head.offset = sizeof(bitmapdata);
-	head.biSize = 40;
-	head.width = width;
-	head.height = height;
-	head.planes = 1;
-	head.bitCount = 8*channels;
-	head.compression = 0;
-	head.imageSizeBytes = width*height*channels;
-	head.xpelsPerMeter = 0;
-	head.ypelsPerMeter = 0;
-	head.clrUsed = 0;
-	head.clrImportant = 0;
+	// Shared by every variant, so checked whenever one is used
+	if (shader->lodThreshold != this->lodThreshold) {
+		glUniform1f(shader->uLODThreshold, this->lodThreshold);
+		shader->lodThreshold = this->lodThreshold;
+	}
+}
 
-	fwrite(&head, sizeof(head), 1, f);
-	fwrite(data, head.imageSizeBytes, 1, f);
-	fclose(f);
+GLsizei GLFontManager::GetGlyphVertexCount(Quality quality)
+{
+	return quality.tightQuads ? 8 : 4;
 }
 
-// A bezier is written as 6 16-bit integers (12 bytes). Increments buffer by
-// the number of bytes written (always 12). Coords are scaled from
-// [0,glyphSize] to [0,UINT16_MAX].
-void write_bezier_to_buffer(uint16_t **pbuffer, Bezier2 *bezier, Vec2 *glyphSize)
+void GLFontManager::SetLODThreshold(float pixels)
 {
-	uint16_t *buffer = *pbuffer;
-	buffer[0] = bezier->e0.x * UINT16_MAX / glyphSize->w;
-	buffer[1] = bezier->e0.y * UINT16_MAX / glyphSize->h;
-	buffer[2] = bezier->c.x  * UINT16_MAX / glyphSize->w;
-	buffer[3] = bezier->c.y  * UINT16_MAX / glyphSize->h;
-	buffer[4] = bezier->e1.x * UINT16_MAX / glyphSize->w;
-	buffer[5] = bezier->e1.y * UINT16_MAX / glyphSize->h;
-	*pbuffer += 6;
+	this->lodThreshold = pixels;
 }
 
-void write_glyph_data_to_buffer(
-	uint8_t *buffer8,
-	std::vector<Bezier2> &beziers,
-	Vec2 &glyphSize,
-	uint16_t gridX,
-	uint16_t gridY,
-	uint16_t gridWidth,
-	uint16_t gridHeight)
+void GLFontManager::SetCubicTargetSize(float pixelsPerEm)
 {
-	uint16_t *buffer = (uint16_t *)buffer8;
-	buffer[0] = gridX;
-	buffer[1] = gridY;
-	buffer[2] = gridWidth;
-	buffer[3] = gridHeight;
-	buffer += 4;
+	this->cubicTargetSize = std::max(pixelsPerEm, 0.0f);
+}
 
-	for (size_t i = 0; i < beziers.size(); i++) {
-		write_bezier_to_buffer(&buffer, &beziers[i], &glyphSize);
-	}
+void GLFontManager::SetShaderTransform(glm::mat4 transform)
+{
+	glUniformMatrix4fv(this->glContext->glyphShader->uTransform, 1, GL_FALSE, glm::value_ptr(transform));
 }
 
-GLFontManager::Glyph * GLFontManager::GetGlyphForCodepoint(FT_Face face, uint32_t point)
+void GLFontManager::UseBatchTransforms(GLuint transformsTexId)
 {
-	auto faceIt = this->glyphs.find(face);
-	if (faceIt != this->glyphs.end()) {
-		auto glyphIt = faceIt->second.find(point);
-		if (glyphIt != faceIt->second.end()) {
-			return &glyphIt->second;
-		}
+	bool batched = transformsTexId != 0;
+	GlyphShader *shader = this->glContext->glyphShader;
+	if (shader->batched != batched) {
+		glUniform1i(shader->uBatched, batched);
+		shader->batched = batched;
 	}
-
-	AtlasGroup *atlas = this->GetOpenAtlasGroup();
-
-	// Load the glyph. FT_LOAD_NO_SCALE implies that FreeType should not
-	// render the glyph to a bitmap, and ensures that metrics and outline
-	// points are represented in font units instead of em.
-	FT_UInt glyphIndex = FT_Get_Char_Index(face, point);
-	if (FT_Load_Glyph(face, glyphIndex, FT_LOAD_NO_SCALE)) {
-		return nullptr;
+	if (batched) {
+		this->BindTexture(2, GL_TEXTURE_BUFFER, transformsTexId);
 	}
+}
 
-	FT_Pos glyphWidth = face->glyph->metrics.width;
-	FT_Pos glyphHeight = face->glyph->metrics.height;
-	uint8_t gridWidth = kGridMaxSize;
-	uint8_t gridHeight = kGridMaxSize;
-
-	std::vector<Bezier2> curves = GetBeziersForOutline(&face->glyph->outline);
-	VGrid grid(curves, Vec2(glyphWidth, glyphHeight), gridWidth, gridHeight);
-
-	// Although the data is represented as a 32bit texture, it's actually
-	// two 16bit ints per pixel, each with an x and y coordinate for
-	// the bezier. Every six 16bit ints (3 pixels) is a full bezier
-	// Plus two pixels for grid position information
-	uint16_t bezierPixelLength = 2 + curves.size()*3;
-
-	bool tooManyCurves = uint32_t(bezierPixelLength) > sq(uint32_t(kBezierAtlasSize));
-
-	if (curves.size() == 0 || tooManyCurves) {
-		if (tooManyCurves) {
-			std::cerr << "WARN: Glyph " << point << " has too many curves\n";
-		}
+void GLFontManager::UseAtlasTextures()
+{
+	GPUMirror &gpu = *this->glContext->gpu;
+	this->BindTexture(0, GL_TEXTURE_2D_ARRAY, gpu.gridAtlasArrayId);
+	this->BindTexture(1, GL_TEXTURE_BUFFER, gpu.glyphDataBufTexId);
+	this->BindTexture(3, GL_TEXTURE_BUFFER, gpu.glyphHandleBufTexId);
+	this->BindTexture(4, GL_TEXTURE_BUFFER, gpu.glyphCurvesBufTexId);
+}
 
-		GLFontManager::Glyph glyph{};
-		glyph.bezierAtlasPos[1] = -1;
-		glyph.size[0] = glyphWidth;
-		glyph.size[1] = glyphHeight;
-		glyph.offset[0] = face->glyph->metrics.horiBearingX;
-		glyph.offset[1] = face->glyph->metrics.horiBearingY - glyphHeight;
-		glyph.advance = face->glyph->metrics.horiAdvance;
-		this->glyphs[face][point] = glyph;
-		return &this->glyphs[face][point];
+void GLFontManager::BindTexture(GLuint unit, GLenum target, GLuint texture)
+{
+	if (this->glContext->glState.textures[unit] == texture) {
+		return;
 	}
-
-	// Find an open position in the bezier atlas
-	if (atlas->glyphDataBufOffset + bezierPixelLength > sq(kBezierAtlasSize)) {
-		atlas->full = true;
-		atlas->uploaded = false;
-		atlas = this->GetOpenAtlasGroup();
+	if (this->glContext->glState.activeTexture != GL_TEXTURE0 + unit) {
+		glActiveTexture(GL_TEXTURE0 + unit);
+		this->glContext->glState.activeTexture = GL_TEXTURE0 + unit;
 	}
+	glBindTexture(target, texture);
+	this->glContext->glState.textures[unit] = texture;
+}
 
-	// Find an open position in the grid atlas
-	if (atlas->nextGridPos[0] + kGridMaxSize > kGridAtlasSize) {
-		atlas->nextGridPos[1] += kGridMaxSize;
-		atlas->nextGridPos[0] = 0;
-		if (atlas->nextGridPos[1] >= kGridAtlasSize) {
-			atlas->full = true;
-			atlas->uploaded = false;
-			atlas = this->GetOpenAtlasGroup(); // Should only ever happen once per glyph
-		}
+void GLFontManager::BindVertexArray(GLuint vertexArray)
+{
+	if (this->glContext->glState.vertexArray != vertexArray) {
+		glBindVertexArray(vertexArray);
+		this->glContext->glState.vertexArray = vertexArray;
 	}
-
-	uint8_t *bezierData = atlas->glyphDataBuf + (atlas->glyphDataBufOffset * kAtlasChannels);
-
-	Vec2 glyphSize(glyphWidth, glyphHeight);
-	write_glyph_data_to_buffer(
-		bezierData,
-		curves,
-		glyphSize,
-		atlas->nextGridPos[0],
-		atlas->nextGridPos[1],
-		kGridMaxSize,
-		kGridMaxSize);
-
-	// TODO: Integrate with AtlasGroup / replace AtlasGroup
-	VGridAtlas gridAtlas{};
-	gridAtlas.data = atlas->gridAtlas;
-	gridAtlas.width = kGridAtlasSize;
-	gridAtlas.height = kGridAtlasSize;
-	gridAtlas.depth = kAtlasChannels;
-	gridAtlas.WriteVGridAt(grid, atlas->nextGridPos[0], atlas->nextGridPos[1]);
-
-	GLFontManager::Glyph glyph{};
-	glyph.bezierAtlasPos[0] = atlas->glyphDataBufOffset;
-	glyph.bezierAtlasPos[1] = this->atlases.size()-1;
-	glyph.size[0] = glyphWidth;
-	glyph.size[1] = glyphHeight;
-	glyph.offset[0] = face->glyph->metrics.horiBearingX;
-	glyph.offset[1] = face->glyph->metrics.horiBearingY - glyphHeight;
-	glyph.advance = face->glyph->metrics.horiAdvance;
-	this->glyphs[face][point] = glyph;
-
-	atlas->glyphDataBufOffset += bezierPixelLength;
-	atlas->nextGridPos[0] += kGridMaxSize;
-	atlas->uploaded = false;
-
-	writeBMP("bezierAtlas.bmp", kBezierAtlasSize, kBezierAtlasSize, 4, atlas->glyphDataBuf);
-	writeBMP("gridAtlas.bmp", kGridAtlasSize, kGridAtlasSize, 4, atlas->gridAtlas);
-
-	return &this->glyphs[face][point];
 }
 
-void GLFontManager::LoadASCII(FT_Face face)
+// Deleting a bound vertex array unbinds it, and its name can then be reused,
+// so it's forgotten. Sets *vertexArray to 0.
+void GLFontManager::DeleteVertexArray(GLuint *vertexArray)
 {
-	if (!face) {
+	if (!*vertexArray) {
 		return;
 	}
-
-	this->GetGlyphForCodepoint(face, 0);
-
-	for (int i = 32; i < 128; i++) {
-		this->GetGlyphForCodepoint(face, i);
+	if (this->glContext->glState.vertexArray == *vertexArray) {
+		this->glContext->glState.vertexArray = 0;
 	}
+	glDeleteVertexArrays(1, vertexArray);
+	*vertexArray = 0;
 }
 
-void GLFontManager::UploadAtlases()
+void GLFontManager::EnableBlend()
 {
-	for (size_t i = 0; i < this->atlases.size(); i++) {
-		if (this->atlases[i].uploaded) {
-			continue;
-		}
-
-		glBindBuffer(GL_TEXTURE_BUFFER, this->atlases[i].glyphDataBufId);
-		glBufferData(GL_TEXTURE_BUFFER, sq(kBezierAtlasSize)*kAtlasChannels,
-			this->atlases[i].glyphDataBuf, GL_STREAM_DRAW);
-
-		glBindTexture(GL_TEXTURE_2D, this->atlases[i].gridAtlasId);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, kGridAtlasSize, kGridAtlasSize, 0, GL_RGBA, GL_UNSIGNED_BYTE, this->atlases[i].gridAtlas);
-
-		atlases[i].uploaded = true;
+	if (!this->glContext->glState.blend) {
+		glEnable(GL_BLEND);
+		this->glContext->glState.blend = true;
 	}
 }
 
-void GLFontManager::UseGlyphShader()
+void GLFontManager::ResetGLState()
 {
-	glUseProgram(this->glyphShader);
+	this->glContext->glState = GLState{};
 }
 
-void GLFontManager::SetShaderTransform(glm::mat4 transform)
+void GLFontManager::UseContext(const void *context, const void *shareWith)
 {
-	glUniformMatrix4fv(this->uTransform, 1, GL_FALSE, glm::value_ptr(transform));
+	auto found = this->glContexts.find(context);
+	if (found == this->glContexts.end()) {
+		GLContextState state{};
+		auto shared = this->glContexts.find(shareWith);
+		if (shareWith && shared != this->glContexts.end()) {
+			state.gpu = shared->second.gpu;
+		} else {
+			state.gpu = std::make_shared<GPUMirror>();
+		}
+		found = this->glContexts.insert(std::make_pair(context, std::move(state))).first;
+	}
+	this->glContext = &found->second;
 }
 
-void GLFontManager::UseAtlasTextures(uint16_t atlasIndex)
+void GLFontManager::ReleaseContext(const void *context)
 {
-	if (atlasIndex >= this->atlases.size()) {
+	auto found = this->glContexts.find(context);
+	if (found == this->glContexts.end()) {
 		return;
 	}
 
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, this->atlases[atlasIndex].gridAtlasId);
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_BUFFER, this->atlases[atlasIndex].glyphDataBufTexId);
+	bool current = this->glContext == &found->second;
+	this->DeleteContextObjects(found->second);
+	this->glContexts.erase(found);
+	if (current) {
+		this->UseContext(nullptr);
+	}
+}
+
+void GLFontManager::DeleteContextObjects(GLContextState &state)
+{
+	for (GLuint query : state.pendingTimerQueries) {
+		state.freeTimerQueries.push_back(query);
+	}
+	if (!state.freeTimerQueries.empty()) {
+		glDeleteQueries(state.freeTimerQueries.size(), state.freeTimerQueries.data());
+	}
+	state.pendingTimerQueries.clear();
+	state.freeTimerQueries.clear();
+
+	if (state.gpu.use_count() > 1) {
+		return;
+	}
+	GPUMirror &gpu = *state.gpu;
+	if (gpu.gridAtlasArrayId) {
+		glDeleteTextures(1, &gpu.gridAtlasArrayId);
+	}
+	if (gpu.glyphDataBufId) {
+		glDeleteTextures(1, &gpu.glyphDataBufTexId);
+		glDeleteTextures(1, &gpu.glyphCurvesBufTexId);
+		glDeleteBuffers(1, &gpu.glyphDataBufId);
+	}
+	if (gpu.glyphHandleBufId) {
+		glDeleteTextures(1, &gpu.glyphHandleBufTexId);
+		glDeleteBuffers(1, &gpu.glyphHandleBufId);
+	}
+	for (auto &shader : gpu.glyphShaders) {
+		glDeleteProgram(shader.second.program);
+	}
+	*state.gpu = GPUMirror{};
+	state.glState = GLState{};
 }
 
 static GLuint loadShaderProgram(const char *vsCodeC, const char *fsCodeC)
@@ -698,20 +2695,35 @@ static GLuint loadShaderProgram(const char *vsCodeC, const char *fsCodeC)
 }
 
 namespace {
+// Both shaders are compiled with #version and the #defines of their
+// variant put in front (see GLFontManager::LoadGlyphShader).
 const char *kGlyphVertexShader = R"(
-#version 330 core
 uniform samplerBuffer uGlyphData;
+uniform usamplerBuffer uGlyphHandles;
 uniform mat4 uTransform;
 
+// When drawing a GLTextBatch, each label's transform is in uTransforms,
+// applied before uTransform.
+uniform bool uBatched;
+uniform samplerBuffer uTransforms;
+
 layout(location = 0) in vec2 vPosition;
 layout(location = 1) in uint vData;
 layout(location = 2) in vec4 vColor;
+layout(location = 3) in uint vLabel;
 
 out vec4 oColor;
 flat out uint glyphDataOffset;
 flat out ivec4 oGridRect;
+flat out int oGridLayer;
+flat out int oOverflowOffset;
+flat out int oCoverageOffset;
 out vec2 oNormCoord;
 
+// Triangle strip vertex order of the hull's corners, which go
+// counterclockwise from the bottom edge
+const int kHullStrip[8] = int[8](0, 1, 7, 2, 6, 3, 5, 4);
+
 float ushortFromVec2(vec2 v)
 {
 	return (v.y * 65280.0 + v.x * 255.0);
@@ -723,13 +2735,64 @@ ivec2 vec2FromPixel(uint offset)
 	return ivec2(ushortFromVec2(pixel.xy), ushortFromVec2(pixel.zw));
 }
 
+// Corner i of the glyph's hull, where cuts is how far each corner of the
+// box is cut off (see write_glyph_hull_to_buffer())
+vec2 hullCorner(int i, vec4 cuts)
+{
+	vec2 corners[8] = vec2[8](
+		vec2(cuts.x, 0.0), vec2(1.0 - cuts.y, 0.0),
+		vec2(1.0, cuts.y), vec2(1.0, 1.0 - cuts.z),
+		vec2(1.0 - cuts.z, 1.0), vec2(cuts.w, 1.0),
+		vec2(0.0, 1.0 - cuts.w), vec2(0.0, cuts.x));
+	return corners[i];
+}
+
 void main()
 {
+	// Each instance is drawn as a 4 vertex triangle strip over its box,
+	// or with kTightQuads, an 8 vertex strip over its hull
+	oNormCoord = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+	vec4 hullCuts = vec4(0.0);
+
+	// vData is the glyph's handle, which gives its glyph data offset
+	uint offset = 0xFFFFFFFFu;
+	if (vData != 0xFFFFFFFFu) {
+		offset = texelFetch(uGlyphHandles, int(vData)).r;
+	}
+
 	oColor = vColor;
-	glyphDataOffset = vData >> 2u;
-	oNormCoord = vec2((vData & 2u) >> 1, vData & 1u);
-	oGridRect = ivec4(vec2FromPixel(glyphDataOffset), vec2FromPixel(glyphDataOffset + 1u));
-	gl_Position = uTransform*vec4(vPosition, 0.0, 1.0);
+	glyphDataOffset = offset;
+	vec2 size = vec2(0.0);
+	if (offset != 0xFFFFFFFFu) {
+		oGridRect = ivec4(vec2FromPixel(offset), vec2FromPixel(offset + 1u));
+		ivec2 layerAndCurves = vec2FromPixel(offset + 2u);
+		oGridLayer = layerAndCurves.x;
+
+		// Glyphs without curves (placeholders) have no coverage map
+		int curvesEnd = kGlyphHeaderPixels + layerAndCurves.y*kCurvePixels;
+		oCoverageOffset = layerAndCurves.y > 0 ? curvesEnd : -1;
+		oOverflowOffset = curvesEnd + (layerAndCurves.y > 0 ? kGlyphCoveragePixels + kGlyphHullPixels : 0);
+		size = vec2(vec2FromPixel(offset + 3u));
+#if kTightQuads
+		if (oCoverageOffset >= 0) {
+			uint hull = offset + uint(oCoverageOffset + kGlyphCoveragePixels);
+			hullCuts = vec4(vec2FromPixel(hull), vec2FromPixel(hull + 1u)) / 65535.0;
+		}
+#endif
+	}
+#if kTightQuads
+	oNormCoord = hullCorner(kHullStrip[gl_VertexID], hullCuts);
+#endif
+	mat4 transform = uTransform;
+	if (uBatched) {
+		int i = int(vLabel)*4;
+		transform *= mat4(
+			texelFetch(uTransforms, i),
+			texelFetch(uTransforms, i + 1),
+			texelFetch(uTransforms, i + 2),
+			texelFetch(uTransforms, i + 3));
+	}
+	gl_Position = transform*vec4(vPosition + oNormCoord*size, 0.0, 1.0);
 }
 )";
 
@@ -737,19 +2800,30 @@ const char *kGlyphFragmentShader = R"(
 // This shader slightly modified from source code by Will Dobbie.
 // See dobbieText.cpp for more info.
 
-#version 330 core
 precision highp float;
 
-#define numSS 4
+// numSS, kBoxWindow, and kGammaCorrect are defined by the variant, and
+// the glyph data layout constants by LoadGlyphShader
 #define pi 3.1415926535897932384626433832795
 #define kPixelWindowSize 1.0
 
-uniform sampler2D uGridAtlas;
+uniform usampler2DArray uGridAtlas;
 uniform samplerBuffer uGlyphData;
 
+// The glyph data again, as texels of 4 pixels. Glyph data is aligned to
+// them, so each curve is one texel.
+uniform usamplerBuffer uGlyphCurves;
+
+// Glyphs whose longer side is drawn smaller than this many pixels are drawn
+// from their coverage map instead of their curves
+uniform float uLODThreshold;
+
 in vec4 oColor;
 flat in uint glyphDataOffset;
 flat in ivec4 oGridRect;
+flat in int oGridLayer;
+flat in int oOverflowOffset;
+flat in int oCoverageOffset;
 in vec2 oNormCoord;
 
 layout(location = 0) out vec4 outColor;
@@ -770,21 +2844,26 @@ bool almostEqual(float a, float b)
 	return abs(a-b) < 1e-5;
 }
 
-float normalizedUshortFromVec2(vec2 v)
+vec4 getPixelByOffset(int offset)
 {
-	return (v.y * 65280.0 + v.x * 255.0) / 65536.0;
+	return texelFetch(uGlyphData, offset);
 }
 
-vec4 getPixelByOffset(int offset)
+ivec2 ushortsAtOffset(int offset)
 {
-	return texelFetch(uGlyphData, offset);
+	vec4 pixel = getPixelByOffset(offset);
+	return ivec2(round(vec2(pixel.y, pixel.w) * 65280.0 + vec2(pixel.x, pixel.z) * 255.0));
 }
 
+// Each curve is a single fetch of its three points, as pairs of 16-bit
+// coordinates (see write_bezier_to_buffer()). Glyph data and its header are
+// aligned to whole texels, so the curves start on one.
 void fetchBezier(int coordIndex, out vec2 p[3])
 {
+	int first = (int(glyphDataOffset) + kGlyphHeaderPixels) / kCurvePixels;
+	uvec4 texel = texelFetch(uGlyphCurves, first + coordIndex);
 	for (int i=0; i<3; i++) {
-		vec4 pixel = getPixelByOffset(int(glyphDataOffset) + 2 + coordIndex*3 + i);
-		p[i] = vec2(normalizedUshortFromVec2(pixel.xy), normalizedUshortFromVec2(pixel.zw)) - oNormCoord;
+		p[i] = vec2(texel[i] & 0xFFFFu, texel[i] >> 16u) / 65536.0 - oNormCoord;
 	}
 }
 
@@ -806,9 +2885,28 @@ int getAxisIntersections(float p0, float p1, float p2, out vec2 t)
 
 float integrateWindow(float x)
 {
+#if kBoxWindow
+	return 0.5 * (1.0 - x);                        // box window
+#else
 	float xsq = x*x;
 	return sign(x) * (0.5 * xsq*xsq - xsq) + 0.5;  // parabolic window
-	//return 0.5 * (1.0 - sign(x) * xsq);          // box window
+#endif
+}
+
+// Blending a coverage of a in gamma space gives the same color as blending
+// it in linear space would when a' = 1 - (1 - a)^(1/2.2) for dark text on a
+// light background, or a' = a^(1/2.2) for light text on a dark one. Mixed by
+// the luminance of the text color in between.
+float gammaCorrectCoverage(float a, vec3 color)
+{
+#if kGammaCorrect
+	float luminance = dot(color, vec3(0.2126, 0.7152, 0.0722));
+	float dark = 1.0 - pow(1.0 - a, 1.0/2.2);
+	float light = pow(a, 1.0/2.2);
+	return mix(dark, light, luminance);
+#else
+	return a;
+#endif
 }
 
 mat2 getUnitLineMatrix(vec2 b1, vec2 b2)
@@ -857,6 +2955,27 @@ void updateClosestCrossing(in vec2 porig[3], mat2 M, inout float closest, ivec2
 	}
 }
 
+// The coverage map holds one byte per texel, four texels per pixel. See
+// VGrid::coverage.
+float coverageAt(ivec2 texel)
+{
+	int i = texel.y*kCoverageSize + texel.x;
+	vec4 pixel = getPixelByOffset(int(glyphDataOffset) + oCoverageOffset + (i >> 2));
+	return pixel[i & 3];
+}
+
+float sampleCoverage(vec2 ncoord)
+{
+	vec2 p = clamp(ncoord*float(kCoverageSize) - 0.5, vec2(0.0), vec2(float(kCoverageSize - 1)));
+	ivec2 i0 = ivec2(p);
+	ivec2 i1 = min(i0 + 1, ivec2(kCoverageSize - 1));
+	vec2 f = p - vec2(i0);
+	return mix(
+		mix(coverageAt(i0), coverageAt(ivec2(i1.x, i0.y)), f.x),
+		mix(coverageAt(ivec2(i0.x, i1.y)), coverageAt(i1), f.x),
+		f.y);
+}
+
 mat2 inverse(mat2 m)
 {
 	return mat2(m[1][1],-m[0][1], -m[1][0], m[0][0])
@@ -865,21 +2984,54 @@ mat2 inverse(mat2 m)
 
 void main()
 {
+	// Derivatives are only defined before any fragment returns early, so
+	// they're all taken first
+	vec2 dx = dFdx(oNormCoord);
+	vec2 dy = dFdy(oNormCoord);
+	mat2 initrot = inverse(mat2(dx * kPixelWindowSize, dy * kPixelWindowSize));
+
+	// How much of the glyph one pixel covers. Small glyphs cover too few
+	// pixels for the curves to be worth testing, so their coverage map
+	// is sampled instead.
+	vec2 pixelSize = abs(dx) + abs(dy);
+	if (oCoverageOffset >= 0 && min(pixelSize.x, pixelSize.y)*uLODThreshold > 1.0) {
+		outColor = oColor;
+		outColor.a *= gammaCorrectCoverage(sampleCoverage(oNormCoord), oColor.rgb);
+		return;
+	}
+
 	ivec2 integerCell = normalizedCoordToIntegerCell(oNormCoord);
 	ivec2 indicesCoord = ivec2(oGridRect.xy + integerCell);
 	vec2 cellMid = (integerCell + 0.5) / oGridRect.zw;
 
-	mat2 initrot = inverse(mat2(dFdx(oNormCoord) * kPixelWindowSize, dFdy(oNormCoord) * kPixelWindowSize));
-
-	float theta = pi/float(numSS);
-	mat2 rotM = mat2(cos(theta), sin(theta), -sin(theta), cos(theta)); // note this is column major ordering
-
-	ivec4 indices1 = ivec4(texelFetch(uGridAtlas, indicesCoord, 0) * 255.0);
+	ivec4 indices1 = ivec4(texelFetch(uGridAtlas, ivec3(indicesCoord, oGridLayer), 0));
 
 	// The mid-inside flag is encoded by the order of the beziers indices.
 	// See write_vgrid_cell_to_buffer() for details.
 	bool midInside = indices1[0] > indices1[1];
 
+	// A cell without curves is entirely inside or outside, which is all
+	// the rays below would find. Overflow cells always have curves in
+	// their first two indices.
+	if (all(lessThan(indices1, ivec4(2)))) {
+		if (!midInside) {
+			discard;
+		}
+		outColor = oColor;
+		return;
+	}
+
+	float theta = pi/float(numSS);
+	mat2 rotM = mat2(cos(theta), sin(theta), -sin(theta), cos(theta)); // note this is column major ordering
+
+	// Cells with more than 4 beziers only hold the first two. The rest are
+	// in an overflow list, ending with a 0 index, after the glyph's curves.
+	// See write_vgrid_overflow_cell_to_buffer() for details.
+	bool moreThanFourIndices = indices1[3] == 1;
+	int numInline = moreThanFourIndices ? 2 : 4;
+	int overflowList = int(glyphDataOffset) + oOverflowOffset + indices1[2];
+	ivec2 indices2;
+
 	float midClosest = midInside ? -2.0 : 2.0;
 
 	float firstIntersection[numSS];
@@ -891,15 +3043,21 @@ void main()
 
 	mat2 midTransform = getUnitLineMatrix(oNormCoord, cellMid);
 
-	for (int bezierIndex=0; bezierIndex<4; bezierIndex++) {
+	// A glyph has at most 65534 beziers, so this always ends before the limit
+	for (int bezierIndex=0; bezierIndex<65536; bezierIndex++) {
 		int coordIndex;
 
-		//if (bezierIndex < 4) {
+		if (bezierIndex < numInline) {
 			coordIndex = indices1[bezierIndex];
-		//} else {
-		//	 if (!moreThanFourIndices) break;
-		//	 coordIndex = indices2[bezierIndex-4];
-		//}
+		} else {
+			if (!moreThanFourIndices) break;
+			int i = bezierIndex - numInline;
+			if ((i & 1) == 0) {
+				indices2 = ushortsAtOffset(overflowList + i/2);
+			}
+			coordIndex = indices2[i & 1];
+			if (coordIndex == 0) break;
+		}
 
 		// Indices 0 and 1 are both "no bezier" -- see
 		// write_vgrid_cell_to_buffer() for why.
@@ -965,7 +3123,7 @@ void main()
 
 	percent = percent / float(numSS);
 	outColor = oColor;
-	outColor.a *= percent;
+	outColor.a *= gammaCorrectCoverage(clamp(percent, 0.0, 1.0), oColor.rgb);
 }
 )";
 }
@@ -0,0 +1,147 @@
+#include "glyph_cache.hpp"
+
+static const size_t kInitialSlots = 256;
+
+static size_t hash_key(FT_Face face, uint32_t glyphIndex)
+{
+	// 64-bit mix (splitmix64 finalizer) of the face pointer and glyph index
+	uint64_t h = (uint64_t)(uintptr_t)face ^ ((uint64_t)glyphIndex << 32 | glyphIndex);
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+	return (size_t)(h ^ (h >> 31));
+}
+
+GlyphCache::GlyphCache()
+: slots(kInitialSlots, nullptr), hashedCount(0)
+{
+}
+
+GlyphCache::LowIndexTable * GlyphCache::FindLowIndexTable(FT_Face face)
+{
+	// There are only ever a handful of faces, so a linear search is faster
+	// than anything fancier.
+	for (size_t i = 0; i < this->lowIndices.size(); i++) {
+		if (this->lowIndices[i].face == face) {
+			return &this->lowIndices[i];
+		}
+	}
+	return nullptr;
+}
+
+// Returns the slot containing the glyph, or the empty slot where it would go.
+size_t GlyphCache::FindSlot(FT_Face face, uint32_t glyphIndex) const
+{
+	size_t mask = this->slots.size() - 1;
+	size_t i = hash_key(face, glyphIndex) & mask;
+	while (this->slots[i]) {
+		if (this->slots[i]->face == face && this->slots[i]->glyphIndex == glyphIndex) {
+			break;
+		}
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+void GlyphCache::Grow()
+{
+	std::vector<Entry *> old;
+	old.swap(this->slots);
+	this->slots.assign(old.size() * 2, nullptr);
+
+	for (Entry *entry : old) {
+		if (entry) {
+			this->slots[this->FindSlot(entry->face, entry->glyphIndex)] = entry;
+		}
+	}
+}
+
+GLFontManager::Glyph * GlyphCache::Find(FT_Face face, uint32_t glyphIndex)
+{
+	if (glyphIndex < kLowIndexCount) {
+		LowIndexTable *table = this->FindLowIndexTable(face);
+		if (!table || !table->glyphs[glyphIndex]) {
+			return nullptr;
+		}
+		return &table->glyphs[glyphIndex]->glyph;
+	}
+
+	Entry *entry = this->slots[this->FindSlot(face, glyphIndex)];
+	return entry ? &entry->glyph : nullptr;
+}
+
+GLFontManager::Glyph * GlyphCache::Insert(
+	FT_Face face,
+	uint32_t glyphIndex,
+	const GLFontManager::Glyph &glyph)
+{
+	GLFontManager::Glyph *existing = this->Find(face, glyphIndex);
+	if (existing) {
+		*existing = glyph;
+		return existing;
+	}
+
+	Entry *entry;
+	if (this->freeEntries.empty()) {
+		this->entries.push_back(Entry{face, glyphIndex, glyph});
+		entry = &this->entries.back();
+	} else {
+		entry = this->freeEntries.back();
+		this->freeEntries.pop_back();
+		*entry = Entry{face, glyphIndex, glyph};
+	}
+
+	if (glyphIndex < kLowIndexCount) {
+		LowIndexTable *table = this->FindLowIndexTable(face);
+		if (!table) {
+			this->lowIndices.push_back(LowIndexTable{face, {}});
+			table = &this->lowIndices.back();
+		}
+		table->glyphs[glyphIndex] = entry;
+		return &entry->glyph;
+	}
+
+	// Keep the load factor at or below 1/2 so probe chains stay short
+	this->hashedCount++;
+	if (this->hashedCount * 2 > this->slots.size()) {
+		this->Grow();
+	}
+
+	this->slots[this->FindSlot(face, glyphIndex)] = entry;
+	return &entry->glyph;
+}
+
+void GlyphCache::Erase(FT_Face face, uint32_t glyphIndex)
+{
+	Entry *entry;
+	if (glyphIndex < kLowIndexCount) {
+		LowIndexTable *table = this->FindLowIndexTable(face);
+		if (!table || !table->glyphs[glyphIndex]) {
+			return;
+		}
+		entry = table->glyphs[glyphIndex];
+		table->glyphs[glyphIndex] = nullptr;
+	} else {
+		size_t mask = this->slots.size() - 1;
+		size_t i = this->FindSlot(face, glyphIndex);
+		entry = this->slots[i];
+		if (!entry) {
+			return;
+		}
+		this->slots[i] = nullptr;
+		this->hashedCount--;
+
+		// Move later entries of the probe chain into the gap, unless
+		// their own slot is after it, so that lookups don't stop early
+		for (size_t j = (i + 1) & mask; this->slots[j]; j = (j + 1) & mask) {
+			size_t home = hash_key(this->slots[j]->face, this->slots[j]->glyphIndex) & mask;
+			if (((j - home) & mask) >= ((j - i) & mask)) {
+				this->slots[i] = this->slots[j];
+				this->slots[j] = nullptr;
+				i = j;
+			}
+		}
+	}
+
+	entry->face = nullptr;
+	this->freeEntries.push_back(entry);
+}
@@ -0,0 +1,63 @@
+#ifndef GLYPH_CACHE_H
+#define GLYPH_CACHE_H
+
+#include <gllabel.hpp>
+#include <deque>
+#include <vector>
+
+// Maps (face, glyph index) pairs to glyphs using an open-addressing hash
+// table. Glyph indices below kLowIndexCount are also kept in a small per-face
+// array so that the common case never needs to hash, since fonts tend to put
+// the glyphs of Latin text first. Entries are never moved once inserted, so
+// the returned Glyph pointers stay valid until the glyph is erased.
+class GlyphCache
+{
+public:
+	struct Entry
+	{
+		FT_Face face;
+		uint32_t glyphIndex;
+		GLFontManager::Glyph glyph;
+	};
+
+	GlyphCache();
+
+	// Returns nullptr if the glyph isn't cached.
+	GLFontManager::Glyph * Find(FT_Face face, uint32_t glyphIndex);
+
+	// Replaces the glyph if it's already cached.
+	GLFontManager::Glyph * Insert(
+		FT_Face face,
+		uint32_t glyphIndex,
+		const GLFontManager::Glyph &glyph);
+
+	// Does nothing if the glyph isn't cached. The entry is reused by a
+	// later Insert.
+	void Erase(FT_Face face, uint32_t glyphIndex);
+
+	// All entries, in insertion order. Erased entries have a null face.
+	inline const std::deque<Entry> & Entries() const { return entries; }
+
+private:
+	static const uint32_t kLowIndexCount = 128;
+
+	struct LowIndexTable
+	{
+		FT_Face face;
+		Entry *glyphs[kLowIndexCount];
+	};
+
+	std::deque<Entry> entries;
+	std::vector<Entry *> freeEntries;
+	std::vector<LowIndexTable> lowIndices;
+
+	// Power-of-two sized, linearly probed. Empty slots are nullptr.
+	std::vector<Entry *> slots;
+	size_t hashedCount;
+
+	LowIndexTable * FindLowIndexTable(FT_Face face);
+	size_t FindSlot(FT_Face face, uint32_t glyphIndex) const;
+	void Grow();
+};
+
+#endif
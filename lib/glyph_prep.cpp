@@ -0,0 +1,181 @@
+#include "glyph_prep.hpp"
+#include "outline.hpp"
+#include "atlas.hpp"
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+
+// Initial grid size, as the number of cells per curve of the glyph
+static const float kGridCellsPerCurve = 4;
+
+// Cells can hold any number of curves with overflow lists, but each curve
+// makes the cell slower to draw. Grids grow until no cell has more than
+// this many, or the overflow lists don't fit.
+static const size_t kGridMaxCellCurves = 8;
+
+// How much bigger to make a grid that has too many curves in one cell
+static const float kGridGrowth = 1.25f;
+
+static const uint8_t kGridMinSize = 2;
+
+bool prepare_glyph(FT_Face face, uint32_t glyphIndex, double cubicTolerance, PreparedGlyph *prepared)
+{
+	// Load the glyph. FT_LOAD_NO_SCALE implies that FreeType should not
+	// render the glyph to a bitmap, and ensures that metrics and outline
+	// points are represented in font units instead of em.
+	auto start = std::chrono::steady_clock::now();
+	prepared->loadNanos = prepared->outlineNanos = prepared->gridNanos = 0;
+	if (FT_Load_Glyph(face, glyphIndex, FT_LOAD_NO_SCALE)) {
+		return false;
+	}
+	prepared->loadNanos = nanos_since(start);
+
+	start = std::chrono::steady_clock::now();
+	prepared->metrics = face->glyph->metrics;
+	FT_Pos glyphWidth = face->glyph->metrics.width;
+	FT_Pos glyphHeight = face->glyph->metrics.height;
+	prepared->curves = GetBeziersForOutline(&face->glyph->outline, cubicTolerance);
+	prepared->outlineNanos = nanos_since(start);
+	if (prepared->curves.size() == 0) {
+		return true; // Nothing to draw, so no grid is needed
+	}
+
+	// Start with a grid that has a few cells per curve and roughly square
+	// cells, then refine it until no cell has too many curves (or the grid
+	// can't get any bigger).
+	float aspect = std::max(glyphWidth, (FT_Pos)1) / (float)std::max(glyphHeight, (FT_Pos)1);
+	float cells = prepared->curves.size() * kGridCellsPerCurve;
+	float gridWidth = std::sqrt(cells * aspect);
+	float gridHeight = std::sqrt(cells / aspect);
+
+	start = std::chrono::steady_clock::now();
+	for (;;) {
+		int w = std::min(std::max((int)std::ceil(gridWidth), (int)kGridMinSize), (int)kGridMaxSize);
+		int h = std::min(std::max((int)std::ceil(gridHeight), (int)kGridMinSize), (int)kGridMaxSize);
+		prepared->grid.Build(
+			prepared->curves,
+			Vec2(glyphWidth, glyphHeight),
+			w,
+			h);
+
+		bool maxed = w == kGridMaxSize && h == kGridMaxSize;
+		if (maxed || (prepared->grid.MaxCellBezierCount() <= kGridMaxCellCurves
+			&& prepared->grid.OverflowPixelCount(kAtlasChannels) <= kMaxOverflowPixels)) {
+			break;
+		}
+		gridWidth = std::max(gridWidth, (float)w) * kGridGrowth;
+		gridHeight = std::max(gridHeight, (float)h) * kGridGrowth;
+	}
+	prepared->gridNanos = nanos_since(start);
+	return true;
+}
+
+GlyphWorkerPool::GlyphWorkerPool(unsigned threadCount)
+: outstanding(0), stopping(false)
+{
+	for (unsigned i = 0; i < threadCount; i++) {
+		this->threads.emplace_back(&GlyphWorkerPool::RunWorker, this);
+	}
+}
+
+GlyphWorkerPool::~GlyphWorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stopping = true;
+	}
+	this->jobQueued.notify_all();
+	for (std::thread &thread : this->threads) {
+		thread.join();
+	}
+}
+
+void GlyphWorkerPool::Queue(
+	FT_Face face,
+	std::string fontPath,
+	uint32_t glyphIndex,
+	double cubicTolerance,
+	void *userData)
+{
+	Job job{};
+	job.face = face;
+	job.glyphIndex = glyphIndex;
+	job.cubicTolerance = cubicTolerance;
+	job.userData = userData;
+	job.fontPath = fontPath;
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->queue.push_back(std::move(job));
+		this->outstanding++;
+	}
+	this->jobQueued.notify_one();
+}
+
+void GlyphWorkerPool::TakeFinished(std::vector<Job> &done, bool wait)
+{
+	std::unique_lock<std::mutex> lock(this->mutex);
+	if (wait) {
+		this->jobFinished.wait(lock, [this] {
+			return this->finished.size() == this->outstanding;
+		});
+	}
+
+	this->outstanding -= this->finished.size();
+	for (Job &job : this->finished) {
+		done.push_back(std::move(job));
+	}
+	this->finished.clear();
+}
+
+size_t GlyphWorkerPool::Outstanding()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->outstanding;
+}
+
+void GlyphWorkerPool::RunWorker()
+{
+	// Each worker has its own library and copy of every face it has used,
+	// since neither may be used from two threads at once.
+	FT_Library ft;
+	if (FT_Init_FreeType(&ft) != FT_Err_Ok) {
+		std::cerr << "Failed to load freetype\n";
+		ft = nullptr;
+	}
+	std::map<std::string, FT_Face> faces;
+
+	std::unique_lock<std::mutex> lock(this->mutex);
+	while (true) {
+		this->jobQueued.wait(lock, [this] {
+			return this->stopping || !this->queue.empty();
+		});
+		if (this->stopping) {
+			break;
+		}
+
+		Job job = std::move(this->queue.front());
+		this->queue.pop_front();
+		lock.unlock();
+
+		auto faceIt = faces.find(job.fontPath);
+		if (faceIt == faces.end()) {
+			FT_Face face = nullptr;
+			if (ft && FT_New_Face(ft, job.fontPath.c_str(), 0, &face)) {
+				face = nullptr;
+			}
+			faceIt = faces.insert(std::make_pair(job.fontPath, face)).first;
+		}
+		job.ok = faceIt->second
+			&& prepare_glyph(faceIt->second, job.glyphIndex, job.cubicTolerance, &job.prepared);
+
+		lock.lock();
+		this->finished.push_back(std::move(job));
+		this->jobFinished.notify_all();
+	}
+	lock.unlock();
+
+	if (ft) {
+		FT_Done_FreeType(ft);
+	}
+}
@@ -0,0 +1,88 @@
+#ifndef GLYPH_PREP_H
+#define GLYPH_PREP_H
+
+#include "types.hpp"
+#include "vgrid.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+// Everything about a glyph that can be computed without touching the atlases.
+// Preparing a glyph is the expensive part of loading it, and only needs the
+// face, so it can happen on any thread that owns the face.
+struct PreparedGlyph
+{
+	FT_Glyph_Metrics metrics;
+	std::vector<Bezier2> curves;
+	VGrid grid;
+
+	// Time spent loading the glyph with FreeType, converting its outline
+	// to curves, and building its grid, in nanoseconds
+	uint64_t loadNanos, outlineNanos, gridNanos;
+};
+
+// Nanoseconds since `start`, for timing glyph preparation
+static inline uint64_t nanos_since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - start).count();
+}
+
+// Loads the outline of a glyph, by glyph index, and builds its grid. Cubics
+// are approximated to within cubicTolerance font units (see
+// GetBeziersForOutline). Returns false if FreeType fails to load the glyph.
+bool prepare_glyph(FT_Face face, uint32_t glyphIndex, double cubicTolerance, PreparedGlyph *prepared);
+
+// A pool of threads that prepare glyphs in the background. FreeType faces
+// are not thread-safe, so every worker opens its own copy of each face from
+// the face's font file.
+class GlyphWorkerPool
+{
+public:
+	struct Job
+	{
+		// Identifies the glyph to the thread that queued it. Workers
+		// only use fontPath, glyphIndex, which is the same in
+		// every copy of the face, and cubicTolerance.
+		FT_Face face;
+		uint32_t glyphIndex;
+		double cubicTolerance;
+		void *userData;
+
+		std::string fontPath;
+		bool ok;
+		PreparedGlyph prepared;
+	};
+
+	GlyphWorkerPool(unsigned threadCount);
+	~GlyphWorkerPool();
+
+	void Queue(FT_Face face, std::string fontPath, uint32_t glyphIndex, double cubicTolerance, void *userData);
+
+	// Moves all finished jobs into `done`, without blocking. If `wait` is
+	// true, first waits until every queued job is finished.
+	void TakeFinished(std::vector<Job> &done, bool wait);
+
+	// Number of jobs that have been queued but not yet taken.
+	size_t Outstanding();
+
+private:
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable jobQueued, jobFinished;
+	std::deque<Job> queue;
+	std::vector<Job> finished;
+	size_t outstanding;
+	bool stopping;
+
+	void RunWorker();
+};
+
+#endif
@@ -6,7 +6,7 @@ struct DecomposeState
 {
 	std::vector<Bezier2> *curves;
 	FT_Vector prev;
-	int c2qResolution;
+	double c2qResolution;
 	double *c2qOut;
 };
 
@@ -72,7 +72,7 @@ static int decompose_cubic_to(
 
 // Decompose an outline into an array of quadratic bezier curves. Cubics in
 // the outline are converted to quadratic at the given resolution.
-static std::vector<Bezier2> decompose(FT_Outline *outline, int c2qResolution)
+static std::vector<Bezier2> decompose(FT_Outline *outline, double c2qResolution)
 {
 	double c2qOut[C2Q_OUT_LEN];
 
@@ -119,7 +119,7 @@ static void flip_beziers(std::vector<Bezier2> &beziers)
 
 // Convert a FreeType Outline into an array of quadratic beziers. For well-
 // designed fonts, the beziers are always generated clockwise (fill right).
-std::vector<Bezier2> GetBeziersForOutline(FT_Outline *outline)
+std::vector<Bezier2> GetBeziersForOutline(FT_Outline *outline, double cubicTolerance)
 {
 	if (!outline || outline->n_points <= 0) {
 		return std::vector<Bezier2>();
@@ -132,8 +132,10 @@ std::vector<Bezier2> GetBeziersForOutline(FT_Outline *outline)
 
 	// Tolerance for error when approxmating cubic beziers with quadratics.
 	// Too low and many quadratics are generated (slow), too high and not
-	// enough are generated (looks bad). 5% works pretty well.
-	int c2qResolution = std::max((int)(((width + height) / 2) * 0.05), 1);
+	// enough are generated (looks bad). Without a tolerance from the size
+	// text is drawn at, 5% works pretty well.
+	double c2qResolution = cubicTolerance > 0 ? cubicTolerance
+		: std::max(((width + height) / 2) * 0.05, 1.0);
 
 	std::vector<Bezier2> beziers = decompose(outline, c2qResolution);
 
@@ -7,6 +7,8 @@
 #include FT_FREETYPE_H
 #include FT_OUTLINE_H
 
-std::vector<Bezier2> GetBeziersForOutline(FT_Outline *outline);
+// Cubics are approximated with quadratics that stray at most cubicTolerance
+// font units from them, or 5% of the outline's size if it is 0.
+std::vector<Bezier2> GetBeziersForOutline(FT_Outline *outline, double cubicTolerance = 0);
 
 #endif
@@ -0,0 +1,187 @@
+#include "shaper.hpp"
+#include <algorithm>
+#include <cstring>
+#include FT_ADVANCES_H
+
+// Tabs are as wide as this many spaces
+static const int kTabSpaces = 4;
+
+// Standard ligatures and their presentation forms, longest first, so that
+// "ffi" becomes one glyph rather than "f" and "fi" when the face has it
+struct Ligature
+{
+	char32_t form;
+	const char32_t *text;
+	size_t length;
+};
+
+static const Ligature kLigatures[] = {
+	{0xFB03, U"ffi", 3},
+	{0xFB04, U"ffl", 3},
+	{0xFB00, U"ff", 2},
+	{0xFB01, U"fi", 2},
+	{0xFB02, U"fl", 2},
+};
+
+static bool is_control(char32_t c)
+{
+	return c == '\n' || c == '\r' || c == '\t';
+}
+
+static uint64_t hash_run(FT_Face face, uint8_t features, const char32_t *text, size_t length)
+{
+	// FNV-1a over the characters, then the splitmix64 finalizer
+	uint64_t h = (uint64_t)(uintptr_t)face ^ features;
+	for (size_t i = 0; i < length; i++) {
+		h = (h ^ text[i]) * 0x100000001b3ULL;
+	}
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+	return h ^ (h >> 31);
+}
+
+Shaper::Shaper()
+: hits(0), misses(0), lastFace(nullptr)
+{
+	static_assert(sizeof(kLigatures) / sizeof(kLigatures[0]) == kLigatureCount,
+		"kLigatureCount must match kLigatures");
+}
+
+Shaper::FaceInfo * Shaper::GetFaceInfo(FT_Face face)
+{
+	if (this->lastFace && this->lastFace->face == face) {
+		return this->lastFace;
+	}
+	for (FaceInfo &info : this->faces) {
+		if (info.face == face) {
+			return this->lastFace = &info;
+		}
+	}
+
+	this->faces.push_back(FaceInfo{});
+	FaceInfo &info = this->faces.back();
+	info.face = face;
+	info.kerning = FT_HAS_KERNING(face);
+	for (uint32_t i = 0; i < kAsciiSize; i++) {
+		info.ascii[i] = FT_Get_Char_Index(face, i);
+	}
+
+	// Fixed-width faces are left without ligatures, which would break
+	// their columns
+	for (size_t i = 0; i < kLigatureCount && !FT_IS_FIXED_WIDTH(face); i++) {
+		info.ligatureGlyphs[i] = FT_Get_Char_Index(face, kLigatures[i].form);
+		info.ligatures |= info.ligatureGlyphs[i] != 0;
+	}
+
+	FT_Fixed space = 0;
+	if (FT_Get_Advance(face, info.ascii[' '], FT_LOAD_NO_SCALE, &space) || space <= 0) {
+		space = face->units_per_EM / 4;
+	}
+	info.tabWidth = std::min((FT_Fixed)INT16_MAX, std::max((FT_Fixed)1, space * kTabSpaces));
+	return this->lastFace = &info;
+}
+
+uint32_t Shaper::GlyphIndex(FaceInfo *info, char32_t point)
+{
+	if (point < kAsciiSize) {
+		return info->ascii[point];
+	}
+	auto it = info->points.find(point);
+	if (it == info->points.end()) {
+		it = info->points.insert(std::make_pair(point, FT_Get_Char_Index(info->face, point))).first;
+	}
+	return it->second;
+}
+
+uint32_t Shaper::GlyphIndex(FT_Face face, char32_t point)
+{
+	return this->GlyphIndex(this->GetFaceInfo(face), point);
+}
+
+void Shaper::ShapeUncached(
+	FaceInfo *info,
+	const char32_t *text,
+	size_t length,
+	GLFontManager::Features features,
+	uint32_t *glyphIndices,
+	int16_t *spacing)
+{
+	for (size_t i = 0; i < length; i++) {
+		glyphIndices[i] = is_control(text[i]) ? kNoGlyph : this->GlyphIndex(info, text[i]);
+		spacing[i] = text[i] == '\t' ? info->tabWidth : 0;
+	}
+
+	if (features.ligatures && info->ligatures) {
+		for (size_t i = 0; i < length; i++) {
+			for (size_t l = 0; l < kLigatureCount; l++) {
+				const Ligature &ligature = kLigatures[l];
+				if (!info->ligatureGlyphs[l] || length - i < ligature.length
+					|| memcmp(text + i, ligature.text, ligature.length * sizeof(char32_t))) {
+					continue;
+				}
+				glyphIndices[i] = info->ligatureGlyphs[l];
+				for (size_t j = 1; j < ligature.length; j++) {
+					glyphIndices[i + j] = kNoGlyph;
+				}
+				i += ligature.length - 1;
+				break;
+			}
+		}
+	}
+
+	// The kerning between two glyphs goes after the first, past any
+	// characters its ligature covers
+	if (features.kerning && info->kerning) {
+		size_t prev = length;
+		for (size_t i = 0; i < length; i++) {
+			if (glyphIndices[i] == kNoGlyph) {
+				continue;
+			}
+			FT_Vector kerning;
+			if (prev < length && !FT_Get_Kerning(info->face, glyphIndices[prev], glyphIndices[i],
+				FT_KERNING_UNSCALED, &kerning)) {
+				int adjusted = spacing[prev] + kerning.x;
+				spacing[prev] = std::min(INT16_MAX, std::max(INT16_MIN, adjusted));
+			}
+			prev = i;
+		}
+	}
+}
+
+void Shaper::Shape(
+	FT_Face face,
+	const char32_t *text,
+	size_t length,
+	GLFontManager::Features features,
+	uint32_t *glyphIndices,
+	int16_t *spacing)
+{
+	FaceInfo *info = this->GetFaceInfo(face);
+	bool pairs = (features.kerning && info->kerning) || (features.ligatures && info->ligatures);
+	if (!pairs || length < 2 || length > kMaxCachedRun) {
+		this->ShapeUncached(info, text, length, features, glyphIndices, spacing);
+		return;
+	}
+
+	if (this->runs.empty()) {
+		this->runs.assign(kCachedRuns, CachedRun{});
+	}
+	uint8_t bits = features.kerning | features.ligatures << 1;
+	CachedRun &run = this->runs[hash_run(face, bits, text, length) & (kCachedRuns - 1)];
+	if (run.face == face && run.features == bits && run.length == length
+		&& !memcmp(run.text, text, length * sizeof(char32_t))) {
+		this->hits++;
+		memcpy(glyphIndices, run.glyphIndices, length * sizeof(uint32_t));
+		memcpy(spacing, run.spacing, length * sizeof(int16_t));
+		return;
+	}
+
+	this->misses++;
+	this->ShapeUncached(info, text, length, features, glyphIndices, spacing);
+	run.face = face;
+	run.features = bits;
+	run.length = length;
+	memcpy(run.text, text, length * sizeof(char32_t));
+	memcpy(run.glyphIndices, glyphIndices, length * sizeof(uint32_t));
+	memcpy(run.spacing, spacing, length * sizeof(int16_t));
+}
@@ -0,0 +1,95 @@
+#ifndef SHAPER_H
+#define SHAPER_H
+
+#include <gllabel.hpp>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+// Turns runs of characters into glyph indices and the spacing between them.
+// A run is a word, with any space after it, in one face: kerning between
+// runs is ignored, so that an edit only reshapes the runs it touches.
+//
+// Kerning comes from the face's kern table, and ligatures from the Unicode
+// presentation forms of the standard Latin ligatures (U+FB00 to U+FB04),
+// where the face has them. Faces without either are only mapped through
+// their charmap. Runs short enough are cached by their face, features and
+// characters, so that common words are only shaped once for every label.
+class Shaper
+{
+public:
+	// Characters without a glyph of their own: control characters, and
+	// characters drawn by the ligature glyph of the character before them
+	static const uint32_t kNoGlyph = 0xFFFFFFFF;
+
+	Shaper();
+
+	// Whether a run ends after this character
+	static inline bool EndsRun(char32_t c) {
+		return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+	}
+
+	// Writes the glyph index of every character of the run to
+	// glyphIndices, and the extra advance after it to spacing, in FT
+	// units: kerning with the next glyph, or for a tab, its width.
+	void Shape(
+		FT_Face face,
+		const char32_t *text,
+		size_t length,
+		GLFontManager::Features features,
+		uint32_t *glyphIndices,
+		int16_t *spacing);
+
+	// Glyph index of a codepoint in a face, looked up in the face's
+	// charmap once. 0, the missing glyph, if the face doesn't have it.
+	uint32_t GlyphIndex(FT_Face face, char32_t point);
+
+	// Runs found in the cache, and runs shaped, for GLFontManager::Stats
+	uint64_t hits, misses;
+
+private:
+	static const uint32_t kAsciiSize = 128;
+	static const size_t kMaxCachedRun = 24;
+	static const size_t kCachedRuns = 4096; // Must be a power of two
+
+	static const size_t kLigatureCount = 5;
+
+	struct FaceInfo
+	{
+		FT_Face face;
+		bool kerning;
+		bool ligatures; // Has any of the ligature glyphs
+		int16_t tabWidth;
+		uint32_t ligatureGlyphs[kLigatureCount]; // 0 if missing
+		uint32_t ascii[kAsciiSize];
+		std::unordered_map<char32_t, uint32_t> points;
+	};
+
+	// The cache is direct-mapped, so a run replaces whatever run was in
+	// its slot. Empty slots have no face.
+	struct CachedRun
+	{
+		FT_Face face;
+		uint8_t features;
+		uint8_t length;
+		char32_t text[kMaxCachedRun];
+		uint32_t glyphIndices[kMaxCachedRun];
+		int16_t spacing[kMaxCachedRun];
+	};
+
+	std::deque<FaceInfo> faces;
+	FaceInfo *lastFace;
+	std::vector<CachedRun> runs;
+
+	FaceInfo * GetFaceInfo(FT_Face face);
+	uint32_t GlyphIndex(FaceInfo *info, char32_t point);
+	void ShapeUncached(
+		FaceInfo *info,
+		const char32_t *text,
+		size_t length,
+		GLFontManager::Features features,
+		uint32_t *glyphIndices,
+		int16_t *spacing);
+};
+
+#endif
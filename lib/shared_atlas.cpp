@@ -0,0 +1,423 @@
+#include "shared_atlas.hpp"
+#include "atlas.hpp"
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// A shared atlas file is laid out as follows (all values are native-endian):
+//
+//   SharedAtlasHeader
+//   SharedGlyphSlot[kSharedTableSize]
+//   Grid atlas pages, kSharedMaxAtlases of them
+//   Glyph data, kSharedGlyphDataCapacity pixels
+//
+// Each part is aligned to kSharedPageAlign. The file is created at its full
+// size, but it is sparse, so only the pages that are written take memory.
+//
+// kSharedVersion must be bumped whenever the layout of any of these structs,
+// the Glyph struct, or the contents of the atlases changes.
+static const char kSharedMagic[4] = {'G', 'L', 'L', 'S'};
+static const uint32_t kSharedVersion = 6;
+static const uint32_t kSharedByteOrder = 0x01020304;
+static const uint64_t kSharedPageAlign = 4096;
+static const uint32_t kSharedTableSize = 1 << 16; // Must be a power of two
+static const uint32_t kSharedMaxAtlases = 64;
+static const uint32_t kSharedGlyphDataCapacity = 8 * 1024 * 1024;
+static const size_t kSharedNameLen = 64;
+
+// Grid heights are rounded up to a multiple of kSharedShelfStep, and each
+// rounded height has its own shelf
+static const uint16_t kSharedShelfStep = 4;
+static const uint16_t kSharedShelfClasses = (kGridMaxSize + kSharedShelfStep - 1) / kSharedShelfStep;
+
+// How long to sleep between checks while another process prepares a glyph
+static const useconds_t kSharedWaitMicros = 1000;
+
+// The atomics are used by several processes, so they must not need a lock
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+	"Shared atlases need lock-free 32 and 64-bit atomics");
+
+enum SharedGlyphState : uint32_t
+{
+	kSharedEmpty = 0,
+	kSharedPreparing,
+	kSharedReady,
+	kSharedMissing
+};
+
+struct SharedAtlasHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint16_t gridAtlasSize;
+	uint8_t gridMaxSize;
+	uint8_t atlasChannels;
+	uint32_t glyphSize; // sizeof(GLFontManager::Glyph)
+	uint32_t tableSize;
+	uint32_t maxAtlases;
+	uint32_t glyphDataCapacity; // pixels
+	uint64_t tableOffset; // file offsets
+	uint64_t gridAtlasOffset;
+	uint64_t glyphDataOffset;
+
+	// Where the next grid of each shelf class goes, as packed by
+	// pack_shelf_cursor, and the first row not yet taken by any shelf:
+	// the row in the low 16 bits and the atlas layer in the high 16 bits
+	std::atomic<uint64_t> shelfCursors[kSharedShelfClasses];
+	std::atomic<uint32_t> nextShelfRow;
+	std::atomic<uint32_t> glyphDataSize; // pixels used
+};
+
+struct SharedGlyphSlot
+{
+	std::atomic<uint64_t> key; // FaceHash() << 32 | glyph index, 0 if empty
+	std::atomic<uint32_t> state; // SharedGlyphState
+	std::atomic<uint32_t> owner; // Process preparing the glyph
+	GLFontManager::Glyph glyph;
+	uint32_t dataPixels;
+};
+
+static uint64_t align_up(uint64_t offset, uint64_t align)
+{
+	return (offset + align - 1) / align * align;
+}
+
+// The x and y position of the next grid on a shelf, and the shelf's atlas
+// layer. Zero means the class has no shelf yet.
+static const uint64_t kShelfOpen = 1ull << 48;
+
+static uint64_t pack_shelf_cursor(uint16_t x, uint16_t y, uint16_t layer)
+{
+	return (uint64_t)x | (uint64_t)y << 16 | (uint64_t)layer << 32 | kShelfOpen;
+}
+
+// Lays out the file, filling in the header's sizes and offsets
+static uint64_t layout_shared_atlas(SharedAtlasHeader *header)
+{
+	memcpy(header->magic, kSharedMagic, sizeof(kSharedMagic));
+	header->version = kSharedVersion;
+	header->byteOrder = kSharedByteOrder;
+	header->gridAtlasSize = kGridAtlasSize;
+	header->gridMaxSize = kGridMaxSize;
+	header->atlasChannels = kAtlasChannels;
+	header->glyphSize = sizeof(GLFontManager::Glyph);
+	header->tableSize = kSharedTableSize;
+	header->maxAtlases = kSharedMaxAtlases;
+	header->glyphDataCapacity = kSharedGlyphDataCapacity;
+
+	header->tableOffset = align_up(sizeof(SharedAtlasHeader), kSharedPageAlign);
+	header->gridAtlasOffset = align_up(header->tableOffset
+		+ (uint64_t)kSharedTableSize * sizeof(SharedGlyphSlot), kSharedPageAlign);
+	header->glyphDataOffset = align_up(header->gridAtlasOffset
+		+ (uint64_t)kSharedMaxAtlases * kGridAtlasBytes, kSharedPageAlign);
+	return header->glyphDataOffset + (uint64_t)kSharedGlyphDataCapacity * kAtlasChannels;
+}
+
+static bool header_matches(const SharedAtlasHeader *header, size_t size)
+{
+	SharedAtlasHeader expected{};
+	uint64_t expectedSize = layout_shared_atlas(&expected);
+	return size == expectedSize
+		&& memcmp(header->magic, kSharedMagic, sizeof(kSharedMagic)) == 0
+		&& header->version == expected.version
+		&& header->byteOrder == expected.byteOrder
+		&& header->gridAtlasSize == expected.gridAtlasSize
+		&& header->gridMaxSize == expected.gridMaxSize
+		&& header->atlasChannels == expected.atlasChannels
+		&& header->glyphSize == expected.glyphSize
+		&& header->tableSize == expected.tableSize
+		&& header->maxAtlases == expected.maxAtlases
+		&& header->glyphDataCapacity == expected.glyphDataCapacity
+		&& header->tableOffset == expected.tableOffset
+		&& header->gridAtlasOffset == expected.gridAtlasOffset
+		&& header->glyphDataOffset == expected.glyphDataOffset;
+}
+
+SharedAtlas::SharedAtlas(void *mapping, size_t mappingSize)
+: mapping(mapping), mappingSize(mappingSize)
+{
+	this->header = (SharedAtlasHeader *)mapping;
+	this->slots = (SharedGlyphSlot *)((uint8_t *)mapping + this->header->tableOffset);
+}
+
+SharedAtlas::~SharedAtlas()
+{
+	munmap(this->mapping, this->mappingSize);
+}
+
+SharedAtlas * SharedAtlas::Open(std::string path)
+{
+	int fd = open(path.c_str(), O_RDWR | O_CREAT, 0666);
+	if (fd < 0) {
+		std::cerr << "Failed to open shared atlas " << path << "\n";
+		return nullptr;
+	}
+
+	// Whichever process gets the lock first on a new file sets it up. The
+	// lock is released if that process dies, in which case every process
+	// after it rejects the incomplete header.
+	struct stat st;
+	if (flock(fd, LOCK_EX) != 0 || fstat(fd, &st) != 0) {
+		close(fd);
+		return nullptr;
+	}
+
+	SharedAtlasHeader newHeader{};
+	uint64_t size = layout_shared_atlas(&newHeader);
+	bool created = st.st_size == 0;
+	if (created && ftruncate(fd, size) != 0) {
+		std::cerr << "Failed to create shared atlas " << path << "\n";
+		flock(fd, LOCK_UN);
+		close(fd);
+		return nullptr;
+	}
+	if (!created) {
+		size = st.st_size;
+	}
+
+	void *mapping = MAP_FAILED;
+	if (size >= sizeof(SharedAtlasHeader)) {
+		mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	if (mapping != MAP_FAILED && created) {
+		// The new file is all zeros, which is also the initial state of
+		// the atomics and the table
+		memcpy(mapping, &newHeader, offsetof(SharedAtlasHeader, shelfCursors));
+	}
+	flock(fd, LOCK_UN);
+	close(fd);
+
+	if (mapping == MAP_FAILED) {
+		std::cerr << "Failed to map shared atlas " << path << "\n";
+		return nullptr;
+	}
+	if (!header_matches((SharedAtlasHeader *)mapping, size)) {
+		std::cerr << "Invalid or outdated shared atlas " << path << "\n";
+		munmap(mapping, size);
+		return nullptr;
+	}
+	return new SharedAtlas(mapping, size);
+}
+
+// Faces are matched by family and style name, like in atlas caches. Hashed
+// with 32-bit FNV-1a.
+uint32_t SharedAtlas::FaceHash(FT_Face face)
+{
+	auto cached = this->faceHashes.find(face);
+	if (cached != this->faceHashes.end()) {
+		return cached->second;
+	}
+
+	uint32_t hash = 2166136261u;
+	const char *names[2] = {face->family_name, face->style_name};
+	for (const char *name : names) {
+		for (size_t i = 0; name && name[i] && i < kSharedNameLen; i++) {
+			hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+		}
+		hash = (hash ^ 0) * 16777619u;
+	}
+
+	// Keys of 0 mark empty slots
+	if (hash == 0) {
+		hash = 1;
+	}
+	this->faceHashes[face] = hash;
+	return hash;
+}
+
+SharedAtlas::Result SharedAtlas::Acquire(
+	FT_Face face,
+	uint32_t glyphIndex,
+	bool wait,
+	GLFontManager::Glyph *glyph,
+	uint32_t *dataPixels,
+	SharedGlyphSlot **slot)
+{
+	// Find the key's slot, or claim an empty one for it
+	uint64_t key = (uint64_t)this->FaceHash(face) << 32 | glyphIndex;
+	uint32_t mask = kSharedTableSize - 1;
+	uint32_t i = (key * 0x9E3779B97F4A7C15ull) >> 48 & mask;
+	SharedGlyphSlot *found = nullptr;
+	for (uint32_t probes = 0; probes < kSharedTableSize; probes++, i = (i + 1) & mask) {
+		uint64_t slotKey = this->slots[i].key.load(std::memory_order_acquire);
+		if (slotKey == 0) {
+			this->slots[i].key.compare_exchange_strong(slotKey, key);
+			if (slotKey == 0) {
+				slotKey = key;
+			}
+		}
+		if (slotKey == key) {
+			found = &this->slots[i];
+			break;
+		}
+	}
+
+	*slot = found;
+	if (!found) {
+		return Result::Claimed;
+	}
+
+	uint32_t self = getpid();
+	for (;;) {
+		uint32_t state = found->state.load(std::memory_order_acquire);
+		if (state == kSharedReady) {
+			*glyph = found->glyph;
+			*dataPixels = found->dataPixels;
+			return Result::Ready;
+		}
+		if (state == kSharedMissing) {
+			return Result::Missing;
+		}
+		if (state == kSharedEmpty) {
+			if (found->state.compare_exchange_strong(state, kSharedPreparing)) {
+				found->owner.store(self);
+				return Result::Claimed;
+			}
+			continue;
+		}
+
+		// Take over from a process that died while preparing the glyph.
+		// The owner is 0 for a moment after the state is claimed.
+		uint32_t owner = found->owner.load();
+		if (owner != 0 && (owner == self || (kill(owner, 0) != 0 && errno == ESRCH))) {
+			if (found->owner.compare_exchange_strong(owner, self)) {
+				return Result::Claimed;
+			}
+			continue;
+		}
+
+		if (!wait) {
+			return Result::Pending;
+		}
+		usleep(kSharedWaitMicros);
+	}
+}
+
+void SharedAtlas::Publish(
+	SharedGlyphSlot *slot,
+	const GLFontManager::Glyph *glyph,
+	uint32_t dataPixels)
+{
+	if (!slot) {
+		return;
+	}
+
+	if (glyph) {
+		slot->glyph = *glyph;
+		slot->glyph.pending = false;
+		slot->dataPixels = dataPixels;
+	}
+	slot->state.store(glyph ? kSharedReady : kSharedMissing, std::memory_order_release);
+}
+
+// Takes the next `height` rows of the atlases for a new shelf.
+static bool take_shelf_rows(SharedAtlasHeader *header, uint16_t height, uint16_t *y, uint16_t *layer)
+{
+	uint32_t row = header->nextShelfRow.load();
+	uint32_t next;
+	do {
+		*y = row & 0xFFFF;
+		*layer = row >> 16;
+		if (*y + height > kGridAtlasSize) {
+			*y = 0;
+			(*layer)++;
+		}
+		if (*layer >= kSharedMaxAtlases) {
+			return false;
+		}
+		next = (uint32_t)(*y + height) | (uint32_t)*layer << 16;
+	} while (!header->nextShelfRow.compare_exchange_weak(row, next));
+	return true;
+}
+
+// Grids are packed left to right in shelves, with a shelf open for each
+// class of heights. A skyline would pack tighter, but couldn't be updated
+// atomically.
+bool SharedAtlas::PackGrid(uint16_t width, uint16_t height, uint16_t *layer, uint16_t pos[2])
+{
+	uint16_t shelfClass = (height + kSharedShelfStep - 1) / kSharedShelfStep - 1;
+	std::atomic<uint64_t> &shelf = this->header->shelfCursors[shelfClass];
+	uint64_t cursor = shelf.load();
+	for (;;) {
+		uint16_t x = cursor;
+		uint16_t y = cursor >> 16;
+		uint16_t shelfLayer = cursor >> 32;
+		if ((cursor & kShelfOpen) && x + width <= kGridAtlasSize) {
+			if (shelf.compare_exchange_weak(cursor, pack_shelf_cursor(x + width, y, shelfLayer))) {
+				pos[0] = x;
+				pos[1] = y;
+				*layer = shelfLayer;
+				return true;
+			}
+			continue;
+		}
+
+		// Start a new shelf with this grid. If another process starts one
+		// first, the rows taken here are left unused, but that is rare.
+		if (!take_shelf_rows(this->header, (shelfClass + 1) * kSharedShelfStep, &y, &shelfLayer)) {
+			return false;
+		}
+		if (shelf.compare_exchange_strong(cursor, pack_shelf_cursor(width, y, shelfLayer))) {
+			pos[0] = 0;
+			pos[1] = y;
+			*layer = shelfLayer;
+			return true;
+		}
+	}
+}
+
+bool SharedAtlas::ReserveGlyphData(uint32_t pixels, uint32_t *offset)
+{
+	uint32_t size = this->header->glyphDataSize.load();
+	do {
+		if ((uint64_t)size + pixels > kSharedGlyphDataCapacity) {
+			return false;
+		}
+	} while (!this->header->glyphDataSize.compare_exchange_weak(size, size + pixels));
+
+	*offset = size;
+	return true;
+}
+
+uint16_t * SharedAtlas::GridAtlas(uint16_t layer)
+{
+	uint8_t *base = (uint8_t *)this->mapping + this->header->gridAtlasOffset;
+	return (uint16_t *)(base + (size_t)layer * kGridAtlasBytes);
+}
+
+uint8_t * SharedAtlas::GlyphData()
+{
+	return (uint8_t *)this->mapping + this->header->glyphDataOffset;
+}
+
+uint32_t SharedAtlas::GlyphDataCapacity()
+{
+	return kSharedGlyphDataCapacity;
+}
+
+bool GLFontManager::UseSharedAtlas(std::string path)
+{
+	if (this->atlases.size() > 0 || this->cacheMapping || this->shared) {
+		std::cerr << "Shared atlas must be set up before any glyphs\n";
+		return false;
+	}
+
+	SharedAtlas *shared = SharedAtlas::Open(path);
+	if (!shared) {
+		return false;
+	}
+
+	this->shared.reset(shared);
+	this->glyphData = shared->GlyphData();
+	this->glyphDataSize = 0;
+	this->glyphDataCapacity = 0;
+	return true;
+}
@@ -0,0 +1,85 @@
+#ifndef SHARED_ATLAS_H
+#define SHARED_ATLAS_H
+
+#include <gllabel.hpp>
+#include <map>
+#include <string>
+
+struct SharedAtlasHeader;
+struct SharedGlyphSlot;
+
+// Grid atlas pages, glyph data, and a glyph table in a file that several
+// processes map at once (see GLFontManager::UseSharedAtlas). Nothing is ever
+// removed or moved, so space is claimed with atomic operations alone:
+//
+// - Grids are packed in shelves. The position of the next grid on each
+//   shelf, and the first row that no shelf has taken, are single words
+//   that are advanced with compare-and-swap.
+// - Glyph data is claimed by atomically adding to its used size.
+// - Table slots are claimed by compare-and-swap of their key. A glyph's
+//   state goes from empty, to being prepared by one process, to ready (or
+//   missing, if it has no outline). Its grid, data, and Glyph struct are
+//   written before the ready state is stored with release ordering, and
+//   readers load the state with acquire ordering before reading them.
+//
+// A process that dies while preparing a glyph leaves it in the preparing
+// state, so other processes take it over once they see the process is gone.
+// All processes must be in the same PID namespace.
+class SharedAtlas
+{
+public:
+	enum class Result
+	{
+		Ready, // The glyph was prepared by some process
+		Missing, // The glyph couldn't be loaded by some process
+		Pending, // Another process is preparing the glyph
+		Claimed // The caller must prepare the glyph, then call Publish
+	};
+
+	// Maps the shared atlas at path, creating it if it doesn't exist.
+	// Returns nullptr on failure.
+	static SharedAtlas * Open(std::string path);
+	~SharedAtlas();
+
+	// Looks up a glyph, by glyph index, in the table. If `wait` is true,
+	// waits for other processes to finish preparing it instead of returning
+	// Pending. Ready glyphs are copied to *glyph, along with the number of
+	// glyph data pixels they use. If the result is Claimed, *slot must be
+	// passed to Publish. It is nullptr if the table is full, in which case
+	// the glyph is not shared.
+	Result Acquire(
+		FT_Face face,
+		uint32_t glyphIndex,
+		bool wait,
+		GLFontManager::Glyph *glyph,
+		uint32_t *dataPixels,
+		SharedGlyphSlot **slot);
+
+	// Makes a claimed glyph available to every process, or marks it as
+	// missing if glyph is nullptr. Does nothing if slot is nullptr.
+	void Publish(
+		SharedGlyphSlot *slot,
+		const GLFontManager::Glyph *glyph,
+		uint32_t dataPixels);
+
+	// Claim space for a grid or for glyph data. Return false when the
+	// shared atlas is full.
+	bool PackGrid(uint16_t width, uint16_t height, uint16_t *layer, uint16_t pos[2]);
+	bool ReserveGlyphData(uint32_t pixels, uint32_t *offset);
+
+	uint16_t * GridAtlas(uint16_t layer);
+	uint8_t * GlyphData();
+	uint32_t GlyphDataCapacity();
+
+private:
+	void *mapping;
+	size_t mappingSize;
+	SharedAtlasHeader *header;
+	SharedGlyphSlot *slots;
+	std::map<FT_Face, uint32_t> faceHashes;
+
+	SharedAtlas(void *mapping, size_t mappingSize);
+	uint32_t FaceHash(FT_Face face);
+};
+
+#endif
@@ -0,0 +1,101 @@
+#include "stream_buffer.hpp"
+#include <algorithm>
+
+// Segments start with room for this many bytes, and double when they run out
+static const size_t kInitialSegmentSize = 4096;
+
+static const GLbitfield kPersistentFlags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+StreamBuffer::StreamBuffer()
+: buffer(0), persistent(false), mapped(nullptr), segmentSize(0), segment(0), fences{}
+{
+}
+
+StreamBuffer::~StreamBuffer()
+{
+	this->Release();
+}
+
+void StreamBuffer::Release()
+{
+	for (GLsync &fence : this->fences) {
+		if (fence) {
+			glDeleteSync(fence);
+			fence = nullptr;
+		}
+	}
+	if (this->buffer) {
+		if (this->mapped) {
+			glBindBuffer(GL_ARRAY_BUFFER, this->buffer);
+			glUnmapBuffer(GL_ARRAY_BUFFER);
+			this->mapped = nullptr;
+		}
+		glDeleteBuffers(1, &this->buffer);
+		this->buffer = 0;
+	}
+}
+
+// Replaces the buffer with one whose segments fit `bytes`. The GPU keeps the
+// old buffer alive until it's done drawing from it.
+void StreamBuffer::Allocate(size_t bytes)
+{
+	this->Release();
+
+	size_t size = std::max(kInitialSegmentSize, this->segmentSize * 2);
+	while (size < bytes) {
+		size *= 2;
+	}
+	this->segmentSize = size;
+	this->segment = 0;
+
+	glGenBuffers(1, &this->buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, this->buffer);
+	this->persistent = GLEW_ARB_buffer_storage;
+	if (this->persistent) {
+		glBufferStorage(GL_ARRAY_BUFFER, size * kSegments, NULL, kPersistentFlags);
+		this->mapped = glMapBufferRange(GL_ARRAY_BUFFER, 0, size * kSegments, kPersistentFlags);
+		this->persistent = this->mapped != nullptr;
+	} else {
+		glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+	}
+}
+
+void * StreamBuffer::Begin(size_t bytes)
+{
+	if (!this->buffer || bytes > this->segmentSize) {
+		this->Allocate(bytes);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, this->buffer);
+
+	if (!this->persistent) {
+		// Invalidating orphans the buffer, so this never waits for the GPU
+		return glMapBufferRange(GL_ARRAY_BUFFER, 0, std::max(bytes, (size_t)1),
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	}
+
+	this->segment = (this->segment + 1) % kSegments;
+	GLsync &fence = this->fences[this->segment];
+	if (fence) {
+		GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+		while (glClientWaitSync(fence, flags, 1000000000) == GL_TIMEOUT_EXPIRED) {
+			flags = 0;
+		}
+		glDeleteSync(fence);
+		fence = nullptr;
+	}
+	return (char *)this->mapped + this->Offset();
+}
+
+void StreamBuffer::End()
+{
+	if (!this->persistent) {
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+	}
+}
+
+void StreamBuffer::Fence()
+{
+	if (this->persistent) {
+		this->fences[this->segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+}
@@ -0,0 +1,47 @@
+#ifndef STREAM_BUFFER_H
+#define STREAM_BUFFER_H
+
+#include <glew.h>
+#include <stddef.h>
+
+// A vertex buffer for data that is rewritten every frame. It is split into
+// kSegments segments, and each frame is written into the next one, so the
+// CPU writes one segment while the GPU may still be reading the others.
+// With ARB_buffer_storage, the buffer is mapped once, persistently, and a
+// fence after each frame's draws tells when its segment can be reused.
+// Otherwise, the buffer is orphaned and mapped again every frame.
+class StreamBuffer
+{
+public:
+	static const unsigned kSegments = 3;
+
+	StreamBuffer();
+	~StreamBuffer();
+
+	// Returns somewhere to write `bytes` bytes for this frame, growing
+	// the buffer if needed. Waits if the GPU is still reading the
+	// segment. Must be followed by End before the buffer is drawn.
+	void * Begin(size_t bytes);
+
+	// Finishes writing. The frame's data starts at Offset() in Buffer().
+	void End();
+
+	// Must be called after the draws that read the frame's data.
+	void Fence();
+
+	inline GLuint Buffer() { return buffer; }
+	inline size_t Offset() { return segment * segmentSize; }
+
+private:
+	GLuint buffer;
+	bool persistent;
+	void *mapped; // The whole buffer, if persistent
+	size_t segmentSize; // bytes
+	unsigned segment;
+	GLsync fences[kSegments];
+
+	void Allocate(size_t bytes);
+	void Release();
+};
+
+#endif
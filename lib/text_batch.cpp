@@ -0,0 +1,160 @@
+#include <gllabel.hpp>
+#include <algorithm>
+#include <glm/gtc/matrix_transform.hpp>
+
+GLTextBatch::GLTextBatch()
+: capacity(0)
+{
+	this->manager = GLFontManager::GetFontManager();
+
+	glGenBuffers(1, &this->instanceBuffer);
+	glGenBuffers(1, &this->transformIndexBuffer);
+	glGenBuffers(1, &this->transformsBuffer);
+	glGenTextures(1, &this->transformsTexId);
+
+	glGenVertexArrays(1, &this->vertexArray);
+	this->manager->BindVertexArray(this->vertexArray);
+	GLLabel::SetInstanceAttribs(this->instanceBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, this->transformIndexBuffer);
+	glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, sizeof(uint32_t), (void*)0);
+	glEnableVertexAttribArray(3);
+	glVertexAttribDivisor(3, 1);
+}
+
+GLTextBatch::~GLTextBatch()
+{
+	glDeleteBuffers(1, &this->instanceBuffer);
+	glDeleteBuffers(1, &this->transformIndexBuffer);
+	glDeleteBuffers(1, &this->transformsBuffer);
+	glDeleteTextures(1, &this->transformsTexId);
+	this->manager->DeleteVertexArray(&this->vertexArray);
+}
+
+void GLTextBatch::Add(GLLabel *label, glm::mat4 transform)
+{
+	this->labels.push_back(std::make_pair(label, transform));
+}
+
+void GLTextBatch::Render(float time, glm::mat4 transform)
+{
+	// Carets load their glyph, so they must be made before uploading.
+	// Their positions are relative to the label, so each label with a
+	// caret also gets a transform without any block origin. Until the
+	// blocks' transforms are added, caretTransforms holds label indices.
+	this->carets.clear();
+	this->caretTransforms.clear();
+	for (size_t i = 0; i < this->labels.size(); i++) {
+		glm::vec2 offset;
+		GLLabel *label = this->labels[i].first;
+		if (label->UpdateCaret(time, &offset)) {
+			GLLabel::GlyphInstance caret = label->caretInstance;
+			caret.pos += offset;
+			this->carets.push_back(caret);
+			this->caretTransforms.push_back(i);
+		}
+	}
+
+	this->manager->UseGlyphShader(this->quality);
+	this->manager->UploadAtlases();
+
+	size_t total = 0;
+	for (auto &label : this->labels) {
+		label.first->RefreshPendingGlyphs();
+		for (const GLLabel::Block &block : label.first->blocks) {
+			if (block.instances.empty()) {
+				continue;
+			}
+			Entry entry{&block, block.version, (uint32_t)this->transforms.size(), total};
+			this->entries.push_back(entry);
+			this->transforms.push_back(glm::translate(label.second, glm::vec3(block.origin.x, block.origin.y, 0)));
+			total += block.instances.size();
+		}
+	}
+	size_t blockInstances = total;
+	total += this->carets.size();
+
+	// Caret transforms go after the blocks', so that blinking doesn't move
+	// the blocks' transforms and make them upload again
+	for (uint32_t &caretTransform : this->caretTransforms) {
+		uint32_t label = caretTransform;
+		caretTransform = this->transforms.size();
+		this->transforms.push_back(this->labels[label].second);
+	}
+	uint64_t bytes = 0;
+
+	// Growing the buffers loses their contents, so re-upload everything
+	if (total > this->capacity) {
+		this->capacity = std::max(total, this->capacity * 2);
+		glBindBuffer(GL_ARRAY_BUFFER, this->instanceBuffer);
+		glBufferData(GL_ARRAY_BUFFER, this->capacity * sizeof(GLLabel::GlyphInstance), NULL, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, this->transformIndexBuffer);
+		glBufferData(GL_ARRAY_BUFFER, this->capacity * sizeof(uint32_t), NULL, GL_DYNAMIC_DRAW);
+		this->prevEntries.clear();
+	}
+
+	for (size_t i = 0; i < this->entries.size(); i++) {
+		Entry &entry = this->entries[i];
+		if (i < this->prevEntries.size()
+			&& this->prevEntries[i].version == entry.version
+			&& this->prevEntries[i].transform == entry.transform
+			&& this->prevEntries[i].first == entry.first) {
+			continue;
+		}
+
+		const std::vector<GLLabel::GlyphInstance> &instances = entry.block->instances;
+		glBindBuffer(GL_ARRAY_BUFFER, this->instanceBuffer);
+		glBufferSubData(GL_ARRAY_BUFFER,
+			entry.first * sizeof(GLLabel::GlyphInstance),
+			instances.size() * sizeof(GLLabel::GlyphInstance),
+			&instances[0]);
+
+		this->transformIndices.assign(instances.size(), entry.transform);
+		glBindBuffer(GL_ARRAY_BUFFER, this->transformIndexBuffer);
+		glBufferSubData(GL_ARRAY_BUFFER,
+			entry.first * sizeof(uint32_t),
+			instances.size() * sizeof(uint32_t),
+			&this->transformIndices[0]);
+		bytes += instances.size() * (sizeof(GLLabel::GlyphInstance) + sizeof(uint32_t));
+	}
+
+	if (this->carets.size() > 0) {
+		glBindBuffer(GL_ARRAY_BUFFER, this->instanceBuffer);
+		glBufferSubData(GL_ARRAY_BUFFER,
+			blockInstances * sizeof(GLLabel::GlyphInstance),
+			this->carets.size() * sizeof(GLLabel::GlyphInstance),
+			&this->carets[0]);
+		glBindBuffer(GL_ARRAY_BUFFER, this->transformIndexBuffer);
+		glBufferSubData(GL_ARRAY_BUFFER,
+			blockInstances * sizeof(uint32_t),
+			this->caretTransforms.size() * sizeof(uint32_t),
+			&this->caretTransforms[0]);
+		bytes += this->carets.size() * (sizeof(GLLabel::GlyphInstance) + sizeof(uint32_t));
+	}
+
+	if (total > 0) {
+		// Each mat4 is four RGBA32F texels, one per column
+		glBindBuffer(GL_TEXTURE_BUFFER, this->transformsBuffer);
+		glBufferData(GL_TEXTURE_BUFFER, this->transforms.size() * sizeof(glm::mat4), &this->transforms[0], GL_STREAM_DRAW);
+		this->manager->BindTexture(2, GL_TEXTURE_BUFFER, this->transformsTexId);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, this->transformsBuffer);
+		bytes += this->transforms.size() * sizeof(glm::mat4);
+
+		this->manager->UseAtlasTextures();
+		this->manager->SetShaderTransform(transform);
+		this->manager->UseBatchTransforms(this->transformsTexId);
+
+		this->manager->BeginGPUTimer();
+		this->manager->EnableBlend();
+		this->manager->BindVertexArray(this->vertexArray);
+		glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0,
+			GLFontManager::GetGlyphVertexCount(this->quality), total);
+		this->manager->EndGPUTimer();
+		this->manager->UseBatchTransforms(0);
+	}
+	this->manager->stats.labelBytesUploaded += bytes;
+
+	this->prevEntries.swap(this->entries);
+	this->entries.clear();
+	this->labels.clear();
+	this->transforms.clear();
+}
@@ -1,6 +1,56 @@
 #include <cmath>
 #include "types.hpp"
 
+// Several lines can be intersected with a curve at once, four at a time, on
+// SSE2 (any x86-64) and AArch64 NEON. Only operations that are exactly
+// rounded are used, in the same order as the scalar code, so that the
+// results are bit-identical unless the compiler contracts the scalar code
+// into fused multiply-adds.
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_FLOAT4 1
+
+typedef __m128 float4;
+static inline float4 f4_set(float v) { return _mm_set1_ps(v); }
+static inline float4 f4_load(const float *p) { return _mm_loadu_ps(p); }
+static inline void f4_store(float *p, float4 v) { _mm_storeu_ps(p, v); }
+static inline float4 f4_add(float4 a, float4 b) { return _mm_add_ps(a, b); }
+static inline float4 f4_sub(float4 a, float4 b) { return _mm_sub_ps(a, b); }
+static inline float4 f4_mul(float4 a, float4 b) { return _mm_mul_ps(a, b); }
+static inline float4 f4_div(float4 a, float4 b) { return _mm_div_ps(a, b); }
+static inline float4 f4_sqrt(float4 v) { return _mm_sqrt_ps(v); }
+
+// Bit i is set if lane i is in [0,1], which is never true for NaN
+static inline int f4_in_unit(float4 t)
+{
+	return _mm_movemask_ps(_mm_and_ps(
+		_mm_cmple_ps(t, _mm_set1_ps(1)),
+		_mm_cmpge_ps(t, _mm_setzero_ps())));
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_FLOAT4 1
+
+typedef float32x4_t float4;
+static inline float4 f4_set(float v) { return vdupq_n_f32(v); }
+static inline float4 f4_load(const float *p) { return vld1q_f32(p); }
+static inline void f4_store(float *p, float4 v) { vst1q_f32(p, v); }
+static inline float4 f4_add(float4 a, float4 b) { return vaddq_f32(a, b); }
+static inline float4 f4_sub(float4 a, float4 b) { return vsubq_f32(a, b); }
+static inline float4 f4_mul(float4 a, float4 b) { return vmulq_f32(a, b); }
+static inline float4 f4_div(float4 a, float4 b) { return vdivq_f32(a, b); }
+static inline float4 f4_sqrt(float4 v) { return vsqrtq_f32(v); }
+
+static inline int f4_in_unit(float4 t)
+{
+	static const uint32_t kLaneBits[4] = {1, 2, 4, 8};
+	uint32x4_t valid = vandq_u32(
+		vcleq_f32(t, vdupq_n_f32(1)),
+		vcgeq_f32(t, vdupq_n_f32(0)));
+	return vaddvq_u32(vandq_u32(valid, vld1q_u32(kLaneBits)));
+}
+#endif
+
 inline bool almostEqual(float a, float b)
 {
 	return std::fabs(a-b) < 1e-5;
@@ -20,7 +70,7 @@ inline bool almostEqual(float a, float b)
  * t = (A - B [+-] sqrt(y*a + B^2 - A*C))/a , where  a = A - 2B + C.
  * http://www.wolframalpha.com/input/?i=y+%3D+(1-t)%5E2a+%2B+2t(1-t)*b+%2B+t%5E2*c+solve+for+t
  */
-int Bezier2::IntersectHorz(float Y, float outX[2])
+int Bezier2::IntersectHorz(float Y, float outX[2]) const
 {
 	Vec2 A = this->e0;
 	Vec2 B = this->c;
@@ -64,7 +114,7 @@ int Bezier2::IntersectHorz(float Y, float outX[2])
  * Same as IntersectHorz, except finds the y values of an intersection
  * with the vertical line x=X.
  */
-int Bezier2::IntersectVert(float X, float outY[2])
+int Bezier2::IntersectVert(float X, float outY[2]) const
 {
 	Bezier2 inverse = {
 		{ this->e0.y, this->e0.x },
@@ -74,3 +124,73 @@ int Bezier2::IntersectVert(float X, float outY[2])
 	return inverse.IntersectHorz(X, outY);
 }
 
+#ifdef HAVE_FLOAT4
+// X_FROM_T of IntersectHorz, for four values of t
+static inline float4 f4_x_from_t(float4 t, float Ax, float Bx, float Cx)
+{
+	float4 mt = f4_sub(f4_set(1), t);
+	float4 x = f4_mul(f4_mul(mt, mt), f4_set(Ax));
+	x = f4_add(x, f4_mul(f4_mul(f4_mul(f4_set(2), t), mt), f4_set(Bx)));
+	return f4_add(x, f4_mul(f4_mul(t, t), f4_set(Cx)));
+}
+#endif
+
+void Bezier2::IntersectHorzLines(const float *Y, int count, float *outX, int *numInt) const
+{
+	int i = 0;
+
+#ifdef HAVE_FLOAT4
+	Vec2 A = this->e0;
+	Vec2 B = this->c;
+	Vec2 C = this->e1;
+
+	// The curve is the same for every line, so either all lines or none
+	// need the a=0 case, which is left to IntersectHorz.
+	float a = A.y - 2*B.y + C.y;
+	if (!almostEqual(a, 0)) {
+		float4 va = f4_set(a);
+		float4 BB = f4_set(B.y*B.y);
+		float4 AC = f4_set(A.y*C.y);
+		float4 AminusB = f4_set(A.y - B.y);
+
+		for (; i + 4 <= count; i += 4) {
+			float4 Yi = f4_load(Y + i);
+			float4 sqrtTerm = f4_sqrt(f4_sub(f4_add(f4_mul(Yi, va), BB), AC));
+			float4 t0 = f4_div(f4_add(AminusB, sqrtTerm), va);
+			float4 t1 = f4_div(f4_sub(AminusB, sqrtTerm), va);
+
+			int valid0 = f4_in_unit(t0);
+			int valid1 = f4_in_unit(t1);
+			float x0[4], x1[4];
+			f4_store(x0, f4_x_from_t(t0, A.x, B.x, C.x));
+			f4_store(x1, f4_x_from_t(t1, A.x, B.x, C.x));
+
+			for (int lane = 0; lane < 4; lane++) {
+				float *out = &outX[2*(i + lane)];
+				int n = 0;
+				if (valid0 & (1 << lane)) {
+					out[n++] = x0[lane];
+				}
+				if (valid1 & (1 << lane)) {
+					out[n++] = x1[lane];
+				}
+				numInt[i + lane] = n;
+			}
+		}
+	}
+#endif
+
+	for (; i < count; i++) {
+		numInt[i] = this->IntersectHorz(Y[i], &outX[2*i]);
+	}
+}
+
+void Bezier2::IntersectVertLines(const float *X, int count, float *outY, int *numInt) const
+{
+	Bezier2 inverse = {
+		{ this->e0.y, this->e0.x },
+		{ this->e1.y, this->e1.x },
+		{ this->c.y, this->c.x }
+	};
+	inverse.IntersectHorzLines(X, count, outY, numInt);
+}
@@ -23,8 +23,14 @@ struct Bezier2 {
 	Vec2 e1;
 	Vec2 c; // control point
 
-	int IntersectHorz(float y, float outX[2]);
-	int IntersectVert(float x, float outY[2]);
+	int IntersectHorz(float y, float outX[2]) const;
+	int IntersectVert(float x, float outY[2]) const;
+
+	// Intersects the curve with every line y=Y[i] for i < count, as if by
+	// numInt[i] = IntersectHorz(Y[i], &outX[2*i]), but intersecting
+	// several lines at once with SIMD where available.
+	void IntersectHorzLines(const float *Y, int count, float *outX, int *numInt) const;
+	void IntersectVertLines(const float *X, int count, float *outY, int *numInt) const;
 };
 
 #endif
@@ -1,6 +1,6 @@
 #include "vgrid.hpp"
-#include <iostream>
 #include <cmath>
+#include <algorithm>
 #include <assert.h>
 
 // Converts X,Y to index in a row-major 2D array
@@ -13,33 +13,119 @@ constexpr const T& clamp(const T &v, const T &min, const T &max) {
 	return std::max(std::min(v, max), min);
 }
 
-// Returns a list of the beziers that intersect each grid cell.
-// The returned outer vector is always size gridWidth*gridHeight.
-static std::vector<std::set<size_t>> find_cells_intersections(
+// A piece of a bezier over which y only increases or only decreases, so that
+// it crosses each horizontal line at most once. Crossings are counted for
+// lines where yMin <= y < yMax, which counts each crossing of a closed
+// contour exactly once, even through the shared end point of two pieces.
+struct VGridMonoCurve {
+	float yMin, yMax;
+	float tStart, tEnd;
+	int dir; // +1 if y increases along the curve, -1 otherwise
+	int firstRow, endRow; // row midlines crossed, end exclusive
+	uint32_t bezier;
+};
+
+// Scratch space used while building grids. Kept per thread and reused so
+// that building a grid doesn't allocate once the buffers have grown.
+struct VGridScratch {
+	// (cell, bezier) pairs, in order of increasing bezier index
+	std::vector<uint32_t> pairCells;
+	std::vector<uint32_t> pairBeziers;
+
+	// Last bezier index added to each cell, to skip duplicate pairs
+	std::vector<int64_t> lastBezier;
+
+	// Positions of the vertical and horizontal grid lines (or midlines)
+	// being intersected, and the intersections of one curve with each line
+	// (two floats per line)
+	std::vector<float> vertLines;
+	std::vector<float> horzLines;
+	std::vector<float> lineIntersections;
+	std::vector<int> lineIntersectionCounts;
+
+	// Edge table of the y-monotone pieces of the curves, sorted by the
+	// first row midline they cross, and the pieces crossing the current row
+	std::vector<VGridMonoCurve> monoCurves;
+	std::vector<VGridMonoCurve> sortedMonoCurves;
+	std::vector<uint32_t> rowOffsets;
+	std::vector<uint32_t> activeCurves;
+
+	// Midline crossings of the current row, and their winding directions
+	std::vector<std::pair<float, int>> crossings;
+
+	// Coverage of each texel of the coverage map, before scaling to bytes
+	std::vector<float> coverageSums;
+};
+
+// Each function binds this to a local reference once, since every access
+// to a thread_local goes through a call to its TLS wrapper.
+static thread_local VGridScratch threadScratch;
+
+// Intersects a curve with every line in scratch.vertLines if `vertical` is
+// true, or in scratch.horzLines otherwise.
+static void intersect_lines(VGridScratch &scratch,
+	const Bezier2 &bezier, bool vertical)
+{
+	const std::vector<float> &lines = vertical
+		? scratch.vertLines
+		: scratch.horzLines;
+	size_t count = lines.size();
+	scratch.lineIntersections.resize(count * 2);
+	scratch.lineIntersectionCounts.resize(count);
+	if (vertical) {
+		bezier.IntersectVertLines(lines.data(), count,
+			scratch.lineIntersections.data(),
+			scratch.lineIntersectionCounts.data());
+	} else {
+		bezier.IntersectHorzLines(lines.data(), count,
+			scratch.lineIntersections.data(),
+			scratch.lineIntersectionCounts.data());
+	}
+}
+
+// Finds the beziers that intersect each grid cell and stores them in
+// grid.cellOffsets and grid.cellBeziers.
+static void find_cells_intersections(
+	VGrid &grid,
 	std::vector<Bezier2> &beziers,
 	Vec2 glyphSize,
 	int gridWidth,
 	int gridHeight)
 {
-	std::vector<std::set<size_t>> cellBeziers;
-	cellBeziers.resize(gridWidth * gridHeight);
+	VGridScratch &scratch = threadScratch;
+	size_t numCells = gridWidth * gridHeight;
+	scratch.pairCells.clear();
+	scratch.pairBeziers.clear();
+	scratch.lastBezier.assign(numCells, -1);
+
+	scratch.vertLines.resize(gridWidth + 1);
+	for (int x = 0; x <= gridWidth; x++) {
+		scratch.vertLines[x] = x * glyphSize.w / gridWidth;
+	}
+	scratch.horzLines.resize(gridHeight + 1);
+	for (int y = 0; y <= gridHeight; y++) {
+		scratch.horzLines[y] = y * glyphSize.h / gridHeight;
+	}
 
 	auto setgrid = [&](int x, int y, size_t bezierIndex) {
 		x = clamp(x, 0, gridWidth - 1);
 		y = clamp(y, 0, gridHeight - 1);
-		cellBeziers[(y * gridWidth) + x].insert(bezierIndex);
+		size_t cellIdx = xy2i(x, y, gridWidth);
+		if (scratch.lastBezier[cellIdx] != (int64_t)bezierIndex) {
+			scratch.lastBezier[cellIdx] = bezierIndex;
+			scratch.pairCells.push_back(cellIdx);
+			scratch.pairBeziers.push_back(bezierIndex);
+		}
 	};
 
 	for (size_t i = 0; i < beziers.size(); i++) {
 		bool anyIntersections = false;
 
 		// Every vertical grid line including edges
+		intersect_lines(scratch, beziers[i], true);
 		for (int x = 0; x <= gridWidth; x++) {
-			float intY[2];
-			int numInt = beziers[i].IntersectVert(
-				x * glyphSize.w / gridWidth,
-				intY);
-			for (int j = 0; j < numInt; j++) {
+			const float *intY = &scratch.lineIntersections[x * 2];
+			for (int j = 0; j < scratch.lineIntersectionCounts[x]; j++) {
 				int y = intY[j] * gridHeight / glyphSize.h;
 				setgrid(x,     y, i); // right
 				setgrid(x - 1, y, i); // left
@@ -48,12 +134,10 @@ static std::vector<std::set<size_t>> find_cells_intersections(
 		}
 
 		// Every horizontal grid line including edges
+		intersect_lines(scratch, beziers[i], false);
 		for (int y = 0; y <= gridHeight; y++) {
-			float intX[2];
-			int numInt = beziers[i].IntersectHorz(
-				y * glyphSize.h / gridHeight,
-				intX);
-			for (int j = 0; j < numInt; j++) {
+			const float *intX = &scratch.lineIntersections[y * 2];
+			for (int j = 0; j < scratch.lineIntersectionCounts[y]; j++) {
 				int x = intX[j] * gridWidth / glyphSize.w;
 				setgrid(x, y,      i); // up
 				setgrid(x, y - 1 , i); // down
@@ -70,63 +154,244 @@ static std::vector<std::set<size_t>> find_cells_intersections(
 		}
 	}
 
-	return cellBeziers;
+	// Counting sort the pairs by cell. The sort is stable, so the beziers
+	// of each cell stay sorted by index.
+	grid.cellOffsets.assign(numCells + 1, 0);
+	for (uint32_t cellIdx : scratch.pairCells) {
+		grid.cellOffsets[cellIdx + 1]++;
+	}
+	for (size_t i = 0; i < numCells; i++) {
+		grid.cellOffsets[i + 1] += grid.cellOffsets[i];
+	}
+
+	// lastBezier is no longer needed, so reuse it as the fill cursor
+	for (size_t i = 0; i < numCells; i++) {
+		scratch.lastBezier[i] = grid.cellOffsets[i];
+	}
+	grid.cellBeziers.resize(scratch.pairCells.size());
+	for (size_t i = 0; i < scratch.pairCells.size(); i++) {
+		size_t cellIdx = scratch.pairCells[i];
+		grid.cellBeziers[scratch.lastBezier[cellIdx]++] = scratch.pairBeziers[i];
+	}
+}
+
+static bool almost_zero(float v)
+{
+	return std::fabs(v) < 1e-5;
+}
+
+static float x_at(const Bezier2 &b, float t)
+{
+	return (1-t)*(1-t)*b.e0.x + 2*t*(1-t)*b.c.x + t*t*b.e1.x;
+}
+
+static float y_at(const Bezier2 &b, float t)
+{
+	return (1-t)*(1-t)*b.e0.y + 2*t*(1-t)*b.c.y + t*t*b.e1.y;
+}
+
+// Distance from t to the range [start, end]
+static float range_distance(float t, float start, float end)
+{
+	return std::max(std::max(start - t, t - end), 0.0f);
 }
 
-// Returns whether the midpoint of the cell is inside the glyph for each cell.
-// The returned vector is always size gridWidth*gridHeight.
-static std::vector<char> find_cells_mids_inside(
+// Finds t where a monotone piece of bezier b crosses the line y=Y, which
+// must be within the piece's y range.
+static float mono_curve_crossing(const Bezier2 &b, const VGridMonoCurve &piece, float Y)
+{
+	float A = b.e0.y, B = b.c.y, C = b.e1.y;
+	float a = A - 2*B + C;
+	float t;
+	if (almost_zero(a)) {
+		// Nearly a line, and a single piece with A != C
+		t = (Y - A) / (C - A);
+	} else {
+		// The solutions of IntersectHorz(). Rounding may leave either one
+		// just outside of the piece, so take the nearer.
+		float sqrtTerm = std::sqrt(std::max(Y*a + B*B - A*C, 0.0f));
+		float t0 = (A - B + sqrtTerm) / a;
+		float t1 = (A - B - sqrtTerm) / a;
+		t = range_distance(t0, piece.tStart, piece.tEnd)
+			<= range_distance(t1, piece.tStart, piece.tEnd) ? t0 : t1;
+	}
+	return clamp(t, piece.tStart, piece.tEnd);
+}
+
+// Sweeps the horizontal lines y=rowLines[i] (in increasing order) across the
+// glyph, and calls fillSpan(row, start, end) for every span of each line
+// that has a nonzero winding number around it, meaning it's inside the
+// glyph. Unlike even-odd, the nonzero rule also treats the overlap of two
+// contours as inside. Span ends are x coordinates multiplied by xScale.
+template<typename FillSpan>
+static void sweep_winding_spans(
+	std::vector<Bezier2> &beziers,
+	const std::vector<float> &rowLines,
+	float xScale,
+	FillSpan fillSpan)
+{
+	VGridScratch &scratch = threadScratch;
+	int rows = rowLines.size();
+
+	// Split the curves into y-monotone pieces and find the rows each
+	// crosses. Flat pieces never cross a line.
+	std::vector<VGridMonoCurve> &monoCurves = scratch.monoCurves;
+	monoCurves.clear();
+	auto addPiece = [&](uint32_t bezier, float t0, float y0, float t1, float y1) {
+		if (y0 == y1) {
+			return;
+		}
+		VGridMonoCurve piece;
+		piece.yMin = std::min(y0, y1);
+		piece.yMax = std::max(y0, y1);
+		piece.tStart = t0;
+		piece.tEnd = t1;
+		piece.dir = y1 > y0 ? 1 : -1;
+		piece.firstRow = std::lower_bound(rowLines.begin(), rowLines.end(), piece.yMin) - rowLines.begin();
+		piece.endRow = std::lower_bound(rowLines.begin(), rowLines.end(), piece.yMax) - rowLines.begin();
+		piece.bezier = bezier;
+		if (piece.firstRow < piece.endRow) {
+			monoCurves.push_back(piece);
+		}
+	};
+	for (size_t i = 0; i < beziers.size(); i++) {
+		const Bezier2 &b = beziers[i];
+		float a = b.e0.y - 2*b.c.y + b.e1.y;
+		float tExtreme = almost_zero(a) ? -1 : (b.e0.y - b.c.y) / a;
+		if (tExtreme > 0 && tExtreme < 1) {
+			float yExtreme = y_at(b, tExtreme);
+			addPiece(i, 0, b.e0.y, tExtreme, yExtreme);
+			addPiece(i, tExtreme, yExtreme, 1, b.e1.y);
+		} else {
+			addPiece(i, 0, b.e0.y, 1, b.e1.y);
+		}
+	}
+
+	// Bucket the pieces by their first row (a counting sort)
+	std::vector<uint32_t> &rowOffsets = scratch.rowOffsets;
+	rowOffsets.assign(rows + 1, 0);
+	for (const VGridMonoCurve &piece : monoCurves) {
+		rowOffsets[piece.firstRow + 1]++;
+	}
+	for (int y = 0; y < rows; y++) {
+		rowOffsets[y + 1] += rowOffsets[y];
+	}
+	std::vector<VGridMonoCurve> &sorted = scratch.sortedMonoCurves;
+	sorted.resize(monoCurves.size());
+	for (const VGridMonoCurve &piece : monoCurves) {
+		sorted[rowOffsets[piece.firstRow]++] = piece;
+	}
+	// rowOffsets[y] is now the end of row y, and so the start of row y+1
+
+	// Sweep down the rows, keeping the pieces that cross the current row
+	// and tracking the winding number of the outline along it
+	std::vector<uint32_t> &active = scratch.activeCurves;
+	std::vector<std::pair<float, int>> &crossings = scratch.crossings;
+	active.clear();
+	for (int y = 0; y < rows; y++) {
+		uint32_t rowStart = y == 0 ? 0 : rowOffsets[y - 1];
+		for (uint32_t i = rowStart; i < rowOffsets[y]; i++) {
+			active.push_back(i);
+		}
+		active.erase(std::remove_if(active.begin(), active.end(),
+			[&](uint32_t i) { return sorted[i].endRow <= y; }),
+			active.end());
+
+		crossings.clear();
+		for (uint32_t i : active) {
+			const VGridMonoCurve &piece = sorted[i];
+			float t = mono_curve_crossing(beziers[piece.bezier], piece, rowLines[y]);
+			float x = x_at(beziers[piece.bezier], t) * xScale;
+			crossings.push_back(std::make_pair(x, piece.dir));
+		}
+		std::sort(crossings.begin(), crossings.end());
+
+		int winding = 0;
+		float start = 0;
+		for (const std::pair<float, int> &crossing : crossings) {
+			if (winding != 0) {
+				fillSpan(y, start, crossing.first);
+			}
+			winding += crossing.second;
+			start = crossing.first;
+		}
+	}
+}
+
+// Finds whether the midpoint of the cell is inside the glyph for each cell
+// and stores them in grid.cellMids.
+static void find_cells_mids_inside(
+	VGrid &grid,
 	std::vector<Bezier2> &beziers,
 	Vec2 glyphSize,
 	int gridWidth,
 	int gridHeight)
 {
-	std::vector<char> cellMids;
-	cellMids.resize(gridWidth * gridHeight);
+	std::vector<char> &cellMids = grid.cellMids;
+	cellMids.assign(gridWidth * gridHeight, false);
+	VGridScratch &scratch = threadScratch;
 
-	// Find whether the center of each cell is inside the glyph
+	// Horizontal midpoint line of each row of cells
+	std::vector<float> &rowMids = scratch.horzLines;
+	rowMids.resize(gridHeight);
 	for (int y = 0; y < gridHeight; y++) {
-		// Find all intersections with cells horizontal midpoint line
-		// and store them sorted from left to right
-		std::set<float> intersections;
 		float yMid = y + 0.5;
-		for (size_t i = 0; i < beziers.size(); i++) {
-			float intX[2];
-			int numInt = beziers[i].IntersectHorz(
-				yMid * glyphSize.h / gridHeight,
-				intX);
-			for (int j = 0; j < numInt; j++) {
-				float x = intX[j] * gridWidth / glyphSize.w;
-				intersections.insert(x);
+		rowMids[y] = yMid * glyphSize.h / gridHeight;
+	}
+
+	// The midpoint of every cell between the start and end of a span,
+	// rounded to the nearest int, is inside the glyph.
+	sweep_winding_spans(beziers, rowMids, gridWidth / glyphSize.w,
+		[&](int y, float start, float end) {
+			int startCell = clamp((int)std::round(start), 0, gridWidth);
+			int endCell = clamp((int)std::round(end), 0, gridWidth);
+			for (int x = startCell; x < endCell; x++) {
+				cellMids[(y * gridWidth) + x] = true;
 			}
-		}
+		});
+}
 
-		// Traverse intersections (whole grid row, left to right).
-		// Every 2nd crossing represents exiting an "inside" region.
-		// All properly formed glyphs should have an even number of
-		// crossings.
-		bool outside = false;
-		float start = 0;
-		for (auto it = intersections.begin(); it != intersections.end(); it++) {
-			float end = *it;
-
-			// Upon exiting, the midpoint of every cell between
-			// start and end, rounded to the nearest int, is
-			// inside the glyph.
-			if (outside) {
-				int startCell = clamp((int)std::round(start), 0, gridWidth);
-				int endCell = clamp((int)std::round(end), 0, gridWidth);
-				for (int x = startCell; x < endCell; x++) {
-					cellMids[(y * gridWidth) + x] = true;
-				}
+// Finds how much of each texel of the coverage map is inside the glyph and
+// stores it in grid.coverage. Each texel is sampled with
+// kVGridCoverageSamples horizontal lines, and the inside part of each line
+// is measured exactly.
+static void find_coverage(
+	VGrid &grid,
+	std::vector<Bezier2> &beziers,
+	Vec2 glyphSize)
+{
+	static const int kSize = kVGridCoverageSize;
+	VGridScratch &scratch = threadScratch;
+
+	std::vector<float> &lines = scratch.horzLines;
+	lines.resize(kSize * kVGridCoverageSamples);
+	for (size_t i = 0; i < lines.size(); i++) {
+		lines[i] = (i + 0.5f) * glyphSize.h / lines.size();
+	}
+
+	// Inside length of each texel, in texels, summed over its lines
+	std::vector<float> &sums = scratch.coverageSums;
+	sums.assign(kSize * kSize, 0);
+	sweep_winding_spans(beziers, lines, kSize / glyphSize.w,
+		[&](int line, float start, float end) {
+			float *row = &sums[(line / kVGridCoverageSamples) * kSize];
+			start = clamp(start, 0.0f, (float)kSize);
+			end = clamp(end, 0.0f, (float)kSize);
+			for (int x = (int)start; x < kSize && x < end; x++) {
+				row[x] += std::min(end, x + 1.0f) - std::max(start, (float)x);
 			}
+		});
 
-			outside = !outside;
-			start = end;
-		}
+	grid.coverage.resize(kSize * kSize);
+	for (size_t i = 0; i < sums.size(); i++) {
+		float c = sums[i] / kVGridCoverageSamples;
+		grid.coverage[i] = (uint8_t)std::round(clamp(c, 0.0f, 1.0f) * 255);
 	}
+}
 
-	return cellMids;
+VGrid::VGrid()
+: width(0), height(0)
+{
 }
 
 VGrid::VGrid(
@@ -134,33 +399,76 @@ VGrid::VGrid(
 	Vec2 glyphSize,
 	int gridWidth,
 	int gridHeight)
-: width(gridWidth), height(gridHeight)
 {
-	this->cellBeziers = find_cells_intersections(
-		beziers, glyphSize, gridWidth, gridHeight);
-	this->cellMids = find_cells_mids_inside(
-		beziers, glyphSize, gridWidth, gridHeight);
+	this->Build(beziers, glyphSize, gridWidth, gridHeight);
 }
 
-// Each bezier index is represented as one byte in the grid cell,
+void VGrid::Build(
+	std::vector<Bezier2> &beziers,
+	Vec2 glyphSize,
+	int gridWidth,
+	int gridHeight)
+{
+	this->width = gridWidth;
+	this->height = gridHeight;
+	find_cells_intersections(
+		*this, beziers, glyphSize, gridWidth, gridHeight);
+	find_cells_mids_inside(
+		*this, beziers, glyphSize, gridWidth, gridHeight);
+	find_coverage(*this, beziers, glyphSize);
+}
+
+size_t VGrid::MaxCellBezierCount() const
+{
+	size_t count = 0;
+	for (int i = 0; i < this->width * this->height; i++) {
+		count = std::max(count, this->CellBezierCount(i));
+	}
+	return count;
+}
+
+// Overflow cells keep two beziers in the atlas texel, and their overflow
+// list holds the rest plus a terminating 0.
+static const size_t kOverflowInlineBeziers = 2;
+
+static size_t overflow_list_pixels(size_t nbeziers)
+{
+	return (nbeziers - kOverflowInlineBeziers + kOverflowIndicesPerPixel)
+		/ kOverflowIndicesPerPixel;
+}
+
+size_t VGrid::OverflowPixelCount(uint8_t depth) const
+{
+	size_t count = 0;
+	for (int i = 0; i < this->width * this->height; i++) {
+		size_t nbeziers = this->CellBezierCount(i);
+		if (nbeziers > depth) {
+			count += overflow_list_pixels(nbeziers);
+		}
+	}
+	return count;
+}
+
+// Each bezier index is represented as 16 bits in the grid cell,
 // and values 0 and 1 are reserved for special meaning.
-// This leaves a limit of 254 beziers per grid/glyph.
+// This leaves a limit of kMaxBeziersPerGrid beziers per grid/glyph.
 // More on the meaning of values 1 and 0 in the VGridAtlas struct
 // definition and in write_vgrid_cell_to_buffer().
-static const uint8_t kBezierIndexUnused = 0;
-static const uint8_t kBezierIndexSortMeta = 1;
-static const uint8_t kBezierIndexFirstReal = 2;
-//static const uint8_t kMaxBeziersPerGrid = 256 - kBezierIndexFirstReal;
+static const uint16_t kBezierIndexUnused = 0;
+static const uint16_t kBezierIndexSortMeta = 1;
+static const uint16_t kBezierIndexOverflow = 1; // Only ever the last index
+static const uint16_t kBezierIndexFirstReal = 2;
 
-// Writes the data of a single vgrid cell into a texel. At most `depth` bytes
-// will be written, even if there are more beziers.
+// Writes the data of a single vgrid cell into a texel. At most `depth`
+// indices will be written, even if there are more beziers.
 static void write_vgrid_cell_to_buffer(
 	VGrid &grid,
 	size_t cellIdx, // which cell in `grid` to write
-	uint8_t *data, // texel buffer, `depth` bytes long
+	uint16_t *data, // texel buffer, `depth` indices long
 	uint8_t depth)
 {
-	std::set<size_t> *beziers = &grid.cellBeziers[cellIdx];
+	size_t nbeziers = grid.CellBezierCount(cellIdx);
+	const uint32_t *beziers = grid.CellBeziers(cellIdx);
 
 	// Clear texel
 	for (uint8_t i = 0; i < depth; i++) {
@@ -168,16 +476,11 @@ static void write_vgrid_cell_to_buffer(
 	}
 
 	// Write out bezier indices to atlas texel
-	size_t i = 0;
-	size_t nbeziers = std::min(beziers->size(), (size_t)depth);
-	auto end = beziers->begin();
-	std::advance(end, nbeziers);
-	for (auto it = beziers->begin(); it != end; it++) {
-		// TODO: The uint8_t cast wont overflow because the bezier
+	for (size_t i = 0; i < std::min(nbeziers, (size_t)depth); i++) {
+		// TODO: The uint16_t cast wont overflow because the bezier
 		// limit is checked when loading the glyph. But try to encode
 		// that info into the data types so no cast is needed.
-		data[i] = (uint8_t)(*it) + kBezierIndexFirstReal;
-		i++;
+		data[i] = (uint16_t)beziers[i] + kBezierIndexFirstReal;
 	}
 
 	bool midInside = grid.cellMids[cellIdx];
@@ -187,56 +490,99 @@ static void write_vgrid_cell_to_buffer(
 	// adjusting the order of the bezier indices. In this case, the
 	// midInside bit is 1 if data[0] > data[1].
 	// Note that the bezier indices are already sorted from smallest to
-	// largest because of std::set.
+	// largest (see VGrid::cellBeziers).
 	if (midInside) {
 		// If cell is empty, there's nothing to swap (both values 0).
 		// So a fake "sort meta" value must be used to make data[0]
 		// be larger. This special value is treated as 0 by the shader.
-		if (beziers->size() == 0) {
+		if (nbeziers == 0) {
 			data[0] = kBezierIndexSortMeta;
 		}
 		// If there's just one bezier, data[0] is always > data[1] so
 		// nothing needs to be done. Otherwise, swap data[0] and [1].
-		else if (beziers->size() != 1) {
-			uint8_t tmp = data[0];
+		else if (nbeziers != 1) {
+			uint16_t tmp = data[0];
 			data[0] = data[1];
 			data[1] = tmp;
 		}
 	// If midInside is 0, make sure that data[0] <= data[1]. This can only
 	// not happen if there is only 1 bezier in this cell, for the reason
 	// described above. Solve by moving the only bezier into data[1].
-	} else if (beziers->size() == 1) {
+	} else if (nbeziers == 1) {
 		data[1] = data[0];
 		data[0] = kBezierIndexUnused;
 	}
 }
 
+// Writes a cell with more than `depth` beziers. Its first two beziers go in
+// the texel, ordered to encode midInside like any other cell, followed by
+// the pixel offset of its overflow list and kBezierIndexOverflow. No other
+// cell ends with that value, since kBezierIndexSortMeta is only ever written
+// to data[0]. The rest of the beziers are written to `list`, which is padded
+// with kBezierIndexUnused to a whole number of pixels.
+static void write_vgrid_overflow_cell_to_buffer(
+	VGrid &grid,
+	size_t cellIdx,
+	uint16_t *data,
+	uint16_t listOffset, // pixel offset of `list` in the overflow lists
+	uint16_t *list)
+{
+	size_t nbeziers = grid.CellBezierCount(cellIdx);
+	const uint32_t *beziers = grid.CellBeziers(cellIdx);
+
+	data[0] = (uint16_t)beziers[0] + kBezierIndexFirstReal;
+	data[1] = (uint16_t)beziers[1] + kBezierIndexFirstReal;
+	if (grid.cellMids[cellIdx]) {
+		std::swap(data[0], data[1]);
+	}
+	data[2] = listOffset;
+	data[3] = kBezierIndexOverflow;
+
+	size_t listSize = overflow_list_pixels(nbeziers) * kOverflowIndicesPerPixel;
+	for (size_t i = 0; i < listSize; i++) {
+		size_t j = i + kOverflowInlineBeziers;
+		list[i] = j < nbeziers
+			? (uint16_t)beziers[j] + kBezierIndexFirstReal
+			: kBezierIndexUnused;
+	}
+}
+
 // Writes an entire vgrid into the atlas, where the bottom-left of the vgrid
 // will be written at (atX, atY). It will take up (grid->width, grid->height)
 // atlas texels and overwrite all contents in that rectangle.
-void VGridAtlas::WriteVGridAt(VGrid &grid, uint16_t atX, uint16_t atY)
+size_t VGridAtlas::WriteVGridAt(VGrid &grid, uint16_t atX, uint16_t atY, uint16_t *overflow)
 {
 	// TODO: Write an assert() that can take a format message so the
 	// variables can be printed.
 	assert((atX + grid.width) <= this->width);
 	assert((atY + grid.height) <= this->height);
 
+	size_t overflowPos = 0; // pixels
+	size_t truncated = 0;
 	for (uint16_t y = 0; y < grid.height; y++) {
 		for (uint16_t x = 0; x < grid.width; x++) {
 			size_t cellIdx = xy2i(x, y, grid.width);
 			size_t atlasIdx = xy2i(atX+x, atY+y, this->width) * this->depth;
+			uint16_t *data = &this->data[atlasIdx];
+
+			size_t nbeziers = grid.CellBezierCount(cellIdx);
+			if (nbeziers <= this->depth) {
+				write_vgrid_cell_to_buffer(grid, cellIdx, data, this->depth);
+				continue;
+			}
 
-			std::set<size_t> *beziers = &grid.cellBeziers[cellIdx];
-			if (beziers->size() > this->depth) {
-				std::cerr << "WARN: Too many beziers in one grid cell ("
-					<< "max: " << this->depth
-					<< ", need: " << beziers->size()
-					<< ", x: " << x
-					<< ", y: " << y << ")\n";
+			size_t listPixels = overflow_list_pixels(nbeziers);
+			if (overflow && overflowPos + listPixels <= kMaxOverflowPixels) {
+				write_vgrid_overflow_cell_to_buffer(grid, cellIdx, data,
+					overflowPos,
+					overflow + overflowPos*kOverflowIndicesPerPixel);
+				overflowPos += listPixels;
+				continue;
 			}
 
-			uint8_t *data = &this->data[atlasIdx];
+			truncated++;
 			write_vgrid_cell_to_buffer(grid, cellIdx, data, this->depth);
 		}
 	}
+	return truncated;
 }
@@ -1,42 +1,98 @@
 #pragma once
 #include "types.hpp"
+#include <stddef.h>
 #include <vector>
-#include <set>
+
+// Size of VGrid::coverage, and the number of lines it samples per row of
+// texels. Must match kCoverageSize in the glyph shader.
+static const int kVGridCoverageSize = 8;
+static const int kVGridCoverageSamples = 4;
 
 // Reprents a grid that is "overlayed" on top of a glyph, storing some
 // properties about each grid cell. The grid's origin is bottom-left
 // and is stored in row-major order.
 struct VGrid {
-	// For each cell, a set of bezier curves (indices referring to
-	// input bezier array) that pass through that cell.
-	std::vector<std::set<size_t>> cellBeziers;
+	// The bezier curves (indices referring to input bezier array) that
+	// pass through each cell, stored compressed-row style: the curves of
+	// cell i are cellBeziers[cellOffsets[i]] up to (but not including)
+	// cellBeziers[cellOffsets[i+1]], sorted from smallest to largest.
+	std::vector<uint32_t> cellOffsets;
+	std::vector<uint32_t> cellBeziers;
 
 	// For each cell, a boolean indicating whether the cell's midpoint is
 	// inside the glpyh (true) or outside (false).
 	std::vector<char> cellMids;
 
-	// Size of the grid. Both arrays above are size width*height.
+	// A small map of how much of the glyph is covered, kVGridCoverageSize
+	// texels square, row-major from the bottom-left of the glyph, with 255
+	// for fully inside. Used instead of the grid to draw glyphs that are
+	// only a few pixels big.
+	std::vector<uint8_t> coverage;
+
+	// Size of the grid. cellMids is size width*height, cellOffsets is one
+	// larger.
 	int width;
 	int height;
 
+	VGrid();
 	VGrid(
 		std::vector<Bezier2> &beziers,
 		Vec2 glyphSize,
 		int gridWidth,
 		int gridHeight);
+
+	// Rebuilds the grid for a new glyph. Storage is reused, so building
+	// many grids with one VGrid doesn't allocate once it has grown to fit.
+	void Build(
+		std::vector<Bezier2> &beziers,
+		Vec2 glyphSize,
+		int gridWidth,
+		int gridHeight);
+
+	inline size_t CellBezierCount(size_t cellIdx) const {
+		return cellOffsets[cellIdx + 1] - cellOffsets[cellIdx];
+	}
+	inline const uint32_t * CellBeziers(size_t cellIdx) const {
+		return cellBeziers.data() + cellOffsets[cellIdx];
+	}
+
+	// The largest number of beziers in any one cell.
+	size_t MaxCellBezierCount() const;
+
+	// Number of glyph data pixels needed for the overflow lists of the
+	// cells that have more than `depth` beziers.
+	size_t OverflowPixelCount(uint8_t depth) const;
 };
 
+// Bezier indices are 16 bits, and two values are reserved (see
+// write_vgrid_cell_to_buffer()).
+static const size_t kMaxBeziersPerGrid = 65536 - 2;
+
+// Overflow lists are addressed by a 16-bit offset (see VGridAtlas), so each
+// glyph can have at most this many pixels of them. Each pixel of glyph data
+// holds two indices.
+static const size_t kMaxOverflowPixels = 65536;
+static const size_t kOverflowIndicesPerPixel = 2;
+
 struct VGridAtlas {
 	// 2D buffer, size is width*height, row-major, starts at bottom-left
-	uint8_t *data;
+	uint16_t *data;
 
 	uint16_t width;
 	uint16_t height;
 
-	// Bytes per pixel, aka. how many bezier curves are allowed per grid
-	// cell. This should probably always be 4, since that's the limit of
-	// bytes per pixel that OpenGL supports (GL_RGBA8).
+	// Indices per pixel, aka. how many bezier curves fit in a grid cell.
+	// This should probably always be 4, since that's the limit of channels
+	// per pixel that OpenGL supports (GL_RGBA16UI).
 	uint8_t depth;
 
-	void WriteVGridAt(VGrid &grid, uint16_t atX, uint16_t atY);
+	// Cells with more than `depth` beziers keep the first two in the atlas
+	// and mark the texel as an overflow cell by setting its last index to
+	// 1. Its third index is then the pixel offset of the cell's overflow
+	// list in `overflow`, which holds the remaining bezier indices, ending
+	// with a 0. `overflow` must have room for
+	// grid.OverflowPixelCount(depth) pixels, and may be null if that is 0.
+	// Returns the number of cells that still had too many beziers, which
+	// only get their first `depth`.
+	size_t WriteVGridAt(VGrid &grid, uint16_t atX, uint16_t atY, uint16_t *overflow);
 };